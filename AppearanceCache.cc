@@ -0,0 +1,92 @@
+#include "AppearanceCache.hh"
+#include "Hash.hh"
+
+#include <qpdf/Buffer.hh>
+
+AppearanceCache::AppearanceCache(bool retain_keys)
+    : retain_keys(retain_keys),
+      duplicate_count(0),
+      bytes_saved(0)
+{
+}
+
+//Every dictionary entry, as /Group, /OC, /Ref or /Metadata change how or
+//whether the stream renders too, then the raw data. /Length follows from
+//the data, /Name is an obsolete label and null entries count as absent
+std::string AppearanceCache::contentKey(QPDFObjectHandle stream, size_t &data_size)
+{
+    std::map<std::string, QPDFObjectHandle> entries = stream.getDict().getDictAsMap();
+    std::string key;
+    for(std::map<std::string, QPDFObjectHandle>::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if(it->first == "/Length" || it->first == "/Name" || it->second.isNull())
+            continue;
+        key.append(it->first);
+        key.append(" ");
+        key.append(it->second.unparseResolved());
+        key.append("\n");
+    }
+
+    PointerHolder<Buffer> data = stream.getRawStreamData();
+    key.append(reinterpret_cast<char const*>(data->getBuffer()), data->getSize());
+    data_size = data->getSize();
+    return key;
+}
+
+QPDFObjectHandle AppearanceCache::canonical(QPDFObjectHandle appearance)
+{
+    //only indirect streams can be shared between pages
+    if(!appearance.isStream() || !appearance.isIndirect())
+        return appearance;
+
+    QPDFObjGen og = appearance.getObjGen();
+    std::map<QPDFObjGen, QPDFObjectHandle>::iterator seen = resolved.find(og);
+    if(seen != resolved.end())
+        return seen->second;
+
+    size_t data_size = 0;
+    std::string key = contentKey(appearance, data_size);
+    std::vector<Entry> &bucket = by_hash[hash64(key)];
+
+    QPDFObjectHandle result = appearance;
+    for(std::vector<Entry>::iterator entry = bucket.begin(); entry != bucket.end(); ++entry)
+    {
+        //without retained keys a hash match is confirmed by reading
+        //the earlier stream again
+        std::string recomputed;
+        if(!retain_keys)
+        {
+            size_t ignored = 0;
+            recomputed = contentKey(entry->stream, ignored);
+        }
+        if((retain_keys ? entry->key : recomputed) == key)
+        {
+            result = entry->stream;
+            duplicate_count++;
+            bytes_saved += data_size;
+            break;
+        }
+    }
+
+    if(result.getObjGen() == og)
+    {
+        Entry entry;
+        if(retain_keys)
+            entry.key = key;
+        entry.stream = appearance;
+        bucket.push_back(entry);
+    }
+
+    resolved[og] = result;
+    return result;
+}
+
+size_t AppearanceCache::duplicates() const
+{
+    return duplicate_count;
+}
+
+long long AppearanceCache::bytesSaved() const
+{
+    return bytes_saved;
+}
@@ -0,0 +1,45 @@
+#ifndef APPEARANCECACHE_HH
+#define APPEARANCECACHE_HH
+
+#include <qpdf/QPDFObjectHandle.hh>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//Per-document cache that collapses appearance streams with identical
+//contents onto one canonical XObject. Two streams are identical if their
+//raw data and all dictionary entries but /Length and /Name match
+class AppearanceCache
+{
+public:
+    //With retain_keys false only hashes are kept, and candidates are
+    //read again to be compared. Slower, but memory does not grow with
+    //the size of the appearances
+    AppearanceCache(bool retain_keys = true);
+
+    //Return the stream all copies of appearance should use. This is
+    //appearance itself the first time its contents are seen
+    QPDFObjectHandle canonical(QPDFObjectHandle appearance);
+
+    size_t duplicates() const;      //distinct streams replaced by another
+    long long bytesSaved() const;   //raw stream bytes no longer written
+
+private:
+    struct Entry
+    {
+        std::string key;
+        QPDFObjectHandle stream;
+    };
+
+    std::string contentKey(QPDFObjectHandle stream, size_t &data_size);
+
+    bool retain_keys;
+    std::map<QPDFObjGen, QPDFObjectHandle> resolved;
+    std::unordered_map<unsigned long long, std::vector<Entry> > by_hash;
+    size_t duplicate_count;
+    long long bytes_saved;
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "AppearanceGeometry.hh"
+
+#include <set>
+#include <string>
+
+AppearanceGeometry::AppearanceGeometry()
+    : translate(true),
+      scale(false)
+{
+    for(int i = 0; i < 4; ++i)
+        bbox[i] = 0;
+}
+
+AppearanceGeometryCache::AppearanceGeometryCache()
+    : analysis_count(0),
+      lookup_count(0)
+{
+}
+
+//The dictionary of a stream, or the object itself if it is a dictionary
+static QPDFObjectHandle dictionaryOf(QPDFObjectHandle object)
+{
+    if(object.isStream())
+        return object.getDict();
+    return object;
+}
+
+AppearanceGeometry const& AppearanceGeometryCache::lookup(QPDFObjectHandle appearance)
+{
+    lookup_count++;
+    if(!appearance.isIndirect())
+    {
+        direct = analyse(appearance);
+        return direct;
+    }
+
+    std::map<QPDFObjGen, AppearanceGeometry>::iterator it = by_object.find(appearance.getObjGen());
+    if(it == by_object.end())
+        it = by_object.insert(std::make_pair(appearance.getObjGen(), analyse(appearance))).first;
+    return it->second;
+}
+
+size_t AppearanceGeometryCache::analyses() const
+{
+    return analysis_count;
+}
+
+size_t AppearanceGeometryCache::lookups() const
+{
+    return lookup_count;
+}
+
+AppearanceGeometry AppearanceGeometryCache::analyse(QPDFObjectHandle appearance)
+{
+    analysis_count++;
+    AppearanceGeometry geometry;
+    QPDFObjectHandle dict = dictionaryOf(appearance);
+
+    //without /Resources /XObject the appearance is drawn as it is, so it
+    //is only moved to the annotation
+    QPDFObjectHandle resources = dict.getKey("/Resources");
+    if(!resources.isDictionary())
+        return geometry;
+    QPDFObjectHandle xobjects = resources.getKey("/XObject");
+    if(!xobjects.isDictionary())
+        return geometry;
+    std::set<std::string> names = xobjects.getKeys();
+    if(names.empty())
+        return geometry;
+
+    //If there are xobjects present, then scaling 'might' be required.
+    //A nested /BBox that does not start at (0,0) automatically takes
+    //care of the translation
+    geometry.scale = true;
+    geometry.translate = false;
+    for(std::set<std::string>::const_iterator name = names.begin(); name != names.end(); ++name)
+    {
+        QPDFObjectHandle nested = xobjects.getKey(*name);
+        if(!nested.isStream() && !nested.isDictionary())
+            continue;
+        QPDFObjectHandle nested_bbox = dictionaryOf(nested).getKey("/BBox");
+        if(!nested_bbox.isArray())
+            continue;
+        if(nested_bbox.getArrayItem(0).getNumericValue() == 0 &&
+           nested_bbox.getArrayItem(1).getNumericValue() == 0)
+        {
+            geometry.translate = true;
+            break;
+        }
+    }
+
+    QPDFObjectHandle bbox = dict.getKey("/BBox");
+    for(int i = 0; i < 4; ++i)
+        geometry.bbox[i] = bbox.getArrayItem(i).getNumericValue();
+    return geometry;
+}
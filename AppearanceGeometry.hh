@@ -0,0 +1,44 @@
+#ifndef APPEARANCEGEOMETRY_HH
+#define APPEARANCEGEOMETRY_HH
+
+#include <qpdf/QPDFObjectHandle.hh>
+
+#include <map>
+
+//What placing an appearance on the page needs to know about it. The
+//appearance's own /Matrix is applied by Do and does not show up here
+struct AppearanceGeometry
+{
+    AppearanceGeometry();
+
+    bool translate;     //move the origin to the lower left of /Rect
+    bool scale;         //stretch /BBox onto /Rect
+    double bbox[4];     //the appearance's /BBox, read when scale is set
+};
+
+//Geometry of the appearances of a document, each stream analysed once
+//however many widgets share it. Radio groups and checkboxes typically
+//point hundreds of widgets at a handful of streams
+class AppearanceGeometryCache
+{
+public:
+    AppearanceGeometryCache();
+
+    //Geometry of a normal appearance stream or dictionary. Indirect
+    //objects are cached by object ID, direct ones are analysed each time.
+    //The reference stays valid until the next lookup
+    AppearanceGeometry const& lookup(QPDFObjectHandle appearance);
+
+    size_t analyses() const;    //appearances actually analysed
+    size_t lookups() const;
+
+private:
+    AppearanceGeometry analyse(QPDFObjectHandle appearance);
+
+    std::map<QPDFObjGen, AppearanceGeometry> by_object;
+    AppearanceGeometry direct;
+    size_t analysis_count;
+    size_t lookup_count;
+};
+
+#endif
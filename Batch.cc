@@ -0,0 +1,226 @@
+#include "Batch.hh"
+#include "Log.hh"
+#include "Parallel.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+BatchJob::BatchJob()
+    : seconds(0)
+{
+}
+
+static std::string baseName(std::string const& path)
+{
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+//Absolute path of a file with symbolic links resolved, for files that
+//do not exist yet through their directory, so different spellings of
+//one file compare equal
+static std::string canonicalPath(std::string const& path)
+{
+    char resolved[PATH_MAX];
+    if(realpath(path.c_str(), resolved) != NULL)
+        return resolved;
+
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash == 0 ? 1 : slash);
+    if(realpath(dir.c_str(), resolved) != NULL)
+        return std::string(resolved) + "/" + baseName(path);
+    return path;
+}
+
+static bool isDirectory(std::string const& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static std::vector<std::string> directoryPdfs(std::string const& dir)
+{
+    DIR* d = opendir(dir.c_str());
+    if(d == NULL)
+        throw std::runtime_error("cannot read directory " + dir + ": " + strerror(errno));
+
+    std::vector<std::string> files;
+    while(struct dirent* entry = readdir(d))
+    {
+        std::string name = entry->d_name;
+        if(name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".pdf") == 0)
+            files.push_back(dir + "/" + name);
+    }
+    closedir(d);
+
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+std::vector<BatchJob> readBatch(std::string const& source, std::string const& output_dir)
+{
+    std::vector<BatchJob> jobs;
+
+    if(isDirectory(source))
+    {
+        std::vector<std::string> files = directoryPdfs(source);
+        for(size_t i = 0; i < files.size(); ++i)
+        {
+            jobs.push_back(BatchJob());
+            jobs.back().input = files[i];
+        }
+    }
+    else
+    {
+        std::ifstream manifest(source.c_str());
+        if(!manifest)
+            throw std::runtime_error("cannot read manifest " + source + ": " + strerror(errno));
+
+        std::string line;
+        while(std::getline(manifest, line))
+        {
+            if(!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if(line.empty() || line[0] == '#')
+                continue;
+
+            jobs.push_back(BatchJob());
+            size_t tab = line.find('\t');
+            jobs.back().input = line.substr(0, tab);
+            if(tab != std::string::npos)
+                jobs.back().output = line.substr(tab + 1);
+        }
+    }
+
+    for(size_t i = 0; i < jobs.size(); ++i)
+    {
+        if(jobs[i].output.empty())
+            jobs[i].output = output_dir + "/" + baseName(jobs[i].input);
+    }
+
+    //concurrent jobs must not write over each other, and an output
+    //truncated over an input would pull the document out from under its
+    //reader
+    std::map<std::string, size_t> inputs;
+    for(size_t i = 0; i < jobs.size(); ++i)
+        inputs[canonicalPath(jobs[i].input)] = i;
+    std::map<std::string, size_t> outputs;
+    for(size_t i = 0; i < jobs.size(); ++i)
+    {
+        std::string output = canonicalPath(jobs[i].output);
+        if(inputs.count(output) != 0 && inputs[output] == i)
+            throw std::runtime_error("output of " + jobs[i].input + " would overwrite it");
+        if(inputs.count(output) != 0)
+            throw std::runtime_error("output " + jobs[i].output + " of " + jobs[i].input +
+                                     " would overwrite the input " + jobs[inputs[output]].input);
+        if(outputs.count(output) != 0)
+            throw std::runtime_error("output " + jobs[i].output + " of " + jobs[i].input +
+                                     " is also the output of " + jobs[outputs[output]].input);
+        outputs[output] = i;
+    }
+    return jobs;
+}
+
+//Start reading a file into the page cache without waiting for it
+static void prefetch(std::string const& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+void runBatch(std::vector<BatchJob> &jobs, FlattenOptions const& options, unsigned int workers)
+{
+    workers = resolveJobs(workers);
+
+    //the documents are the unit of parallelism, pages stay on one thread
+    FlattenOptions job_options = options;
+    job_options.jobs = 1;
+    FormFlattener flattener(job_options);
+
+    //the first document of every queue is read ahead before starting
+    for(size_t i = 0; i < jobs.size() && i < workers; ++i)
+        prefetch(jobs[i].input);
+
+    stealingFor(jobs.size(), workers, [&](size_t i) {
+        //queues are dealt round robin, so i + workers is usually this
+        //thread's next document
+        if(i + workers < jobs.size())
+            prefetch(jobs[i + workers].input);
+
+        TraceSpan span(options.metrics, "document");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        BatchJob &job = jobs[i];
+
+        //written beside the output and renamed over it once complete, so
+        //a failed job leaves no truncated document behind
+        std::string temporary = job.output + ".part";
+        int output = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(output < 0)
+        {
+            job.result.error = "cannot create " + temporary + ": " + strerror(errno);
+        }
+        else
+        {
+            job.result = flattener.flattenFileToFd(job.input.c_str(), output);
+            if(close(output) != 0 && job.result.success)
+            {
+                job.result.success = false;
+                job.result.error = "cannot write " + job.output + ": " + strerror(errno);
+            }
+            if(job.result.success && rename(temporary.c_str(), job.output.c_str()) != 0)
+            {
+                job.result.success = false;
+                job.result.error = "cannot write " + job.output + ": " + strerror(errno);
+            }
+            if(!job.result.success)
+                unlink(temporary.c_str());
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        job.seconds = elapsed.count();
+        FLATTEN_LOG(options.log, job.result.success ? FLATTEN_LOG_DEBUG : FLATTEN_LOG_ERROR,
+                    job.input << ": " << (job.result.success ? "flattened" : job.result.error));
+    });
+}
+
+//Tabs and line breaks would break the columns of the summary
+static std::string summaryField(std::string text)
+{
+    std::replace(text.begin(), text.end(), '\t', ' ');
+    std::replace(text.begin(), text.end(), '\n', ' ');
+    std::replace(text.begin(), text.end(), '\r', ' ');
+    return text;
+}
+
+void writeBatchSummary(std::ostream &out, std::vector<BatchJob> const& jobs)
+{
+    out << "status\tinput\toutput\twidgets\tbytes\tms\terror\n";
+    for(size_t i = 0; i < jobs.size(); ++i)
+    {
+        BatchJob const& job = jobs[i];
+        char const* status = !job.result.success ? "failed" : job.result.cancelled ? "partial" : "ok";
+        out << status << "\t"
+            << summaryField(job.input) << "\t"
+            << summaryField(job.output) << "\t"
+            << job.result.widgets_flattened << "\t"
+            << job.result.bytes_written << "\t"
+            << job.seconds * 1000 << "\t"
+            << summaryField(job.result.cancelled && job.result.success ?
+                            "stopped during " + job.result.cancelled_in : job.result.error) << "\n";
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef BATCH_HH
+#define BATCH_HH
+
+#include "FormFlattener.hh"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+//One document of a batch and its outcome
+struct BatchJob
+{
+    BatchJob();
+
+    std::string input;
+    std::string output;
+    FlattenResult result;
+    double seconds;             //wall time of the job, reading to writing
+};
+
+//Jobs for a manifest or a directory. A manifest lists one input per line,
+//optionally followed by a tab and the output name; blank lines and lines
+//starting with # are skipped. A directory contributes its *.pdf files in
+//name order. Outputs without a name go to output_dir under the input's
+//file name. Throws std::runtime_error if source cannot be read, or if an
+//output is the output of another job or one of the inputs
+std::vector<BatchJob> readBatch(std::string const& source, std::string const& output_dir);
+
+//Flatten every job with its own QPDF on up to workers threads (0 = all
+//cores), balanced by stealingFor. While a thread works on a document the
+//kernel is asked to read ahead the next one in its queue. Failures are
+//recorded in the job's result and do not stop the batch
+void runBatch(std::vector<BatchJob> &jobs, FlattenOptions const& options, unsigned int workers);
+
+//Tab separated status, input, output, widgets, bytes written, time in
+//milliseconds and error of every job, with a header line
+void writeBatchSummary(std::ostream &out, std::vector<BatchJob> const& jobs);
+
+#endif
@@ -0,0 +1,16 @@
+#include "CancelToken.hh"
+
+CancelToken::CancelToken()
+    : flag(false)
+{
+}
+
+void CancelToken::cancel()
+{
+    flag.store(true, std::memory_order_relaxed);
+}
+
+bool CancelToken::cancelled() const
+{
+    return flag.load(std::memory_order_relaxed);
+}
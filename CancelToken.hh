@@ -0,0 +1,25 @@
+#ifndef CANCELTOKEN_HH
+#define CANCELTOKEN_HH
+
+#include <atomic>
+
+//Lets another thread stop running jobs. The flattener looks at it between
+//pages and between batches of widgets, so a job ends shortly after
+//cancel() rather than immediately. One token can serve any number of
+//jobs; it cannot be reset
+class CancelToken
+{
+public:
+    CancelToken();
+
+    void cancel();
+    bool cancelled() const;
+
+private:
+    CancelToken(CancelToken const&);
+    CancelToken& operator=(CancelToken const&);
+
+    std::atomic<bool> flag;
+};
+
+#endif
@@ -0,0 +1,372 @@
+#include "ContentBalance.hh"
+
+#include <climits>
+#include <cstring>
+#include <stdint.h>
+
+static uint64_t const HIGH_BITS = 0x8080808080808080ULL;
+static uint64_t const LOW_BITS = 0x0101010101010101ULL;
+
+ContentBalance::ContentBalance()
+    : valid(false),
+      net_depth(0),
+      min_depth(0),
+      min_state_depth(INT_MAX)
+{
+}
+
+bool leavesStateUnchanged(std::vector<ContentBalance> const& streams)
+{
+    int depth = 0;
+    for(size_t i = 0; i < streams.size(); ++i)
+    {
+        ContentBalance const& stream = streams[i];
+        if(!stream.valid || depth + stream.min_depth < 0)
+            return false;
+        if(stream.min_state_depth != INT_MAX && depth + stream.min_state_depth < 1)
+            return false;
+        depth += stream.net_depth;
+    }
+    return depth == 0;
+}
+
+enum CharClass {REGULAR, WHITE, DELIMITER};
+
+//Character classes of the PDF lexer, once per process
+struct CharClasses
+{
+    CharClasses()
+    {
+        for(int c = 0; c < 256; ++c)
+            kind[c] = REGULAR;
+        static char const white[] = {0, 9, 10, 12, 13, 32};
+        for(size_t i = 0; i < sizeof(white); ++i)
+            kind[static_cast<unsigned char>(white[i])] = WHITE;
+        for(char const* d = "()<>[]{}/%"; *d != '\0'; ++d)
+            kind[static_cast<unsigned char>(*d)] = DELIMITER;
+    }
+
+    CharClass kind[256];
+};
+
+static CharClasses const classes;
+
+//Nonzero if any byte of word is zero
+static inline uint64_t zeroByte(uint64_t word)
+{
+    return (word - LOW_BITS) & ~word & HIGH_BITS;
+}
+
+//Nonzero if any byte of word may be whitespace or a delimiter. Bytes up
+//to 0x20 cover the whitespace, the masks pair ( with ), < with > and
+//[ ] { } with each other, so a few regular bytes match as well; zero
+//means none of the eight ends a token
+static inline uint64_t mayEndToken(uint64_t word)
+{
+    uint64_t control = ~((word & ~HIGH_BITS) + 0x5f5f5f5f5f5f5f5fULL) & ~word & HIGH_BITS;
+    return control |
+           zeroByte((word & 0xfefefefefefefefeULL) ^ 0x2828282828282828ULL) |
+           zeroByte((word & 0xfdfdfdfdfdfdfdfdULL) ^ 0x3c3c3c3c3c3c3c3cULL) |
+           zeroByte((word & 0xd9d9d9d9d9d9d9d9ULL) ^ 0x5959595959595959ULL) |
+           zeroByte(word ^ 0x2f2f2f2f2f2f2f2fULL) |
+           zeroByte(word ^ 0x2525252525252525ULL);
+}
+
+//Nonzero if any byte of word may be (, ) or a backslash
+static inline uint64_t mayEndLiteral(uint64_t word)
+{
+    return zeroByte((word & 0xfefefefefefefefeULL) ^ 0x2828282828282828ULL) |
+           zeroByte(word ^ 0x5c5c5c5c5c5c5c5cULL);
+}
+
+//Index of the first byte from i on that is whitespace or a delimiter, len
+//if there is none. Eight bytes are tested at a time
+static size_t skipRegular(unsigned char const* data, size_t i, size_t len)
+{
+    while(i < len)
+    {
+        if(i + 8 <= len)
+        {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            if(mayEndToken(word) == 0)
+            {
+                i += 8;
+                continue;
+            }
+        }
+        for(size_t end = i + 8 < len ? i + 8 : len; i < end; ++i)
+        {
+            if(classes.kind[data[i]] != REGULAR)
+                return i;
+        }
+    }
+    return len;
+}
+
+//Index of the first (, ) or backslash from i on, len if there is none.
+//Short strings are checked byte by byte, longer runs eight bytes at a
+//time
+static size_t skipLiteral(unsigned char const* data, size_t i, size_t len)
+{
+    for(size_t end = i + 8 < len ? i + 8 : len; i < end; ++i)
+    {
+        if(data[i] == '(' || data[i] == ')' || data[i] == '\\')
+            return i;
+    }
+    while(i < len)
+    {
+        if(i + 8 <= len)
+        {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            if(mayEndLiteral(word) == 0)
+            {
+                i += 8;
+                continue;
+            }
+        }
+        for(size_t end = i + 8 < len ? i + 8 : len; i < end; ++i)
+        {
+            if(data[i] == '(' || data[i] == ')' || data[i] == '\\')
+                return i;
+        }
+    }
+    return len;
+}
+
+//Operators that change the graphics state other than through q and Q
+static bool changesState(char const* op, size_t len)
+{
+    static char const* const one[] = {"w", "J", "j", "M", "d", "i", "W", "G", "g", "K", "k", "\""};
+    static char const* const two[] = {"cm", "ri", "gs", "CS", "cs", "SC", "sc", "RG", "rg",
+                                      "Tc", "Tw", "Tz", "TL", "TD", "Tf", "Tr", "Ts", "W*"};
+    static char const* const three[] = {"SCN", "scn"};
+
+    if(len == 0 || len > 3)
+        return false;
+    char const* const* table = len == 1 ? one : len == 2 ? two : three;
+    size_t count = len == 1 ? sizeof(one) / sizeof(one[0]) :
+                   len == 2 ? sizeof(two) / sizeof(two[0]) : sizeof(three) / sizeof(three[0]);
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(memcmp(table[i], op, len) == 0)
+            return true;
+    }
+    return false;
+}
+
+BalanceScanner::BalanceScanner()
+    : Pipeline("content balance", NULL),
+      state(NORMAL),
+      depth(0),
+      token_len(0),
+      token_operand(false),
+      paren_depth(0),
+      escaped(false),
+      image_match(0)
+{
+    balance.valid = true;
+}
+
+void BalanceScanner::endToken()
+{
+    state = NORMAL;
+    if(token_operand || token_len == 0)
+        return;
+
+    char first = token[0];
+    if((first >= '0' && first <= '9') || first == '+' || first == '-' || first == '.')
+        return;
+
+    if(token_len == 1 && first == 'q')
+    {
+        depth++;
+    }
+    else if(token_len == 1 && first == 'Q')
+    {
+        depth--;
+        if(depth < balance.min_depth)
+            balance.min_depth = depth;
+    }
+    else if(token_len == 2 && first == 'I' && token[1] == 'D')
+    {
+        //one whitespace byte, then binary data up to whitespace EI
+        state = IMAGE;
+        image_match = 0;
+    }
+    else if(changesState(token, token_len))
+    {
+        if(depth < balance.min_state_depth)
+            balance.min_state_depth = depth;
+    }
+}
+
+void BalanceScanner::write(unsigned char* data, size_t len)
+{
+    size_t i = 0;
+    while(i < len)
+    {
+        unsigned char c = data[i];
+        switch(state)
+        {
+        case NORMAL:
+            if(classes.kind[c] == REGULAR || c == '/')
+            {
+                //names are operands, the slash marks them
+                state = TOKEN;
+                token_len = 0;
+                token_operand = c == '/';
+                if(c == '/')
+                    ++i;
+                break;
+            }
+            ++i;
+            if(c == '%')
+                state = COMMENT;
+            else if(c == '(')
+            {
+                state = LITERAL;
+                paren_depth = 1;
+                escaped = false;
+            }
+            else if(c == '<')
+                state = ANGLE;
+            break;
+
+        case TOKEN:
+        {
+            //operators are short, their bytes are taken one by one. Only
+            //a run longer than any of them, as in image data, is skipped
+            //eight bytes at a time
+            size_t end = i + 8 < len ? i + 8 : len;
+            while(i < end && classes.kind[data[i]] == REGULAR)
+            {
+                if(token_len < sizeof(token))
+                    token[token_len++] = data[i];
+                else
+                    token_operand = true;
+                ++i;
+            }
+            if(i == end && i < len && classes.kind[data[i]] == REGULAR)
+            {
+                token_operand = true;
+                i = skipRegular(data, i, len);
+            }
+            if(i < len)
+                endToken();
+            break;
+        }
+
+        case COMMENT:
+        {
+            //a comment ends at either end of line character
+            unsigned char* lf = static_cast<unsigned char*>(memchr(data + i, '\n', len - i));
+            size_t end = lf != NULL ? lf - data : len;
+            unsigned char* cr = static_cast<unsigned char*>(memchr(data + i, '\r', end - i));
+            if(cr != NULL)
+                end = cr - data;
+            i = end;
+            if(i < len)
+                state = NORMAL;
+            break;
+        }
+
+        case LITERAL:
+            if(!escaped)
+            {
+                size_t next = skipLiteral(data, i, len);
+                if(next != i)
+                {
+                    i = next;
+                    break;
+                }
+            }
+            ++i;
+            if(escaped)
+                escaped = false;
+            else if(c == '\\')
+                escaped = true;
+            else if(c == '(')
+                paren_depth++;
+            else if(c == ')' && --paren_depth == 0)
+                state = NORMAL;
+            break;
+
+        case ANGLE:
+            //<< opens a dictionary, anything else a hex string
+            if(c == '<')
+            {
+                ++i;
+                state = NORMAL;
+            }
+            else
+            {
+                state = HEX;
+            }
+            break;
+
+        case HEX:
+        {
+            unsigned char* end = static_cast<unsigned char*>(memchr(data + i, '>', len - i));
+            if(end == NULL)
+            {
+                i = len;
+            }
+            else
+            {
+                i = end - data + 1;
+                state = NORMAL;
+            }
+            break;
+        }
+
+        case IMAGE:
+            if(image_match == 0)
+            {
+                //only whitespace starts the end marker
+                size_t next = skipRegular(data, i, len);
+                if(next != i)
+                {
+                    i = next;
+                    break;
+                }
+            }
+            if(image_match == 3 && classes.kind[c] != REGULAR)
+            {
+                state = NORMAL;
+                image_match = 0;
+                break;
+            }
+            ++i;
+            if(classes.kind[c] == WHITE)
+                image_match = 1;
+            else if(c == 'E' && image_match == 1)
+                image_match = 2;
+            else if(c == 'I' && image_match == 2)
+                image_match = 3;
+            else
+                image_match = 0;
+            break;
+        }
+    }
+}
+
+void BalanceScanner::finish()
+{
+    if(state == TOKEN)
+        endToken();
+    if(state == IMAGE && image_match == 3)
+        state = NORMAL;
+
+    //stream boundaries fall between tokens, anything left open means the
+    //data is not what it seems
+    if(state != NORMAL && state != COMMENT)
+        balance.valid = false;
+    balance.net_depth = depth;
+}
+
+ContentBalance const& BalanceScanner::result() const
+{
+    return balance;
+}
@@ -0,0 +1,59 @@
+#ifndef CONTENTBALANCE_HH
+#define CONTENTBALANCE_HH
+
+#include <qpdf/Pipeline.hh>
+
+#include <cstddef>
+#include <vector>
+
+//How one content stream nests the graphics state. Depths are relative to
+//the depth the stream starts at
+struct ContentBalance
+{
+    ContentBalance();
+
+    bool valid;             //the stream was scanned to a clean end
+    int net_depth;          //q minus Q
+    int min_depth;          //lowest depth reached, 0 or below
+    int min_state_depth;    //lowest depth at which the state is changed, INT_MAX if never
+};
+
+//True if the streams, run one after the other, leave the graphics state
+//as they found it: no unmatched Q, every q closed, and nothing that
+//changes the state (cm, colours, clipping, text state...) outside a q/Q
+//pair. Such page contents need no wrapping before more is drawn
+bool leavesStateUnchanged(std::vector<ContentBalance> const& streams);
+
+//Pipeline that tokenizes content stream data as it passes and works out
+//its ContentBalance, without parsing operands or building objects.
+//Strings, comments, dictionaries and inline image data are skipped. Data
+//can arrive in pieces of any size
+class BalanceScanner : public Pipeline
+{
+public:
+    BalanceScanner();
+
+    virtual void write(unsigned char* data, size_t len);
+    virtual void finish();
+
+    ContentBalance const& result() const;
+
+private:
+    enum State {NORMAL, TOKEN, COMMENT, LITERAL, ANGLE, HEX, IMAGE};
+
+    void endToken();
+
+    ContentBalance balance;
+    State state;
+    int depth;
+
+    char token[4];          //start of the current token
+    size_t token_len;
+    bool token_operand;     //a name, or longer than any operator of interest
+
+    int paren_depth;        //in a literal string
+    bool escaped;
+    int image_match;        //progress through whitespace E I in image data
+};
+
+#endif
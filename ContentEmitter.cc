@@ -0,0 +1,143 @@
+#include "ContentEmitter.hh"
+#include "OutputProfile.hh"
+
+#include <qpdf/Pl_Buffer.hh>
+#include <qpdf/Pl_Flate.hh>
+#include <qpdf/Buffer.hh>
+
+#include <charconv>
+#include <cmath>
+
+ContentEmitter::ContentEmitter()
+{
+}
+
+void ContentEmitter::reserve(size_t size)
+{
+    buffer.reserve(buffer.size() + size);
+}
+
+void ContentEmitter::append(char const* data, size_t size)
+{
+    buffer.append(data, size);
+}
+
+void ContentEmitter::append(std::string const& data)
+{
+    buffer.append(data);
+}
+
+void ContentEmitter::number(double value)
+{
+    //values this small are noise from matrix arithmetic, and would
+    //otherwise be written with hundreds of digits
+    if(!std::isfinite(value) || std::fabs(value) < 1e-9)
+        value = 0;
+
+    char digits[400];
+    std::to_chars_result converted = std::to_chars(digits, digits + sizeof(digits), value,
+                                                   std::chars_format::fixed);
+    buffer.append(digits, converted.ptr - digits);
+    buffer.push_back(' ');
+}
+
+void ContentEmitter::name(std::string const& name)
+{
+    buffer.append(name);
+    buffer.push_back(' ');
+}
+
+//Bytes that cannot appear unescaped in a literal string
+struct EscapeTable
+{
+    EscapeTable()
+    {
+        for(int c = 0; c < 256; ++c)
+            escape[c] = c < 0x20 || c == 0x7f || c == '(' || c == ')' || c == '\\';
+    }
+
+    bool operator[](unsigned char c) const
+    {
+        return escape[c];
+    }
+
+    bool escape[256];
+};
+
+void ContentEmitter::literal(std::string const& text)
+{
+    static char const octal[] = "01234567";
+    static EscapeTable const needsEscape;
+
+    buffer.push_back('(');
+    for(size_t i = 0; i < text.size(); ++i)
+    {
+        //copy the run of characters that need no escape in one go
+        size_t run = i;
+        while(run < text.size() && !needsEscape[static_cast<unsigned char>(text[run])])
+            ++run;
+        if(run != i)
+        {
+            buffer.append(text, i, run - i);
+            i = run;
+            if(i == text.size())
+                break;
+        }
+
+        unsigned char c = text[i];
+        if(c == '(' || c == ')' || c == '\\')
+        {
+            buffer.push_back('\\');
+            buffer.push_back(c);
+        }
+        else
+        {
+            buffer.push_back('\\');
+            buffer.push_back(octal[(c >> 6) & 7]);
+            buffer.push_back(octal[(c >> 3) & 7]);
+            buffer.push_back(octal[c & 7]);
+        }
+    }
+    buffer.append(") ");
+}
+
+void ContentEmitter::op(char const* op)
+{
+    buffer.append(op);
+    buffer.push_back('\n');
+}
+
+void ContentEmitter::matrix(double const m[6])
+{
+    for(int i = 0; i < 6; ++i)
+        number(m[i]);
+    op("cm");
+}
+
+std::string &ContentEmitter::data()
+{
+    return buffer;
+}
+
+std::string flateEncode(std::string const& data)
+{
+    Pl_Buffer collected("flate output");
+    Pl_Flate deflate("flate encode", &collected, Pl_Flate::a_deflate);
+    beginFlate(PROFILE_DEFAULT);
+    try
+    {
+        deflate.write(reinterpret_cast<unsigned char*>(const_cast<char*>(data.data())), data.size());
+        deflate.finish();
+    }
+    catch(...)
+    {
+        endFlate(PROFILE_DEFAULT);
+        throw;
+    }
+    endFlate(PROFILE_DEFAULT);
+
+    Buffer* encoded = collected.getBuffer();
+    std::string result(reinterpret_cast<char const*>(encoded->getBuffer()), encoded->getSize());
+    delete encoded;
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef CONTENTEMITTER_HH
+#define CONTENTEMITTER_HH
+
+#include <string>
+#include <cstddef>
+
+//Builds a page content stream in a single growing buffer. Numbers are
+//written locale independent in the shortest form that reads back to the
+//same double, without exponents since PDF does not allow them
+class ContentEmitter
+{
+public:
+    ContentEmitter();
+
+    //Make room for at least size more bytes
+    void reserve(size_t size);
+
+    void append(char const* data, size_t size);
+    void append(std::string const& data);
+
+    //Operand followed by a space
+    void number(double value);
+    void name(std::string const& name);
+
+    //Literal string operand, (, ) and \ escaped and control bytes
+    //written as octal escapes
+    void literal(std::string const& text);
+
+    //Operator followed by a newline
+    void op(char const* op);
+
+    //The complete "a b c d e f cm" operation
+    void matrix(double const m[6]);
+
+    std::string &data();
+
+private:
+    std::string buffer;
+};
+
+//Flate encode data, for streams installed with /Filter /FlateDecode
+std::string flateEncode(std::string const& data);
+
+#endif
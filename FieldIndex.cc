@@ -0,0 +1,183 @@
+#include "FieldIndex.hh"
+
+#include <set>
+
+static char const* const attribute_keys[FieldIndex::ATTRIBUTE_COUNT] =
+{
+    "/FT", "/Ff", "/V", "/DV", "/DA", "/Q", "/MaxLen"
+};
+
+FieldIndex::FieldIndex()
+{
+}
+
+int FieldIndex::addNode(QPDFObjectHandle object, int parent)
+{
+    Node node;
+    node.object = object;
+    node.parent = parent;
+    for(int i = 0; i < ATTRIBUTE_COUNT; ++i)
+    {
+        if(object.hasKey(attribute_keys[i]))
+            node.owner[i] = nodes.size();
+        else if(parent >= 0)
+            node.owner[i] = nodes[parent].owner[i];
+        else
+            node.owner[i] = -1;
+    }
+
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+void FieldIndex::build(QPDF &pdf)
+{
+    nodes.clear();
+    widgets.clear();
+    widget_order.clear();
+
+    QPDFObjectHandle acroform = pdf.getRoot().getKey("/AcroForm");
+    if(!acroform.isDictionary() || !acroform.getKey("/Fields").isArray())
+        return;
+
+    //explicit stack instead of recursion, deep trees are legal; the set
+    //guards against /Kids loops in damaged files
+    std::vector<std::pair<QPDFObjectHandle, int> > pending;
+    std::set<QPDFObjGen> visited;
+
+    std::vector<QPDFObjectHandle> fields = acroform.getKey("/Fields").getArrayAsVector();
+    for(std::vector<QPDFObjectHandle>::reverse_iterator it = fields.rbegin(); it != fields.rend(); ++it)
+        pending.push_back(std::make_pair(*it, -1));
+
+    while(!pending.empty())
+    {
+        QPDFObjectHandle object = pending.back().first;
+        int parent = pending.back().second;
+        pending.pop_back();
+
+        if(!object.isDictionary())
+            continue;
+
+        if(object.isIndirect() && !visited.insert(object.getObjGen()).second)
+            continue;
+
+        int node = addNode(object, parent);
+
+        QPDFObjectHandle kids = object.getKey("/Kids");
+        if(kids.isArray() && kids.getArrayNItems() > 0)
+        {
+            for(int i = kids.getArrayNItems() - 1; i >= 0; --i)
+                pending.push_back(std::make_pair(kids.getArrayItem(i), node));
+        }
+        else if(object.isIndirect())
+        {
+            //terminal nodes are the widget annotations
+            widgets[object.getObjGen()] = node;
+            widget_order.push_back(node);
+        }
+    }
+}
+
+int FieldIndex::lookup(QPDFObjectHandle widget)
+{
+    if(widget.isIndirect())
+    {
+        std::map<QPDFObjGen, int>::iterator found = widgets.find(widget.getObjGen());
+        if(found != widgets.end())
+            return found->second;
+    }
+
+    int node = addNode(widget, -1);
+    if(widget.isIndirect())
+        widgets[widget.getObjGen()] = node;
+    return node;
+}
+
+QPDFObjectHandle FieldIndex::get(int node, Attribute attribute)
+{
+    int owner = nodes[node].owner[attribute];
+    if(owner < 0)
+        return QPDFObjectHandle::newNull();
+
+    return nodes[owner].object.getKey(attribute_keys[attribute]);
+}
+
+bool FieldIndex::has(int node, Attribute attribute) const
+{
+    return nodes[node].owner[attribute] >= 0;
+}
+
+//Object IDs of the annotations of page
+static std::set<QPDFObjGen> annotationIds(QPDFObjectHandle page)
+{
+    std::set<QPDFObjGen> ids;
+    QPDFObjectHandle annots = page.getKey("/Annots");
+    for(int i = 0; annots.isArray() && i < annots.getArrayNItems(); ++i)
+    {
+        QPDFObjectHandle annot = annots.getArrayItem(i);
+        if(annot.isIndirect())
+            ids.insert(annot.getObjGen());
+    }
+    return ids;
+}
+
+std::vector<QPDFObjectHandle> FieldIndex::widgetPages(QPDF &pdf)
+{
+    std::vector<QPDFObjectHandle> pages;
+    std::map<QPDFObjGen, std::set<QPDFObjGen> > page_annots;    //of the pages read so far
+    std::set<QPDFObjGen> listed;                                //pages already in pages
+    std::set<QPDFObjGen> unplaced;                              //widgets /P does not place
+
+    for(size_t i = 0; i < widget_order.size(); ++i)
+    {
+        QPDFObjectHandle widget = nodes[widget_order[i]].object;
+        QPDFObjGen id = widget.getObjGen();
+        QPDFObjectHandle page = widget.getKey("/P");
+        if(!page.isIndirect() || !page.isPageObject())
+        {
+            unplaced.insert(id);
+            continue;
+        }
+
+        std::map<QPDFObjGen, std::set<QPDFObjGen> >::iterator annots = page_annots.find(page.getObjGen());
+        if(annots == page_annots.end())
+            annots = page_annots.insert(std::make_pair(page.getObjGen(), annotationIds(page))).first;
+        if(annots->second.count(id) == 0)
+        {
+            unplaced.insert(id);
+            continue;
+        }
+        if(listed.insert(page.getObjGen()).second)
+            pages.push_back(page);
+    }
+
+    if(unplaced.empty())
+        return pages;
+
+    //one walk of the page tree for all the widgets /P got wrong
+    std::vector<QPDFObjectHandle> all_pages = pdf.getAllPages();
+    for(size_t p = 0; p < all_pages.size() && !unplaced.empty(); ++p)
+    {
+        QPDFObjectHandle annots = all_pages[p].getKey("/Annots");
+        bool found = false;
+        for(int i = 0; annots.isArray() && i < annots.getArrayNItems(); ++i)
+        {
+            QPDFObjectHandle annot = annots.getArrayItem(i);
+            if(annot.isIndirect() && unplaced.erase(annot.getObjGen()) != 0)
+                found = true;
+        }
+        if(found && listed.insert(all_pages[p].getObjGen()).second)
+            pages.push_back(all_pages[p]);
+    }
+    return pages;
+}
+
+size_t FieldIndex::size() const
+{
+    return nodes.size();
+}
+
+size_t FieldIndex::widgetCount() const
+{
+    return widgets.size();
+}
@@ -0,0 +1,59 @@
+#ifndef FIELDINDEX_HH
+#define FIELDINDEX_HH
+
+#include <qpdf/QPDF.hh>
+#include <qpdf/QPDFObjectHandle.hh>
+
+#include <map>
+#include <vector>
+
+//Index of the form field tree built in one top-down pass over
+///AcroForm /Fields. Every node records, per inheritable attribute, which
+//node defines it, so descendants share their ancestors' entries instead
+//of copying them. Widget annotations are looked up by object ID
+class FieldIndex
+{
+public:
+    enum Attribute { FT, FF, V, DV, DA, Q, MAXLEN, ATTRIBUTE_COUNT };
+
+    FieldIndex();
+
+    //Walk /AcroForm /Fields of pdf, replacing any previous contents
+    void build(QPDF &pdf);
+
+    //Node of a widget annotation. Widgets that are not reachable from
+    ///Fields get a node of their own, holding only their own attributes
+    int lookup(QPDFObjectHandle widget);
+
+    //Inherited value of an attribute, a null object if no node on the
+    //path from the root defines it
+    QPDFObjectHandle get(int node, Attribute attribute);
+    bool has(int node, Attribute attribute) const;
+
+    //Pages whose /Annots hold a widget of /Fields, in field tree order,
+    //found through the widgets' /P and confirmed by their /Annots, so the
+    //cost follows the widgets rather than the pages. Only for widgets
+    //whose /P is missing or does not list them is the page tree walked,
+    //once for all of them. Widgets missing from /Fields are flattened
+    //only on the pages found this way
+    std::vector<QPDFObjectHandle> widgetPages(QPDF &pdf);
+
+    size_t size() const;
+    size_t widgetCount() const;
+
+private:
+    struct Node
+    {
+        QPDFObjectHandle object;
+        int parent;
+        int owner[ATTRIBUTE_COUNT];     //node defining the attribute, -1 if none
+    };
+
+    int addNode(QPDFObjectHandle object, int parent);
+
+    std::vector<Node> nodes;
+    std::map<QPDFObjGen, int> widgets;
+    std::vector<int> widget_order;      //widget nodes from /Fields in tree order
+};
+
+#endif
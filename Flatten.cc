@@ -1,635 +1,640 @@
+#include "FormFlattener.hh"
+#include "Batch.hh"
+#include "Log.hh"
+#include "MappedFile.hh"
+#include "Shard.hh"
+
 #include <qpdf/QPDF.hh>
 #include <qpdf/PointerHolder.hh>
-#include <qpdf/Buffer.hh>
-#include <qpdf/QPDFWriter.hh>
+#include <qpdf/Pl_StdioFile.hh>
+#include <qpdf/Pl_Buffer.hh>
+#include <qpdf/BufferInputSource.hh>
+#include <qpdf/FileInputSource.hh>
 
 #include <iostream>
 #include <cstdlib>
-#include <sstream>
 #include <cstring>
-#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-enum Button {PUSH, CHECKBOX, RADIO};
+void usage()
+{
+    std::cerr << "Usage: ./Flatten [options] <input_file>" << std::endl;
+    std::cerr << "       ./Flatten [options] job-id user title copies options [file]" << std::endl;
+    std::cerr << "       ./Flatten [options] --batch <manifest|directory>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --jobs N     build page contents on N threads (0 = all cores)" << std::endl;
+    std::cerr << "  --no-dedup   keep identical appearance streams separate" << std::endl;
+    std::cerr << "  --no-minimize  keep the full /Resources of appearances" << std::endl;
+    std::cerr << "  --incremental  append the changes to the original bytes" << std::endl;
+    std::cerr << "  --profile P  output profile: default, fast, small or web" << std::endl;
+    std::cerr << "  --plan-cache DIR  reuse the widget layout of forms seen before" << std::endl;
+    std::cerr << "  --output-cache DIR  serve documents seen before from DIR" << std::endl;
+    std::cerr << "  --output-cache-size SIZE  evict from the output cache above SIZE (default 1G)" << std::endl;
+    std::cerr << "  --max-rss SIZE bound memory use, SIZE in bytes or with a K, M or G suffix" << std::endl;
+    std::cerr << "  --deadline-ms N   give up on a document after N ms" << std::endl;
+    std::cerr << "  --deadline-partial  on the deadline, write what is flattened so far" << std::endl;
+    std::cerr << "  --shards N        split output.pdf into N page ranges" << std::endl;
+    std::cerr << "  --shard-size SIZE split output.pdf into shards of about SIZE" << std::endl;
+    std::cerr << "  --output-dir DIR  batch output directory (default flattened)" << std::endl;
+    std::cerr << "  --summary FILE    batch summary (default DIR/summary.tsv)" << std::endl;
+    std::cerr << "  --log-level L  none, error, warning, info, debug or debug2" << std::endl;
+    std::cerr << "  --stats FILE   write counters and phase timings as JSON" << std::endl;
+    std::cerr << "  --trace FILE   write a Chrome trace of the phases" << std::endl;
+    exit(2);
+}
+
+//Diagnostics of the command line tool, buffered and written to stderr
+Logger logger(FLATTEN_LOG_DEBUG, STDERR_FILENO);
 
-//Check if the given key exists in the dictionary
-bool isKeyPresent(QPDFObjectHandle obj, std::string key)
+//Command line settings that are not flattening options
+struct ReportOptions
 {
-    //ensure that obj is dictionary
-    bool isDict = obj.isDictionary();
-    
-    if(isDict)
-    {
-        if(obj.hasKey(key))
-            return true;
-        else
-            return false;
-    }
-    
-    else
-    {
-        if(obj.getDict().hasKey(key))
-            return true;
-        else
-            return false;
-    }
+    ReportOptions() : jobs_set(false), log_level_set(false), log_level(FLATTEN_LOG_DEBUG), shards(0), shard_kb(0) {}
+
+    bool jobs_set;             //--jobs given, shards are written on all cores otherwise
+    bool log_level_set;
+    LogLevel log_level;
+    std::string stats_file;
+    std::string trace_file;
+
+    std::string batch;          //manifest or directory, empty if not batching
+    std::string output_dir;
+    std::string summary_file;
+
+    size_t shards;              //standalone output split into page ranges, 0 for one file
+    long long shard_kb;         //or into shards of about this size
+};
+
+//Fetch the value of an option given either as --name=value or --name value
+std::string optionValue(int argc, char** argv, int &i, std::string const& arg, std::string const& name)
+{
+    if(arg.size() > name.size() && arg[name.size()] == '=')
+        return arg.substr(name.size() + 1);
+
+    if(arg != name || i + 1 >= argc)
+        usage();
+
+    return argv[++i];
 }
 
+//Parse a size such as 512M into kilobytes, 0 if it is not valid
+long long parseSizeKb(std::string const& value)
+{
+    char* end = NULL;
+    double size = strtod(value.c_str(), &end);
+    if(value.empty() || end == value.c_str() || size <= 0)
+        return 0;
+
+    std::string suffix = end;
+    if(suffix == "K" || suffix == "k")
+        size *= 1024;
+    else if(suffix == "M" || suffix == "m")
+        size *= 1024 * 1024;
+    else if(suffix == "G" || suffix == "g")
+        size *= 1024 * 1024 * 1024;
+    else if(!suffix.empty())
+        return 0;
+    return static_cast<long long>(size / 1024) > 0 ? static_cast<long long>(size / 1024) : 1;
+}
 
-//check if translation is needed for the annotation
-bool needsTranslation(QPDFObjectHandle normal_appearance)
+//Separate our own --options from the positional arguments
+void parseOptions(int argc, char** argv, FlattenOptions &options, ReportOptions &report,
+                  std::vector<char*> &args)
 {
-    bool translate = false;
-    
-    //if /Resources not present, then translation needed
-    if(!isKeyPresent(normal_appearance, "/Resources"))
-    {
-        return true;
-    }
-    else
+    args.push_back(argv[0]);
+    for(int i = 1; i < argc; ++i)
     {
-
-        QPDFObjectHandle resources = normal_appearance.getDict().getKey("/Resources");
-        
-        //if /Resouces does not contain /XObject then needs translation
-        if(!isKeyPresent(resources, "/XObject"))
+        std::string arg = argv[i];
+        if(arg.compare(0, 6, "--jobs") == 0)
         {
-            return true;
+            std::string value = optionValue(argc, argv, i, arg, "--jobs");
+            char* end = NULL;
+            long jobs = strtol(value.c_str(), &end, 10);
+            if(value.empty() || *end != '\0' || jobs < 0)
+                usage();
+            options.jobs = jobs;
+            report.jobs_set = true;
         }
-        else
+        else if(arg.compare(0, 9, "--profile") == 0)
         {
-            std::map<std::string, QPDFObjectHandle> xobject;
-            
-            if(resources.isDictionary())
-                xobject = resources.getKey("/XObject").getDictAsMap();
-            else
-                xobject = resources.getDict().getKey("/XObject").getDictAsMap();
-           
-            if(xobject.size()!=0)
-            { 
-                for(std::map<std::string, QPDFObjectHandle>::iterator it = xobject.begin();
-                    it != xobject.end(); ++it)
-                {
-                    if(!isKeyPresent(it->second, "/BBox"))
-                        continue;
-                
-                    double left = it->second.getDict().getKey("/BBox").getArrayItem(0).getNumericValue();
-                    double bottom = it->second.getDict().getKey("/BBox").getArrayItem(1).getNumericValue();
-
-                    //if /BBox does not start with (0,0) then it automatically takes
-                    //care of the translation    
-                    if(left==0 && bottom==0)
-                    {
-                        translate = true;
-                        break;
-                    }
-                }
-                return translate;
-            } 
-            
-            return true;
+            std::string value = optionValue(argc, argv, i, arg, "--profile");
+            if(!parseOutputProfile(value, options.profile))
+                usage();
         }
-    }
-    return true;
-}
-
-//Check if scaling is required
-bool needsScaling(QPDFObjectHandle normal_appearance)
-{
-    
-    if(!isKeyPresent(normal_appearance, "/Resources"))
-    {
-        return false;
-    }
-    else
-    {
-        QPDFObjectHandle resources = normal_appearance.getDict().getKey("/Resources");
-        if(!isKeyPresent(resources,"/XObject"))
+        else if(arg.compare(0, 12, "--plan-cache") == 0)
+        {
+            options.plan_cache_dir = optionValue(argc, argv, i, arg, "--plan-cache");
+        }
+        else if(arg.compare(0, 19, "--output-cache-size") == 0)
+        {
+            options.output_cache_max_kb = parseSizeKb(optionValue(argc, argv, i, arg, "--output-cache-size"));
+            if(options.output_cache_max_kb == 0)
+                usage();
+        }
+        else if(arg.compare(0, 14, "--output-cache") == 0)
         {
-            return false;
+            options.output_cache_dir = optionValue(argc, argv, i, arg, "--output-cache");
+        }
+        else if(arg.compare(0, 9, "--max-rss") == 0)
+        {
+            options.max_rss_kb = parseSizeKb(optionValue(argc, argv, i, arg, "--max-rss"));
+            if(options.max_rss_kb == 0)
+                usage();
+        }
+        else if(arg == "--deadline-partial")
+        {
+            options.deadline_partial = true;
+        }
+        else if(arg.compare(0, 13, "--deadline-ms") == 0)
+        {
+            std::string value = optionValue(argc, argv, i, arg, "--deadline-ms");
+            char* end = NULL;
+            long long deadline = strtoll(value.c_str(), &end, 10);
+            if(value.empty() || *end != '\0' || deadline <= 0)
+                usage();
+            options.deadline_ms = deadline;
+        }
+        else if(arg.compare(0, 12, "--shard-size") == 0)
+        {
+            report.shard_kb = parseSizeKb(optionValue(argc, argv, i, arg, "--shard-size"));
+            if(report.shard_kb == 0)
+                usage();
+        }
+        else if(arg.compare(0, 8, "--shards") == 0)
+        {
+            std::string value = optionValue(argc, argv, i, arg, "--shards");
+            char* end = NULL;
+            long shards = strtol(value.c_str(), &end, 10);
+            if(value.empty() || *end != '\0' || shards <= 0)
+                usage();
+            report.shards = shards;
+        }
+        else if(arg.compare(0, 11, "--log-level") == 0)
+        {
+            std::string value = optionValue(argc, argv, i, arg, "--log-level");
+            if(!parseLogLevel(value, report.log_level))
+                usage();
+            report.log_level_set = true;
+        }
+        else if(arg.compare(0, 7, "--batch") == 0)
+        {
+            report.batch = optionValue(argc, argv, i, arg, "--batch");
+        }
+        else if(arg.compare(0, 12, "--output-dir") == 0)
+        {
+            report.output_dir = optionValue(argc, argv, i, arg, "--output-dir");
+        }
+        else if(arg.compare(0, 9, "--summary") == 0)
+        {
+            report.summary_file = optionValue(argc, argv, i, arg, "--summary");
+        }
+        else if(arg.compare(0, 7, "--stats") == 0)
+        {
+            report.stats_file = optionValue(argc, argv, i, arg, "--stats");
+        }
+        else if(arg.compare(0, 7, "--trace") == 0)
+        {
+            report.trace_file = optionValue(argc, argv, i, arg, "--trace");
+        }
+        else if(arg == "--incremental")
+        {
+            options.incremental = true;
+        }
+        else if(arg == "--no-dedup")
+        {
+            options.deduplicate_appearances = false;
+        }
+        else if(arg == "--no-minimize")
+        {
+            options.minimize_resources = false;
+        }
+        else if(arg.compare(0, 2, "--") == 0)
+        {
+            usage();
         }
         else
         {
-            std::map<std::string, QPDFObjectHandle> xobjects;
-            if(resources.isDictionary())
-                xobjects = resources.getKey("/XObject").getDictAsMap();
-            else
-                xobjects = resources.getDict().getKey("/XObject").getDictAsMap();
-            
-            //If there are multiple xobjects present,
-            //then scaling 'might' be required
-            if(xobjects.size()==0)
-                return false;
-            else
-                return true;
+            args.push_back(argv[i]);
         }
     }
-    return false;
 }
 
-//Function to check if the annotation is allowed to be printed
-bool annotationAllowed(unsigned int flags)
+//Check if the file descriptor supports random access. The PDF parser
+//has to seek (the xref table lives at the end of the file), so pipes
+//and sockets cannot be handed to it directly
+bool isSeekable(int fd)
 {
-    bool value = true;
-    int bit = 0x01;   
-    
-    //check if annotation is invisible
-    if(flags & bit)
-        value = false;
-
-    //check if annotation is hidden
-    else if(flags & (bit<<1))
-        value = false;
-
-    //check if allowed to print
-    else if(!(flags & (bit<<2)))
-        value = false;
-
-    return value;
-}   
-
-
-//Check whether the document consists of AcroForm
-bool acroformPresent(QPDF &pdf)
-{
-    QPDFObjectHandle root = pdf.getRoot();
-    if(!root.hasKey("/AcroForm"))
-    {
-        std::cerr << "Acroform not present in the PDF" << std::endl;
+    struct stat st;
+    if(fstat(fd, &st) != 0)
         return false;
-    }
 
-    std::cerr << "Acroform present in the PDF" << std::endl;
-    return true;
-}
+    if(!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))
+        return false;
 
-void usage()
-{
-    std::cerr << "Usage: ./Flatten <input_file>" << std::endl;
-    exit(2);
+    return lseek(fd, 0, SEEK_CUR) != (off_t)-1;
 }
 
-void NoNeedAppearances(QPDF &pdf)
+//Open the PDF coming in on a file descriptor. A seekable descriptor is
+//parsed in place; anything else is spooled into memory first
+PointerHolder<InputSource> openFd(int fd)
 {
-    std::cerr<<"DBG:\t Working with Acroform"<<std::endl;
-
-        //Get all the pages present in the PDF document
-        std::vector<QPDFObjectHandle> all_pages = pdf.getAllPages();
-        for(std::vector<QPDFObjectHandle>::iterator page_iter = all_pages.begin();
-            page_iter < all_pages.end(); ++page_iter)
+    if(isSeekable(fd))
+    {
+        FILE* input = fdopen(fd, "rb");
+        if(input == NULL)
         {
-            std::cerr<<"DBG:\t Working on a new page"<<std::endl;
-
-            QPDFObjectHandle page = *page_iter;
-            std::vector<QPDFObjectHandle> preserved_annots;
-            
-            //count the XObjects
-            int count = 0;
+            FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, "Unable to open input descriptor " << fd);
+            exit(1);
+        }
+        FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Input is seekable, parsing in place");
+        FileInputSource* file = new FileInputSource();
+        file->setFile("stdin", input, false);
+        return file;
+    }
 
-            //Create new content stream for the page
-            std::string page_stream_contents = "q\n";
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-            //check if page has annotations
-            if(!isKeyPresent(page,"/Annots"))
+    std::string spool;
+    char buf[65536];
+    ssize_t len;
+    while((len = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if(len < 0)
+        {
+            if(errno == EINTR)
                 continue;
-            
-            std::cerr<<"DBG:\t Accessing page Annots"<<std::endl;
-            //Get all the annotations present in the page
-            std::vector<QPDFObjectHandle> annotations = page.getKey("/Annots").getArrayAsVector();
-           
-            //check if the page's /Resources contains /XObject
-            if(!isKeyPresent(page.getKey("/Resources"), "/XObject"))
-            {
-                QPDFObjectHandle empty_dictionary = QPDFObjectHandle::newDictionary();
-                page.getKey("/Resources").getDict().replaceKey("/XObject",empty_dictionary);
-            }
-            
-            //get the page resources
-            std::map<std::string, QPDFObjectHandle> page_resources_xobject = page.getKey("/Resources").getKey("/XObject").getDictAsMap();
-            
-            //The content stream of the page should already be wrapped inside q...Q pair
-            page.addPageContents(QPDFObjectHandle::newStream(&pdf, "q"), true);
-            page.addPageContents(QPDFObjectHandle::newStream(&pdf, "Q"), false);
-
-            //Work on every annotation present in the page
-            std::vector<int> remove_annot;
-            int annot_num=0;
-
-            for(std::vector<QPDFObjectHandle>::iterator annot_iter = annotations.begin(); 
-                annot_iter < annotations.end(); ++annot_iter)
-            {
-                std::cerr<<"DBG:\t Working on a new Annot"<<std::endl;
-
-                QPDFObjectHandle annot = *annot_iter;
-                if(!isKeyPresent(annot, "/F"))
-                {
-                    //Assuming it is not hidden and invisible and is allowed to print
-                    QPDFObjectHandle number = QPDFObjectHandle::newInteger(4);
-                    annot.getDict().replaceKey("/F", number);
-                }
-
-                std::stringstream s(annot.getKey("/F").unparse());
-                unsigned int flags = 0;
-                s >> flags;
-                
-                //preserve non-widget type annotations
-                if(annot.getKey("/Subtype").unparse() != "/Widget")
-                {
-                    preserved_annots.push_back(annot);    
-                }
-
-                //Honour the flags(/F) present in the annotation
-                else if (annotationAllowed(flags))
-                {
-                    std::cerr<<"DBG:\t Flags honoured"<<std::endl;
-                    if(!isKeyPresent(annot,"/AP"))
-                    {
-                        QPDFObjectHandle normal_dictionary = QPDFObjectHandle::newStream(&pdf);
-                        std::map<std::string, QPDFObjectHandle> N;
-                        N.insert(std::pair<std::string, QPDFObjectHandle>("/N", normal_dictionary));
-                        annot.replaceKey("/AP", QPDFObjectHandle::newDictionary(N));
-                    }
-
-                    std::cerr<<"DBG:\t Accessing Annot's /AP and /N"<<std::endl;
-                    QPDFObjectHandle normal_appearance = annot.getKey("/AP").getKey("/N");
-
-                    
-                    //button might have /Yes or /Off states
-                    if(annot.getKey("/FT").unparse()=="/Btn")
-                    {
-                        std::string appearance_state = annot.getKey("/AS").unparse();
-
-                        std::cerr<<"DBG:\t Changing normal_appearance for /Btn"<<std::endl;
-                        //The state might not be present in /N dictionary in which
-                        //case it should be fetched from /D dictionary
-                        if(!isKeyPresent(normal_appearance, appearance_state))
-                            normal_appearance = annot.getKey("/AP").getKey("/D").getKey(appearance_state);
-                        else
-                            normal_appearance = normal_appearance.getKey(appearance_state);
-                    }
-
-
-                    bool isNAdict = false;
-                    if(normal_appearance.isDictionary())
-                        isNAdict = true;
-                    
-                    //check if /XObject has /Name or not
-                    std::string replace_name = "";
-                    if(!isKeyPresent(normal_appearance, "/Name"))
-                    {
-                        std::cerr<<"DBG:\t Standard /XObject name not present"<<std::endl;
-                        std::ostringstream xobj_count;
-                        xobj_count << ++count;
-                        std::string xobj_name = "/ResX";
-                        xobj_name.append(xobj_count.str());
-
-                        QPDFObjectHandle name = QPDFObjectHandle::newName(xobj_name);
-                        if(!isNAdict) //it is a stream
-                            normal_appearance.getDict().replaceKey("/Name", name);
-                        else //it is a dictionary
-                            normal_appearance.replaceKey("/Name", name);
-
-                        replace_name = xobj_name;
-                    }
-                    else
-                    {
-                        std::cerr<<"DBG:\t Standard /XObject name present"<<std::endl;
-                        QPDFObjectHandle xobj_name;
-                        if(!isNAdict) //it is a stream
-                            xobj_name = normal_appearance.getDict().getKey("/Name");
-                        else //it is a dictionary
-                            xobj_name = normal_appearance.getKey("/Name");
-                        replace_name = xobj_name.unparse(); 
-                    }
-                    
-                    //Insert the named XObject into /Resources
-                    page_resources_xobject.insert(std::pair<std::string, QPDFObjectHandle>(replace_name, normal_appearance));
-                    
-                    //APPLY TRANSFORMATIONS
-                    //Check if translation is required
-                    bool translate = needsTranslation(normal_appearance);
-                    double transformation_matrix[6] = {1,0,0,1,0,0};
-
-                    //Get the llx and lly values of the annotation rectangle
-                    if(translate)
-                    {
-                        std::cerr<<"DBG:\t Performing translation"<<std::endl;
-                        transformation_matrix[4] = annot.getKey("/Rect").getArrayItem(0).getNumericValue();
-                        transformation_matrix[5] = annot.getKey("/Rect").getArrayItem(1).getNumericValue();
-                    }
-
-                    //Check if scaling is required
-                    bool scaling = needsScaling(normal_appearance);
-                    
-                    if(scaling)
-                    {
-                        std::cerr<<"DBG:\t Performaing scaling"<<std::endl;
-                        double BBox[4] = {0,0,0,0};
-                        double rect[4] = {0,0,0,0};
-
-                        for(int i=0; i<4; ++i)
-                        {
-                            if(isNAdict)
-                                BBox[i] = normal_appearance.getKey("/BBox").getArrayItem(i).getNumericValue();
-                            else
-                                BBox[i] = normal_appearance.getDict().getKey("/BBox").getArrayItem(i).getNumericValue();
-                            rect[i] = annot.getKey("/Rect").getArrayItem(i).getNumericValue();
-                        }
-
-                        double BBox_width = BBox[2] - BBox[0];
-                        double BBox_height = BBox[3] - BBox[1];
-
-                        double rect_width = rect[2] - rect[0];
-                        double rect_height = rect[3] - rect[1];
-
-                        //If width of BBox and Rectangle do not match then the
-                        //transformation matrix should scale the BBox to the
-                        //size of the annotation Rectangle
-                        if(BBox_width - rect_width != 0 && BBox_height - rect_height !=0)
-                        {
-                            double scaleX = rect_width / BBox_width;
-                            double scaleY = rect_height / BBox_height;
-
-                            transformation_matrix[0] = scaleX;
-                            transformation_matrix[3] = scaleY;
-                        }
-
-                    }
-
-                    std::ostringstream conv[4];
-                    conv[0] << transformation_matrix[0];
-                    conv[1] << transformation_matrix[3];
-                    conv[2] << transformation_matrix[4];
-                    conv[3] << transformation_matrix[5];
-
-                    page_stream_contents.append("\n" + conv[0].str() + " 0 0 " + conv[1].str() +" " +
-                                                conv[2].str() + " " + conv[3].str() + " cm " +
-                                                replace_name + " Do Q\nq\n");
-                    
-                    //remove this annotation from the /Annots of the page
-                    remove_annot.push_back(annot_num);  
-                }
-                annot_num++;
-            }
-
-            if(!isKeyPresent(page.getKey("/Resources"), "/XObject"))
-            {
-                QPDFObjectHandle xobj_dictionary = QPDFObjectHandle::newDictionary();
-                page.getKey("/Resources").replaceKey("/XObject", xobj_dictionary);
-            }
-
-            //replace the orginal resources with the new one
-            QPDFObjectHandle new_resources = pdf.makeIndirectObject(QPDFObjectHandle::newDictionary(page_resources_xobject));
-            for(std::map<std::string, QPDFObjectHandle>::iterator it = page_resources_xobject.begin();
-                it != page_resources_xobject.end(); ++it)
-            {
-                page.getKey("/Resources").getKey("/XObject").replaceKey(it->first, it->second);
-            }
-
-            page_stream_contents.append("Q\n");
-
-            //check if the existing page contents are wrapped inside q...Q pair
-            QPDFObjectHandle content = QPDFObjectHandle::newStream(&pdf, page_stream_contents);
-            page.addPageContents(content, false);
-            
-            //replace the original /Annots array with the new array
-            int pos_adjust = 0;
-            for(size_t i=0; i<remove_annot.size(); ++i)
-            {
-                int num = remove_annot.front();
-                annotations.erase(annotations.begin() + num + pos_adjust);
-                pos_adjust++;
-            }
-
-            page.replaceKey("/Annots", QPDFObjectHandle::newArray(annotations));
+            FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, "Unable to read input: " << strerror(errno));
+            exit(1);
         }
-        
-        //remove the AcroForm from the PDF
-        pdf.getRoot().removeKey("/AcroForm");
-        std::cerr<<"PDF flattened successfully\nAcroForm removed"<<std::endl;
+        spool.append(buf, len);
+    }
 
-        //write the changes to the PDF
-        //QPDFWriter w(pdf, "output.pdf");
-        //w.write();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Spooled " << spool.size() << " bytes of non-seekable input in "
+                << elapsed.count() << " ms");
 
+    return new BufferInputSource("stdin", spool);
 }
-static int count = 0;
-void generateOneAppearance(QPDFObjectHandle &field, QPDFObjectHandle &annotation, std::map<std::string, QPDFObjectHandle> inherited, QPDF &pdf)
+
+//One line describing how the output was written and what it cost
+std::string outputSummary(FlattenResult const& result)
 {
-    if(!annotation.hasKey("/AP"))
+    std::ostringstream summary;
+    if(result.output_cache_hit)
     {
-        //Get the /Rect entry from the annotation
-        double rect[4] = {0, 0, 0, 0};
-        for(int i = 0; i < 4; i++)
-        {
-            rect[i] = annotation.getKey("/Rect").getArrayItem(i).getNumericValue();
-        }
+        summary<<"Served "<<result.bytes_written<<" bytes from the output cache in "
+               <<result.write_seconds * 1000<<" ms";
+        return summary.str();
+    }
+    if(result.passed_through)
+    {
+        summary<<"Copied "<<result.bytes_written<<" bytes through unchanged in "
+               <<result.write_seconds * 1000<<" ms";
+        return summary.str();
+    }
+    summary<<"Wrote "<<result.bytes_written<<" bytes as "
+           <<(result.incremental_update ? "incremental update" : outputProfileName(result.profile))
+           <<" in "<<result.write_seconds * 1000<<" ms";
+    return summary.str();
+}
 
-        //Get the Default Resources from the AcroForm
-        QPDFObjectHandle defaultResources = QPDFObjectHandle::newDictionary();
-        if(pdf.getRoot().getKey("/AcroForm").hasKey("/DR"))
-        {
-            defaultResources = pdf.getRoot().getKey("/AcroForm").getKey("/DR");
-        }
-       
-        std::cout<<"THIS: "<<inherited.find("/V")->second.getUTF8Value()<<std::endl; 
-        
-        //If there exists a Normal Apperance stream already, then we have to replace
-        //the existing /Resources with the new one, but care has to be taken that if
-        //the existing resources contains conflicting names, then the existing names
-        //are to be given preference
-        //QPDFObjectHandle defaultResources = QPDFObjectHandle::newDictionary();
-        //for(std::map<std::string, QPDFObjectHandle>::it = DRmap.begin();
-        //        it != DRmap.end(); it++)
-        //{
-            
-        //}
-        //
-
-        QPDFObjectHandle BBoxArray = QPDFObjectHandle::newArray();
-        BBoxArray.appendItem( QPDFObjectHandle::newReal(0) );
-        BBoxArray.appendItem( QPDFObjectHandle::newReal(0) );
-        BBoxArray.appendItem( QPDFObjectHandle::newReal(rect[2] - rect[0]) );
-        BBoxArray.appendItem( QPDFObjectHandle::newReal(rect[3] - rect[1]) );
-
-        std::ostringstream s[2];
-        s[0] << defaultResources.getObjectID();
-        s[1] << defaultResources.getGeneration();
-        QPDFObjectHandle normalDictionary = QPDFObjectHandle::newDictionary();
-        QPDFObjectHandle type = QPDFObjectHandle::newName("/XObject");
-        QPDFObjectHandle subtype = QPDFObjectHandle::newName("/Form");
-        normalDictionary.replaceKey("/Type", type);
-        normalDictionary.replaceKey("/Subtype", subtype);
-        normalDictionary.replaceKey("/Resources", defaultResources);
-        normalDictionary.replaceKey("/BBox", BBoxArray);
-
-        std::string streamContent = "/Tx BMC q BT " + inherited.find("/DA")->second.unparse() + " 1 0 0 1 0 0 Tm\n"
-                                    "(" + inherited.find("/V")->second.unparse() + ") Tj ET Q EMC\n";
-
-
-        QPDFObjectHandle normalAppearance = QPDFObjectHandle::newStream(&pdf, streamContent);
-        normalAppearance.replaceDict(normalDictionary);
-    
-        //Add the /AP << /N object >> entry to the annotation
-        std::map<std::string, QPDFObjectHandle> N;
-        N.insert(std::pair<std::string, QPDFObjectHandle>("/N", normalAppearance));
-        annotation.replaceKey("/AP", QPDFObjectHandle::newDictionary(N));
+//Run as a CUPS filter: filter job-id user title copies options [filename]
+//The document is read from the file if one is given, from stdin otherwise,
+//and the result always goes to stdout
+int filterMain(int argc, char** argv, FlattenOptions const& options)
+{
+    FormFlattener flattener(options);
+    FlattenResult result;
 
+    //stream the result straight into stdout, no intermediate file
+    if(argc == 7)
+    {
+        result = flattener.flattenFileToFd(argv[6], STDOUT_FILENO);
     }
     else
     {
-        QPDFObjectHandle currentNormalAppearance = annotation.getKey("/AP").getKey("/N");
-        QPDFObjectHandle appearanceObject;
-        
-        if(currentNormalAppearance.isDictionary())
+        Pl_StdioFile out("stdout", stdout);
+        //a mapping starts at byte 0, so only map a stdin nothing read from yet
+        MappedFile mapped;
+        if(lseek(STDIN_FILENO, 0, SEEK_CUR) == 0 && mapped.open(STDIN_FILENO))
         {
-            appearanceObject = currentNormalAppearance.getKey(annotation.getKey("/AS").unparse());
+            FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Input is a regular file, parsing it mapped");
+            result = flattener.flattenBuffer(mapped.data(), mapped.size(), &out);
         }
         else
         {
-            appearanceObject = currentNormalAppearance;
+            result = flattener.flattenInputSource(openFd(0), &out);
         }
+        fflush(stdout);
+    }
 
-        
-        //Get the Default Resources from the AcroForm
-        QPDFObjectHandle defaultResources = QPDFObjectHandle::newDictionary();
-        if(pdf.getRoot().getKey("/AcroForm").hasKey("/DR"))
-        {
-            defaultResources = pdf.getRoot().getKey("/AcroForm").getKey("/DR");
-        }
-        appearanceObject.getDict().replaceKey("/Resources", defaultResources);
-        std::string streamContent = "\n/Tx BMC" 
-                                    "\nq" 
-                                    "\nBT" 
-                                    "\n" + inherited.find("/DA")->second.unparse() + 
-                                    "\n" + "1 0 0 1 0 0 Tm" 
-                                    "\n(" + inherited.find("/V")->second.unparse() + ") Tj" 
-                                    "\nET" 
-                                    "\nQ" 
-                                    "\nEMC\n";
-        
-        appearanceObject.replaceStreamData(streamContent, QPDFObjectHandle::newNull(), QPDFObjectHandle::newNull());
+    if(!result.success)
+    {
+        FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, result.error);
+        return 1;
+    }
 
+    if(result.output_cache_hit)
+        FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Flattened before, served from the output cache");
+    else if(result.passed_through)
+        FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Nothing to flatten, passed document through");
+    else if(result.cancelled)
+        FLATTEN_LOG(&logger, FLATTEN_LOG_INFO, "Partially flattened, stopped during " << result.cancelled_in
+                    << " after " << result.widgets_flattened << " widgets");
+    else
+    {
+        FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Deduplicated " << result.appearances_deduplicated
+                    << " appearances, saving " << result.appearance_bytes_saved << " bytes");
+        FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Dropped " << result.resource_entries_dropped
+                    << " unused appearance resources");
+        if(result.plan_cache_hit)
+            FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Reused the flatten plan, saving "
+                        << result.plan_seconds_saved * 1000 << " ms");
+        else if(result.plan_cache_used)
+            FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, "Stored a new flatten plan");
     }
-}   
+    FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, outputSummary(result));
 
-void getInheritableValues(QPDFObjectHandle &parent, QPDFObjectHandle &object, std::map<std::string, QPDFObjectHandle> inherited_values, QPDF &pdf)
-{
-    //check for the inheritable attributes
-    std::map<std::string, QPDFObjectHandle> inherited;
+    return 0;
+}
 
-    inherited = inherited_values;
-    
-    std::cout<<object.getKey("/T").unparse()<<std::endl;
-    if(object.hasKey("/FT"))
+//Write the --stats and --trace files, if requested
+int writeReports(ReportOptions const& report, Metrics const& metrics)
+{
+    int status = 0;
+    if(!report.stats_file.empty())
     {
-        inherited.insert(std::pair<std::string, QPDFObjectHandle>("/FT", object.getKey("/FT")));
+        std::ofstream stats(report.stats_file.c_str());
+        metrics.writeReport(stats);
+        if(!stats.good())
+        {
+            FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, "cannot write " << report.stats_file);
+            status = 1;
+        }
     }
-    if(object.hasKey("/Ff"))
+    if(!report.trace_file.empty())
     {
-        inherited.insert(std::pair<std::string, QPDFObjectHandle>("/Ff", object.getKey("/Ff")));
+        std::ofstream trace(report.trace_file.c_str());
+        metrics.writeTrace(trace);
+        if(!trace.good())
+        {
+            FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, "cannot write " << report.trace_file);
+            status = 1;
+        }
     }
-    if(object.hasKey("/V"))
+    return status;
+}
+
+//Batch mode: flatten every document of a manifest or directory into the
+//output directory, one document per worker thread
+int batchMain(ReportOptions const& report, FlattenOptions const& options)
+{
+    std::string output_dir = report.output_dir.empty() ? "flattened" : report.output_dir;
+    std::string summary_file = report.summary_file.empty() ?
+                               output_dir + "/summary.tsv" : report.summary_file;
+
+    std::vector<BatchJob> jobs;
+    try
     {
-        inherited.insert(std::pair<std::string, QPDFObjectHandle>("/V", object.getKey("/V")));
+        jobs = readBatch(report.batch, output_dir);
     }
-    if(object.hasKey("/DV"))
+    catch(std::exception &e)
     {
-        inherited.insert(std::pair<std::string, QPDFObjectHandle>("/DV", object.getKey("/DV")));
+        FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, e.what());
+        return 1;
     }
-    if(object.hasKey("/DA"))
+    if(mkdir(output_dir.c_str(), 0777) != 0 && errno != EEXIST)
     {
-        inherited.insert(std::pair<std::string, QPDFObjectHandle>("/DA", object.getKey("/DA")));
+        FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, "cannot create " << output_dir << ": " << strerror(errno));
+        return 1;
     }
-    if(object.hasKey("/Q"))
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    runBatch(jobs, options, options.jobs);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::ofstream summary(summary_file.c_str());
+    writeBatchSummary(summary, jobs);
+    summary.close();
+    if(!summary)
     {
-        inherited.insert(std::pair<std::string, QPDFObjectHandle>("/Q", object.getKey("/Q")));
+        FLATTEN_LOG(&logger, FLATTEN_LOG_ERROR, "cannot write " << summary_file);
+        return 1;
     }
 
-    //Check if the field is field dictionary
-    if(object.hasKey("/Kids"))
+    size_t failed = 0;
+    for(size_t i = 0; i < jobs.size(); ++i)
+        failed += jobs[i].result.success ? 0 : 1;
+
+    std::cerr<<"Flattened "<<jobs.size() - failed<<" of "<<jobs.size()<<" documents in "
+             <<elapsed.count()<<" s ("<<(elapsed.count() > 0 ? jobs.size() / elapsed.count() : 0)
+             <<" documents/s), summary in "<<summary_file<<std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+//What became of the form, for the standalone modes
+void printOutcome(FlattenResult const& result)
+{
+    if(result.output_cache_hit)
     {
-        //recursively descend into children as well
-        std::vector<QPDFObjectHandle> children = object.getKey("/Kids").getArrayAsVector();
-        for(std::vector<QPDFObjectHandle>::iterator child_iterator = children.begin();
-            child_iterator < children.end(); ++child_iterator)
-        {
-            QPDFObjectHandle child = *child_iterator;
-            getInheritableValues(object, child, inherited, pdf);
-        }
+        std::cerr<<"PDF flattened before, served from the output cache"<<std::endl;
     }
-    //If not kids but only parent is present, then the object has to be
-    //both, a field dictionary as well as annotation dictionary
-    else if(object.hasKey("/Parent"))
+    else if(result.passed_through)
     {
-        generateOneAppearance(object, object, inherited, pdf);
+        std::cerr<<(result.acroform_present ? "No printable form fields in the PDF"
+                                            : "Acroform not present in the PDF")<<std::endl;
     }
-    //If both are not present, then that means it is a top level annotation with
-    //Field and annotation dictionaries merged together
+    else if(result.cancelled)
+    {
+        std::cerr<<"PDF partially flattened, stopped during "<<result.cancelled_in
+                 <<" after "<<result.widgets_flattened<<" widgets"<<std::endl;
+    }
+    else if(result.acroform_present)
+    {
+        std::cerr<<"PDF flattened successfully\nAcroForm removed"<<std::endl;
+        if(result.appearances_deduplicated != 0)
+            std::cerr<<"Deduplicated "<<result.appearances_deduplicated<<" appearances, saving "
+                     <<result.appearance_bytes_saved<<" bytes"<<std::endl;
+    }    
     else
     {
-        generateOneAppearance(parent, object, inherited, pdf);
+        std::cerr<<"Acroform not present in the PDF"<<std::endl;
     }
 }
 
-void needAppearances(QPDF &pdf)
+//Standalone mode: flatten input_file into output.pdf
+int fileMain(char const* filename, FlattenOptions const& options)
 {
-
-    //Get all the pages present in the PDF document
-    std::vector<QPDFObjectHandle> all_pages = pdf.getAllPages();
-    for(std::vector<QPDFObjectHandle>::iterator page_iter = all_pages.begin();
-        page_iter < all_pages.end(); ++page_iter)
+    //written beside output.pdf and renamed over it once complete, so a
+    //failure leaves an earlier output.pdf as it was
+    std::string temporary = "output.pdf.part";
+    int output = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(output < 0)
     {
-        std::cerr<<"DBG:\t Working on a new page"<<std::endl;
-        QPDFObjectHandle page = *page_iter;
+        std::cerr<<"Error: cannot create "<<temporary<<": "<<strerror(errno)<<std::endl;
+        return 1;
+    }
 
-        if(!isKeyPresent(page,"/Annots"))
-            continue;
+    FormFlattener flattener(options);
+    FlattenResult result = flattener.flattenFileToFd(filename, output);
+    if(close(output) != 0 && result.success)
+    {
+        result.success = false;
+        result.error = std::string("cannot write output.pdf: ") + strerror(errno);
+    }
+    if(result.success && rename(temporary.c_str(), "output.pdf") != 0)
+    {
+        result.success = false;
+        result.error = std::string("cannot write output.pdf: ") + strerror(errno);
+    }
+    if(!result.success)
+    {
+        unlink(temporary.c_str());
+        std::cerr<<"Error: "<<result.error<<std::endl;
+        return 1;
+    }
 
-        //Get all the annotations present in the page
-        std::vector<QPDFObjectHandle> annotations = page.getKey("/Annots").getArrayAsVector();
+    printOutcome(result);
+    std::cerr<<outputSummary(result)<<std::endl;
+    return 0;   
+}
 
-        //Iterate over every annotation present on the page       
-        for(std::vector<QPDFObjectHandle>::iterator annot_iter = annotations.begin(); 
-            annot_iter < annotations.end(); ++annot_iter)
+//Standalone mode with --shards or --shard-size: flatten input_file in
+//memory and split it into output-NNN.pdf, listed in output-manifest.tsv.
+//The manifest is written first, each shard appears once it is complete
+int shardMain(char const* filename, FlattenOptions const& options, ReportOptions const& report)
+{
+    //the flattened document is only parsed again by the shard writers, so
+    //it skips the work of the profile; the shards are written with it
+    FlattenOptions flatten_options = options;
+    flatten_options.profile = PROFILE_FAST;
+    flatten_options.incremental = false;
+
+    FormFlattener flattener(flatten_options);
+    Pl_Buffer flattened("flattened document");
+    FlattenResult result = flattener.flattenFile(filename, &flattened);
+    if(!result.success)
+    {
+        std::cerr<<"Error: "<<result.error<<std::endl;
+        return 1;
+    }
+    PointerHolder<Buffer> document = flattened.getBuffer();
+    char const* data = reinterpret_cast<char const*>(document->getBuffer());
+    size_t len = document->getSize();
+
+    ShardOptions shard_options;
+    shard_options.count = report.shards;
+    shard_options.target_bytes = report.shard_kb * 1024;
+    //shards are independent, unlike the pages of one document the
+    //flattener builds, so they are written on all cores by default
+    if(report.jobs_set)
+        shard_options.jobs = options.jobs;
+    shard_options.profile = options.profile;
+    shard_options.metrics = options.metrics;
+
+    std::string manifest_file = shard_options.prefix + "-manifest.tsv";
+    std::vector<Shard> shards;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try
+    {
+        QPDF pdf;
+        pdf.processMemoryFile("flattened document", data, len);
+        shards = planShards(pdf, shard_options);
+
+        std::string temporary = manifest_file + ".part";
+        std::ofstream manifest(temporary.c_str());
+        writeShardManifest(manifest, shards);
+        manifest.close();
+        if(!manifest || rename(temporary.c_str(), manifest_file.c_str()) != 0)
         {
-            std::cerr<<"DBG:\t Working on a new Annot"<<std::endl;
-            QPDFObjectHandle annot = *annot_iter;
-            std::map<std::string, QPDFObjectHandle> inherited_values;
-            getInheritableValues(annot, annot, inherited_values, pdf);
-            count++;
+            unlink(temporary.c_str());
+            throw std::runtime_error("cannot write " + manifest_file);
         }
+
+        writeShards(pdf, data, len, shards, shard_options);
+    }
+    catch(std::exception &e)
+    {
+        std::cerr<<"Error: "<<e.what()<<std::endl;
+        return 1;
     }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    long long bytes = 0;
+    for(size_t n = 0; n < shards.size(); ++n)
+    {
+        bytes += shards[n].bytes_written;
+        FLATTEN_LOG(&logger, FLATTEN_LOG_DEBUG, shards[n].filename << ": pages " << shards[n].first_page << "-"
+                    << shards[n].first_page + shards[n].page_count - 1 << ", "
+                    << shards[n].bytes_written << " bytes (estimated " << shards[n].bytes_estimated
+                    << ") in " << shards[n].seconds * 1000 << " ms");
+    }
+
+    printOutcome(result);
+    std::cerr<<"Wrote "<<shards.size()<<" shards, "<<bytes<<" bytes as "
+             <<outputProfileName(options.profile)<<" in "<<elapsed.count()<<" ms, manifest in "
+             <<manifest_file<<std::endl;
+    return 0;
 }
 
 int main(int argc, char** argv)
 {
-    QPDF pdf;
-    if(argc<2)
-    {
+    FlattenOptions options;
+    ReportOptions report;
+    std::vector<char*> args;
+    parseOptions(argc, argv, options, report, args);
+    argc = args.size();
+    argv = args.data();
+
+    bool batch = !report.batch.empty();
+    bool filter = !batch && (argc == 6 || argc == 7);
+    if(batch ? argc != 1 : !filter && argc != 2)
+        usage();
+    //shards are files of their own, neither a batch nor cupsd expects them
+    bool sharded = report.shards != 0 || report.shard_kb != 0;
+    if(sharded && (batch || filter))
         usage();
-    }
 
-    pdf.processFile(argv[1]);
-    
-    //Check if /AcroForm is present, and if it is present
-    //then process further
-    if(acroformPresent(pdf))
+    //in filter mode cupsd decides what to keep, standalone runs stay quiet
+    logger.setLevel(report.log_level_set ? report.log_level : (filter ? FLATTEN_LOG_DEBUG : FLATTEN_LOG_WARNING));
+    options.log = &logger;
+
+    Metrics metrics(!report.trace_file.empty());
+    if(!report.stats_file.empty() || !report.trace_file.empty())
+        options.metrics = &metrics;
+
+    int status;
+    if(batch)
+        status = batchMain(report, options);
+    else if(filter)
+        status = filterMain(argc, argv, options);
+    else if(sharded)
+        status = shardMain(argv[1], options, report);
+    else
+        status = fileMain(argv[1], options);
+
+    //the budget sizes the batches and decides when generated data
+    //spills, parsing and writing are not bounded by it
+    if(options.max_rss_kb > 0)
     {
-        QPDFObjectHandle root = pdf.getRoot();
-        if(!root.getKey("/AcroForm").hasKey("/NeedAppearances") ||
-           root.getKey("/AcroForm").getKey("/NeedAppearances").unparse() != "true")
-        {
-            NoNeedAppearances(pdf);
-        }
-        else
-        {
-            std::cerr<<"This PDF form needs generation of appearances"<<std::endl;
-            needAppearances(pdf);
-            root.getKey("/AcroForm").removeKey("/NeedAppearances");
-            NoNeedAppearances(pdf);    
-        }
-        QPDFWriter w(pdf, "output.pdf");
-        w.write();
-    }    
-    return 0;   
+        metrics.maximum("max_rss_kb", options.max_rss_kb);
+        if(peakRssKb() > options.max_rss_kb)
+            FLATTEN_LOG(&logger, FLATTEN_LOG_WARNING, "Peak RSS " << peakRssKb() << " kB exceeded the budget of "
+                        << options.max_rss_kb << " kB");
+    }
+    if(writeReports(report, metrics) != 0 && status == 0)
+        status = 1;
+    logger.flush();
+    return status;
 }
@@ -0,0 +1,549 @@
+#include "FontMetrics.hh"
+
+#include <qpdf/Buffer.hh>
+
+#include <algorithm>
+#include <exception>
+
+//Widths of codes 32 to 255 from the Adobe AFM files of the standard 14
+//fonts, 0 where the encoding leaves a code undefined. The text faces are
+//in WinAnsiEncoding, where the unused codes show a bullet. The oblique
+//Helvetica faces have the widths of the upright ones and all Courier
+//faces are 600 wide
+static short const helvetica_widths[224] =
+{
+    278, 278, 355, 556, 556, 889, 667, 191, 333, 333, 389, 584, 278, 333, 278, 278,
+    556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 278, 278, 584, 584, 584, 556,
+    1015, 667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556, 833, 722, 778,
+    667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 278, 278, 278, 469, 556,
+    333, 556, 556, 500, 556, 556, 278, 556, 556, 222, 222, 500, 222, 833, 556, 556,
+    556, 556, 333, 500, 278, 556, 500, 722, 500, 500, 500, 334, 260, 334, 584, 350,
+    556, 350, 222, 556, 333, 1000, 556, 556, 333, 1000, 667, 333, 1000, 350, 611, 350,
+    350, 222, 222, 333, 333, 350, 556, 1000, 333, 1000, 500, 333, 944, 350, 500, 667,
+    278, 333, 556, 556, 556, 556, 260, 556, 333, 737, 370, 556, 584, 333, 737, 333,
+    400, 584, 333, 333, 333, 556, 537, 278, 333, 333, 365, 556, 834, 834, 834, 611,
+    667, 667, 667, 667, 667, 667, 1000, 722, 667, 667, 667, 667, 278, 278, 278, 278,
+    722, 722, 778, 778, 778, 778, 778, 584, 778, 722, 722, 722, 722, 667, 667, 611,
+    556, 556, 556, 556, 556, 556, 889, 500, 556, 556, 556, 556, 278, 278, 278, 278,
+    556, 556, 556, 556, 556, 556, 556, 584, 611, 556, 556, 556, 556, 500, 556, 500
+};
+
+static short const helvetica_bold_widths[224] =
+{
+    278, 333, 474, 556, 556, 889, 722, 238, 333, 333, 389, 584, 278, 333, 278, 278,
+    556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 333, 333, 584, 584, 584, 611,
+    975, 722, 722, 722, 722, 667, 611, 778, 722, 278, 556, 722, 611, 833, 722, 778,
+    667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 333, 278, 333, 584, 556,
+    333, 556, 611, 556, 611, 556, 333, 611, 611, 278, 278, 556, 278, 889, 611, 611,
+    611, 611, 389, 556, 333, 611, 556, 778, 556, 556, 500, 389, 280, 389, 584, 350,
+    556, 350, 278, 556, 500, 1000, 556, 556, 333, 1000, 667, 333, 1000, 350, 611, 350,
+    350, 278, 278, 500, 500, 350, 556, 1000, 333, 1000, 556, 333, 944, 350, 500, 667,
+    278, 333, 556, 556, 556, 556, 280, 556, 333, 737, 370, 556, 584, 333, 737, 333,
+    400, 584, 333, 333, 333, 611, 556, 278, 333, 333, 365, 556, 834, 834, 834, 611,
+    722, 722, 722, 722, 722, 722, 1000, 722, 667, 667, 667, 667, 278, 278, 278, 278,
+    722, 722, 778, 778, 778, 778, 778, 584, 778, 722, 722, 722, 722, 667, 667, 611,
+    556, 556, 556, 556, 556, 556, 889, 556, 556, 556, 556, 556, 278, 278, 278, 278,
+    611, 611, 611, 611, 611, 611, 611, 584, 611, 611, 611, 611, 611, 556, 611, 556
+};
+
+static short const times_roman_widths[224] =
+{
+    250, 333, 408, 500, 500, 833, 778, 180, 333, 333, 500, 564, 250, 333, 250, 278,
+    500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 278, 278, 564, 564, 564, 444,
+    921, 722, 667, 667, 722, 611, 556, 722, 722, 333, 389, 722, 611, 889, 722, 722,
+    556, 722, 667, 556, 611, 722, 722, 944, 722, 722, 611, 333, 278, 333, 469, 500,
+    333, 444, 500, 444, 500, 444, 333, 500, 500, 278, 278, 500, 278, 778, 500, 500,
+    500, 500, 333, 389, 278, 500, 500, 722, 500, 500, 444, 480, 200, 480, 541, 350,
+    500, 350, 333, 500, 444, 1000, 500, 500, 333, 1000, 556, 333, 889, 350, 611, 350,
+    350, 333, 333, 444, 444, 350, 500, 1000, 333, 980, 389, 333, 722, 350, 444, 722,
+    250, 333, 500, 500, 500, 500, 200, 500, 333, 760, 276, 500, 564, 333, 760, 333,
+    400, 564, 300, 300, 333, 500, 453, 250, 333, 300, 310, 500, 750, 750, 750, 444,
+    722, 722, 722, 722, 722, 722, 889, 667, 611, 611, 611, 611, 333, 333, 333, 333,
+    722, 722, 722, 722, 722, 722, 722, 564, 722, 722, 722, 722, 722, 722, 556, 500,
+    444, 444, 444, 444, 444, 444, 667, 444, 444, 444, 444, 444, 278, 278, 278, 278,
+    500, 500, 500, 500, 500, 500, 500, 564, 500, 500, 500, 500, 500, 500, 500, 500
+};
+
+static short const times_bold_widths[224] =
+{
+    250, 333, 555, 500, 500, 1000, 833, 278, 333, 333, 500, 570, 250, 333, 250, 278,
+    500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 333, 333, 570, 570, 570, 500,
+    930, 722, 667, 722, 722, 667, 611, 778, 778, 389, 500, 778, 667, 944, 722, 778,
+    611, 778, 722, 556, 667, 722, 722, 1000, 722, 722, 667, 333, 278, 333, 581, 500,
+    333, 500, 556, 444, 556, 444, 333, 500, 556, 278, 333, 556, 278, 833, 556, 500,
+    556, 556, 444, 389, 333, 556, 500, 722, 500, 500, 444, 394, 220, 394, 520, 350,
+    500, 350, 333, 500, 500, 1000, 500, 500, 333, 1000, 556, 333, 1000, 350, 667, 350,
+    350, 333, 333, 500, 500, 350, 500, 1000, 333, 1000, 389, 333, 722, 350, 444, 722,
+    250, 333, 500, 500, 500, 500, 220, 500, 333, 747, 300, 500, 570, 333, 747, 333,
+    400, 570, 300, 300, 333, 556, 540, 250, 333, 300, 330, 500, 750, 750, 750, 500,
+    722, 722, 722, 722, 722, 722, 1000, 722, 667, 667, 667, 667, 389, 389, 389, 389,
+    722, 722, 778, 778, 778, 778, 778, 570, 778, 722, 722, 722, 722, 722, 611, 556,
+    500, 500, 500, 500, 500, 500, 722, 444, 444, 444, 444, 444, 278, 278, 278, 278,
+    500, 556, 500, 500, 500, 500, 500, 570, 500, 556, 556, 556, 556, 500, 556, 500
+};
+
+static short const times_italic_widths[224] =
+{
+    250, 333, 420, 500, 500, 833, 778, 214, 333, 333, 500, 675, 250, 333, 250, 278,
+    500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 333, 333, 675, 675, 675, 500,
+    920, 611, 611, 667, 722, 611, 611, 722, 722, 333, 444, 667, 556, 833, 667, 722,
+    611, 722, 611, 500, 556, 722, 611, 833, 611, 556, 556, 389, 278, 389, 422, 500,
+    333, 500, 500, 444, 500, 444, 278, 500, 500, 278, 278, 444, 278, 722, 500, 500,
+    500, 500, 389, 389, 278, 500, 444, 667, 444, 444, 389, 400, 275, 400, 541, 350,
+    500, 350, 333, 500, 556, 889, 500, 500, 333, 1000, 500, 333, 944, 350, 556, 350,
+    350, 333, 333, 556, 556, 350, 500, 889, 333, 980, 389, 333, 667, 350, 389, 556,
+    250, 389, 500, 500, 500, 500, 275, 500, 333, 760, 276, 500, 675, 333, 760, 333,
+    400, 675, 300, 300, 333, 500, 523, 250, 333, 300, 310, 500, 750, 750, 750, 500,
+    611, 611, 611, 611, 611, 611, 889, 667, 611, 611, 611, 611, 333, 333, 333, 333,
+    722, 667, 722, 722, 722, 722, 722, 675, 722, 722, 722, 722, 722, 556, 611, 500,
+    500, 500, 500, 500, 500, 500, 667, 444, 444, 444, 444, 444, 278, 278, 278, 278,
+    500, 500, 500, 500, 500, 500, 500, 675, 500, 500, 500, 500, 500, 444, 500, 444
+};
+
+static short const times_bold_italic_widths[224] =
+{
+    250, 389, 555, 500, 500, 833, 778, 278, 333, 333, 500, 570, 250, 333, 250, 278,
+    500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 333, 333, 570, 570, 570, 500,
+    832, 667, 667, 667, 722, 667, 667, 722, 778, 389, 500, 667, 611, 889, 722, 722,
+    611, 722, 667, 556, 611, 722, 667, 889, 667, 611, 611, 333, 278, 333, 570, 500,
+    333, 500, 500, 444, 500, 444, 333, 500, 556, 278, 278, 500, 278, 778, 556, 500,
+    500, 500, 389, 389, 278, 556, 444, 667, 500, 444, 389, 348, 220, 348, 570, 350,
+    500, 350, 333, 500, 500, 1000, 500, 500, 333, 1000, 556, 333, 944, 350, 611, 350,
+    350, 333, 333, 500, 500, 350, 500, 1000, 333, 1000, 389, 333, 722, 350, 389, 611,
+    250, 389, 500, 500, 500, 500, 220, 500, 333, 747, 266, 500, 606, 333, 747, 333,
+    400, 570, 300, 300, 333, 576, 500, 250, 333, 300, 300, 500, 750, 750, 750, 500,
+    667, 667, 667, 667, 667, 667, 944, 667, 667, 667, 667, 667, 389, 389, 389, 389,
+    722, 722, 722, 722, 722, 722, 722, 570, 722, 722, 722, 722, 722, 611, 611, 500,
+    500, 500, 500, 500, 500, 500, 722, 444, 444, 444, 444, 444, 278, 278, 278, 278,
+    500, 556, 500, 500, 500, 500, 500, 570, 500, 556, 556, 556, 556, 444, 500, 444
+};
+
+//Symbol and ZapfDingbats in their built in encodings
+static short const symbol_widths[224] =
+{
+    250, 333, 713, 500, 549, 833, 778, 439, 333, 333, 500, 549, 250, 549, 250, 278,
+    500, 500, 500, 500, 500, 500, 500, 500, 500, 500, 278, 278, 549, 549, 549, 444,
+    549, 722, 667, 722, 612, 611, 763, 603, 722, 333, 631, 722, 686, 889, 722, 722,
+    768, 741, 556, 592, 611, 690, 439, 768, 645, 795, 611, 333, 863, 333, 658, 500,
+    500, 631, 549, 549, 494, 439, 521, 411, 603, 329, 603, 549, 549, 576, 521, 549,
+    549, 521, 549, 603, 439, 576, 713, 686, 493, 686, 494, 480, 200, 480, 549, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    750, 620, 247, 549, 167, 713, 500, 753, 753, 753, 753, 1042, 987, 603, 987, 603,
+    400, 549, 411, 549, 549, 713, 494, 460, 549, 549, 549, 549, 1000, 603, 1000, 658,
+    823, 686, 795, 987, 768, 768, 823, 768, 768, 713, 713, 713, 713, 713, 713, 713,
+    768, 713, 790, 790, 890, 823, 549, 250, 713, 603, 603, 1042, 987, 603, 987, 603,
+    494, 329, 790, 790, 786, 713, 384, 384, 384, 384, 384, 384, 494, 494, 494, 494,
+    0, 329, 274, 686, 686, 686, 384, 384, 384, 384, 384, 384, 494, 494, 494, 0
+};
+
+static short const zapf_dingbats_widths[224] =
+{
+    278, 974, 961, 974, 980, 719, 789, 790, 791, 690, 960, 939, 549, 855, 911, 933,
+    911, 945, 974, 755, 846, 762, 761, 571, 677, 763, 760, 759, 754, 494, 552, 537,
+    577, 692, 786, 788, 788, 790, 793, 794, 816, 823, 789, 841, 823, 833, 816, 831,
+    923, 744, 723, 749, 790, 792, 695, 776, 768, 792, 759, 707, 708, 682, 701, 826,
+    815, 789, 789, 707, 687, 696, 689, 786, 787, 713, 791, 785, 791, 873, 761, 762,
+    762, 759, 759, 892, 892, 788, 784, 438, 138, 277, 415, 392, 392, 668, 668, 0,
+    390, 390, 317, 317, 276, 276, 509, 509, 410, 410, 234, 234, 334, 334, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 732, 544, 544, 910, 667, 760, 760, 776, 595, 694, 626, 788, 788, 788, 788,
+    788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788,
+    788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788, 788,
+    788, 788, 788, 788, 894, 838, 1016, 458, 748, 924, 748, 918, 927, 928, 928, 834,
+    873, 828, 924, 924, 917, 930, 931, 463, 883, 836, 836, 867, 867, 696, 696, 874,
+    0, 874, 760, 946, 771, 865, 771, 888, 967, 888, 831, 873, 927, 970, 918, 0
+};
+
+//Codes below 32 are undefined in all of these encodings
+static void fillMetrics(FontMetrics &metrics, short const* table, double ascent, double descent)
+{
+    for(int c = 0; c < 256; ++c)
+        metrics.widths[c] = c >= 32 ? table[c - 32] : 0;
+    metrics.ascent = ascent;
+    metrics.descent = descent;
+}
+
+static void fillFixed(FontMetrics &metrics, double width, double ascent, double descent)
+{
+    for(int c = 0; c < 256; ++c)
+        metrics.widths[c] = c >= 32 ? width : 0;
+    metrics.ascent = ascent;
+    metrics.descent = descent;
+}
+
+FontMetrics::FontMetrics()
+    : ascent(718),
+      descent(-207),
+      encoding(ENCODING_WIN_ANSI),
+      two_byte_codes(false),
+      default_width(1000)
+{
+    for(int c = 0; c < 256; ++c)
+        widths[c] = 556;
+}
+
+double FontMetrics::width(std::string const& text) const
+{
+    double total = 0;
+    if(!two_byte_codes)
+    {
+        for(size_t i = 0; i < text.size(); ++i)
+            total += widths[static_cast<unsigned char>(text[i])];
+        return total;
+    }
+
+    for(size_t i = 0; i + 1 < text.size(); i += 2)
+    {
+        unsigned int cid = (static_cast<unsigned char>(text[i]) << 8) |
+                           static_cast<unsigned char>(text[i + 1]);
+        std::map<unsigned int, double>::const_iterator it = cid_widths.find(cid);
+        total += it != cid_widths.end() ? it->second : default_width;
+    }
+    return total;
+}
+
+FontMetrics const& standardFontMetrics(std::string const& base_font)
+{
+    struct StandardFonts
+    {
+        StandardFonts()
+        {
+            fillMetrics(helvetica, helvetica_widths, 718, -207);
+            fillMetrics(helvetica_bold, helvetica_bold_widths, 718, -207);
+            fillMetrics(times, times_roman_widths, 683, -217);
+            fillMetrics(times_bold, times_bold_widths, 676, -205);
+            fillMetrics(times_italic, times_italic_widths, 683, -205);
+            fillMetrics(times_bold_italic, times_bold_italic_widths, 699, -205);
+            fillFixed(courier, 600, 629, -157);
+            fillFixed(courier_bold, 600, 626, -142);
+            //neither has ascender lines in its AFM, the font box stands in
+            fillMetrics(symbol, symbol_widths, 1010, -293);
+            symbol.encoding = ENCODING_BUILTIN;
+            fillMetrics(zapf_dingbats, zapf_dingbats_widths, 820, -143);
+            zapf_dingbats.encoding = ENCODING_BUILTIN;
+        }
+
+        FontMetrics helvetica;
+        FontMetrics helvetica_bold;
+        FontMetrics times;
+        FontMetrics times_bold;
+        FontMetrics times_italic;
+        FontMetrics times_bold_italic;
+        FontMetrics courier;
+        FontMetrics courier_bold;
+        FontMetrics symbol;
+        FontMetrics zapf_dingbats;
+    };
+    static StandardFonts const fonts;
+
+    if(base_font.compare(0, 6, "Symbol") == 0)
+        return fonts.symbol;
+    if(base_font.compare(0, 12, "ZapfDingbats") == 0)
+        return fonts.zapf_dingbats;
+
+    //the style is spelled Times-BoldItalic, Arial,Bold or
+    //CourierNewPS-BoldItalicMT depending on the producer
+    bool bold = base_font.find("Bold") != std::string::npos;
+    bool italic = base_font.find("Italic") != std::string::npos ||
+                  base_font.find("Oblique") != std::string::npos;
+    if(base_font.compare(0, 7, "Courier") == 0)
+        return bold ? fonts.courier_bold : fonts.courier;
+    if(base_font.compare(0, 5, "Times") == 0)
+    {
+        if(bold)
+            return italic ? fonts.times_bold_italic : fonts.times_bold;
+        return italic ? fonts.times_italic : fonts.times;
+    }
+    return bold ? fonts.helvetica_bold : fonts.helvetica;
+}
+
+//Big endian integers of a font program, 0 past its end
+static unsigned int readU16(std::string const& data, size_t offset)
+{
+    if(offset + 2 > data.size())
+        return 0;
+    return (static_cast<unsigned char>(data[offset]) << 8) | static_cast<unsigned char>(data[offset + 1]);
+}
+
+static unsigned long readU32(std::string const& data, size_t offset)
+{
+    return (static_cast<unsigned long>(readU16(data, offset)) << 16) | readU16(data, offset + 2);
+}
+
+//Offset of a table of a TrueType program, 0 if it has none
+static size_t trueTypeTable(std::string const& data, char const* tag)
+{
+    unsigned int count = readU16(data, 4);
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        size_t record = 12 + 16 * static_cast<size_t>(i);
+        if(record + 16 <= data.size() && data.compare(record, 4, tag) == 0)
+            return readU32(data, record + 8);
+    }
+    return 0;
+}
+
+//Glyph of code in the cmap subtable at offset, formats 0, 4 and 6 as
+//used for the single byte and BMP mappings. 0 if unmapped
+static unsigned int cmapGlyph(std::string const& data, size_t offset, unsigned int code)
+{
+    unsigned int format = readU16(data, offset);
+    if(format == 0)
+        return code < 256 && offset + 6 + code < data.size() ? static_cast<unsigned char>(data[offset + 6 + code]) : 0;
+    if(format == 6)
+    {
+        unsigned int first = readU16(data, offset + 6);
+        unsigned int count = readU16(data, offset + 8);
+        return code >= first && code - first < count ? readU16(data, offset + 10 + 2 * (code - first)) : 0;
+    }
+    if(format != 4)
+        return 0;
+
+    size_t segments = readU16(data, offset + 6) / 2;
+    size_t ends = offset + 14;
+    size_t starts = ends + 2 * segments + 2;
+    size_t deltas = starts + 2 * segments;
+    size_t ranges = deltas + 2 * segments;
+    for(size_t i = 0; i < segments; ++i)
+    {
+        if(code > readU16(data, ends + 2 * i))
+            continue;
+        unsigned int start = readU16(data, starts + 2 * i);
+        if(code < start)
+            return 0;
+        unsigned int delta = readU16(data, deltas + 2 * i);
+        unsigned int range = readU16(data, ranges + 2 * i);
+        if(range == 0)
+            return (code + delta) & 0xffff;
+        unsigned int glyph = readU16(data, ranges + 2 * i + range + 2 * (code - start));
+        return glyph != 0 ? (glyph + delta) & 0xffff : 0;
+    }
+    return 0;
+}
+
+//Widths of the codes of a simple TrueType font from the hmtx table of its
+///FontFile2. Codes go through the symbolic (3,0) cmap, the (3,1) Unicode
+//one for WinAnsiEncoding or the (1,0) Mac one, like viewers do. Codes
+//without a glyph keep their width. False if the program cannot be read
+static bool trueTypeWidths(QPDFObjectHandle program, FontEncoding encoding, double widths[256])
+{
+    std::string data;
+    try
+    {
+        PointerHolder<Buffer> buffer = program.getStreamData();
+        data.assign(reinterpret_cast<char const*>(buffer->getBuffer()), buffer->getSize());
+    }
+    catch(std::exception &)
+    {
+        return false;
+    }
+
+    size_t head = trueTypeTable(data, "head");
+    size_t hhea = trueTypeTable(data, "hhea");
+    size_t hmtx = trueTypeTable(data, "hmtx");
+    size_t cmap = trueTypeTable(data, "cmap");
+    unsigned int units = readU16(data, head + 18);
+    unsigned int metric_count = readU16(data, hhea + 34);
+    if(head == 0 || hhea == 0 || hmtx == 0 || cmap == 0 || units == 0 || metric_count == 0)
+        return false;
+
+    size_t symbolic = 0, unicode = 0, mac = 0;
+    unsigned int subtables = readU16(data, cmap + 2);
+    for(unsigned int i = 0; i < subtables; ++i)
+    {
+        size_t record = cmap + 4 + 8 * static_cast<size_t>(i);
+        unsigned int platform = readU16(data, record);
+        unsigned int platform_encoding = readU16(data, record + 2);
+        size_t offset = cmap + readU32(data, record + 4);
+        if(platform == 3 && platform_encoding == 0)
+            symbolic = offset;
+        else if(platform == 3 && platform_encoding == 1)
+            unicode = offset;
+        else if(platform == 1 && platform_encoding == 0)
+            mac = offset;
+    }
+
+    for(unsigned int c = 0; c < 256; ++c)
+    {
+        unsigned int glyph = 0;
+        if(symbolic != 0)
+        {
+            glyph = cmapGlyph(data, symbolic, 0xf000 + c);
+            if(glyph == 0)
+                glyph = cmapGlyph(data, symbolic, c);
+        }
+        else if(unicode != 0 && encoding == ENCODING_WIN_ANSI && winAnsiUnicode(c) != 0)
+            glyph = cmapGlyph(data, unicode, winAnsiUnicode(c));
+        if(glyph == 0 && mac != 0)
+            glyph = cmapGlyph(data, mac, c);
+        if(glyph == 0)
+            continue;
+
+        //glyphs past the last metric share its advance
+        unsigned int metric = glyph < metric_count ? glyph : metric_count - 1;
+        widths[c] = readU16(data, hmtx + 4 * static_cast<size_t>(metric)) * 1000.0 / units;
+    }
+    return true;
+}
+
+//Widths of a CIDFont from /W, which holds runs of c [w1 w2 ...] and
+//ranges of c_first c_last w
+static void readCidWidths(QPDFObjectHandle w, std::map<unsigned int, double> &cid_widths)
+{
+    if(!w.isArray())
+        return;
+    int count = w.getArrayNItems();
+    for(int i = 0; i + 1 < count;)
+    {
+        QPDFObjectHandle first = w.getArrayItem(i);
+        QPDFObjectHandle next = w.getArrayItem(i + 1);
+        if(!first.isInteger() || first.getIntValue() < 0)
+            return;
+        long long cid = first.getIntValue();
+        if(next.isArray())
+        {
+            int run = next.getArrayNItems();
+            for(int j = 0; j < run; ++j)
+            {
+                if(next.getArrayItem(j).isNumber())
+                    cid_widths[cid + j] = next.getArrayItem(j).getNumericValue();
+            }
+            i += 2;
+            continue;
+        }
+
+        if(i + 2 >= count || !next.isInteger() || !w.getArrayItem(i + 2).isNumber())
+            return;
+        //a malformed range could span every CID, keep it to two byte codes
+        long long last = std::min(next.getIntValue(), 0xffffLL);
+        double width = w.getArrayItem(i + 2).getNumericValue();
+        for(long long c = cid; c <= last; ++c)
+            cid_widths[c] = width;
+        i += 3;
+    }
+}
+
+FontMetricsCache::FontMetricsCache()
+    : load_count(0)
+{
+}
+
+FontMetrics const& FontMetricsCache::lookup(QPDFObjectHandle resources, std::string const& name)
+{
+    QPDFObjectHandle font;
+    if(resources.isDictionary() && resources.getKey("/Font").isDictionary())
+        font = resources.getKey("/Font").getKey(name);
+
+    if(font.isInitialized() && font.isIndirect())
+    {
+        std::map<QPDFObjGen, FontMetrics>::iterator it = indirect.find(font.getObjGen());
+        if(it == indirect.end())
+            it = indirect.insert(std::make_pair(font.getObjGen(), load(font))).first;
+        return it->second;
+    }
+
+    std::map<std::string, FontMetrics>::iterator it = direct.find(name);
+    if(it == direct.end())
+        it = direct.insert(std::make_pair(name, load(font))).first;
+    return it->second;
+}
+
+size_t FontMetricsCache::loads() const
+{
+    return load_count;
+}
+
+FontMetrics FontMetricsCache::load(QPDFObjectHandle font)
+{
+    load_count++;
+    if(!font.isInitialized() || !font.isDictionary())
+        return standardFontMetrics("Helvetica");
+
+    //subset fonts are named ABCDEF+BaseName
+    std::string base_font;
+    if(font.getKey("/BaseFont").isName())
+        base_font = font.getKey("/BaseFont").getName().substr(1);
+    if(base_font.size() > 7 && base_font[6] == '+')
+        base_font = base_font.substr(7);
+
+    FontMetrics metrics = standardFontMetrics(base_font);
+
+    QPDFObjectHandle descriptor = font.getKey("/FontDescriptor");
+    if(descriptor.isDictionary())
+    {
+        if(descriptor.getKey("/Ascent").isNumber() && descriptor.getKey("/Ascent").getNumericValue() > 0)
+            metrics.ascent = descriptor.getKey("/Ascent").getNumericValue();
+        if(descriptor.getKey("/Descent").isNumber() && descriptor.getKey("/Descent").getNumericValue() < 0)
+            metrics.descent = descriptor.getKey("/Descent").getNumericValue();
+    }
+
+    //field text is converted to WinAnsiEncoding unless the font says
+    //otherwise. Differences to it are not taken into account
+    QPDFObjectHandle encoding = font.getKey("/Encoding");
+    if(encoding.isDictionary())
+        encoding = encoding.getKey("/BaseEncoding");
+    if(encoding.isName() && encoding.getName() != "/WinAnsiEncoding")
+        metrics.encoding = ENCODING_BUILTIN;
+    if(font.getKey("/Subtype").unparse() == "/Type3")
+        metrics.encoding = ENCODING_BUILTIN;
+
+    //composite fonts take their widths from the descendant CIDFont. Field
+    //text is shown as stored, so with an Identity CMap its bytes pair up
+    //into CIDs. Other CMaps are not read, codes are taken as CIDs
+    if(font.getKey("/Subtype").unparse() == "/Type0")
+    {
+        metrics.encoding = ENCODING_BUILTIN;
+        QPDFObjectHandle cmap = font.getKey("/Encoding");
+        metrics.two_byte_codes = cmap.isName() &&
+            (cmap.getName() == "/Identity-H" || cmap.getName() == "/Identity-V");
+
+        QPDFObjectHandle descendant = font.getKey("/DescendantFonts").getArrayItem(0);
+        metrics.default_width = 1000;
+        if(descendant.isDictionary() && descendant.getKey("/DW").isNumber())
+            metrics.default_width = descendant.getKey("/DW").getNumericValue();
+        if(descendant.isDictionary())
+            readCidWidths(descendant.getKey("/W"), metrics.cid_widths);
+
+        for(unsigned int c = 0; c < 256; ++c)
+        {
+            std::map<unsigned int, double>::const_iterator it = metrics.cid_widths.find(c);
+            metrics.widths[c] = it != metrics.cid_widths.end() ? it->second : metrics.default_width;
+        }
+        return metrics;
+    }
+
+    QPDFObjectHandle widths = font.getKey("/Widths");
+    if(widths.isArray() && font.getKey("/FirstChar").isInteger())
+    {
+        //Type3 glyph space is given by /FontMatrix
+        double scale = 1;
+        QPDFObjectHandle matrix = font.getKey("/FontMatrix");
+        if(matrix.isArray() && matrix.getArrayNItems() == 6 && matrix.getArrayItem(0).isNumber())
+            scale = matrix.getArrayItem(0).getNumericValue() * 1000;
+
+        if(descriptor.isDictionary() && descriptor.getKey("/MissingWidth").isNumber())
+        {
+            double missing = descriptor.getKey("/MissingWidth").getNumericValue() * scale;
+            for(int c = 0; c < 256; ++c)
+                metrics.widths[c] = missing;
+        }
+
+        long long first = font.getKey("/FirstChar").getIntValue();
+        int count = widths.getArrayNItems();
+        for(int i = 0; i < count; ++i)
+        {
+            long long code = first + i;
+            QPDFObjectHandle width = widths.getArrayItem(i);
+            if(code >= 0 && code < 256 && width.isNumber())
+                metrics.widths[code] = width.getNumericValue() * scale;
+        }
+    }
+    else if(descriptor.isDictionary() && descriptor.getKey("/FontFile2").isStream())
+    {
+        //required unless the font is one of the standard 14, but some
+        //producers embed a TrueType program and leave /Widths out
+        trueTypeWidths(descriptor.getKey("/FontFile2"), metrics.encoding, metrics.widths);
+    }
+    return metrics;
+}
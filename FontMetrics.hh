@@ -0,0 +1,59 @@
+#ifndef FONTMETRICS_HH
+#define FONTMETRICS_HH
+
+#include <qpdf/QPDFObjectHandle.hh>
+
+#include "TextEncoding.hh"
+
+#include <map>
+#include <string>
+
+//Horizontal metrics of a font in glyph space units (1000 per em). Simple
+//fonts are indexed by character code. Composite fonts with an Identity
+//CMap read text as two byte codes, which are CIDs and looked up in
+//cid_widths, widths then holds the width of CIDs 0 to 255
+struct FontMetrics
+{
+    FontMetrics();
+
+    double widths[256];
+    double ascent;
+    double descent;     //negative, below the baseline
+    FontEncoding encoding;      //how field text is converted to codes
+    bool two_byte_codes;
+    std::map<unsigned int, double> cid_widths;      //from /W
+    double default_width;       ///DW, for CIDs not in cid_widths
+
+    double width(std::string const& text) const;
+};
+
+//Metrics of one of the standard 14 fonts, by /BaseFont name without the
+//slash. Names like Arial,Bold or TimesNewRoman-Italic get the matching
+//standard face, other unknown names get Helvetica as viewers substitute it
+FontMetrics const& standardFontMetrics(std::string const& base_font);
+
+//Metrics of the fonts of a document, each font dictionary parsed once and
+//shared by all fields using it. Taken from /Widths or /W and
+///FontDescriptor when present, from an embedded TrueType program when a
+//simple font lacks /Widths, from the standard 14 tables otherwise
+class FontMetricsCache
+{
+public:
+    FontMetricsCache();
+
+    //Metrics of font name (with the slash) in the /Font dictionary of
+    //resources. Direct font dictionaries are cached by name
+    FontMetrics const& lookup(QPDFObjectHandle resources, std::string const& name);
+
+    //Number of font dictionaries parsed so far
+    size_t loads() const;
+
+private:
+    FontMetrics load(QPDFObjectHandle font);
+
+    std::map<QPDFObjGen, FontMetrics> indirect;
+    std::map<std::string, FontMetrics> direct;
+    size_t load_count;
+};
+
+#endif
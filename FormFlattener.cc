@@ -0,0 +1,1790 @@
+#include "FormFlattener.hh"
+#include "Parallel.hh"
+#include "AppearanceCache.hh"
+#include "ContentEmitter.hh"
+#include "FieldIndex.hh"
+#include "IncrementalWriter.hh"
+#include "Log.hh"
+#include "Metrics.hh"
+#include "SpillStore.hh"
+#include "PlanCache.hh"
+#include "MappedFile.hh"
+#include "OutputCache.hh"
+#include "Hash.hh"
+
+#include <qpdf/QPDFWriter.hh>
+#include <qpdf/Pl_Count.hh>
+#include <qpdf/BufferInputSource.hh>
+#include <qpdf/FileInputSource.hh>
+#include <qpdf/Pl_StdioFile.hh>
+
+#include <iostream>
+#include <cstdlib>
+#include <sstream>
+#include <cstring>
+#include <exception>
+#include <chrono>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <set>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+enum Button {PUSH, CHECKBOX, RADIO};
+
+//Check if the given key exists in the dictionary
+bool isKeyPresent(QPDFObjectHandle obj, std::string key)
+{
+    //ensure that obj is dictionary
+    bool isDict = obj.isDictionary();
+    
+    if(isDict)
+    {
+        if(obj.hasKey(key))
+            return true;
+        else
+            return false;
+    }
+    
+    else
+    {
+        if(obj.getDict().hasKey(key))
+            return true;
+        else
+            return false;
+    }
+}
+
+
+//Function to check if the annotation is allowed to be printed
+bool annotationAllowed(unsigned int flags)
+{
+    bool value = true;
+    int bit = 0x01;   
+    
+    //check if annotation is invisible
+    if(flags & bit)
+        value = false;
+
+    //check if annotation is hidden
+    else if(flags & (bit<<1))
+        value = false;
+
+    //check if allowed to print
+    else if(!(flags & (bit<<2)))
+        value = false;
+
+    return value;
+}   
+
+
+//Check whether the document consists of AcroForm
+bool acroformPresent(QPDF &pdf)
+{
+    QPDFObjectHandle root = pdf.getRoot();
+    return root.hasKey("/AcroForm");
+}
+
+//A widget that the flattening passes would draw into its page. Widgets
+//without /F are made printable by them
+static bool printableWidget(QPDFObjectHandle annot)
+{
+    if(!annot.isDictionary() || annot.getKey("/Subtype").unparse() != "/Widget")
+        return false;
+
+    unsigned int flags = 4;
+    if(annot.getKey("/F").isNumber())
+        flags = static_cast<unsigned int>(annot.getKey("/F").getNumericValue());
+    return annotationAllowed(flags);
+}
+
+//Check whether flattening would change the printed document, that is if
+//a form has a widget that may be printed. Only the field tree is read,
+//and for widgets outside it the /Annots of the pages the field tree's
+//widgets name in /P. The page tree and the contents are never read
+bool needsFlattening(QPDF &pdf)
+{
+    QPDFObjectHandle acroform = pdf.getRoot().getKey("/AcroForm");
+    if(!acroform.isDictionary())
+        return false;
+
+    std::vector<QPDFObjectHandle> pending;
+    if(acroform.getKey("/Fields").isArray())
+        pending = acroform.getKey("/Fields").getArrayAsVector();
+    std::set<QPDFObjGen> seen;
+    std::vector<QPDFObjectHandle> pages;
+    std::set<QPDFObjGen> pages_seen;
+    while(!pending.empty())
+    {
+        QPDFObjectHandle node = pending.back();
+        pending.pop_back();
+        if(!node.isDictionary() || (node.isIndirect() && !seen.insert(node.getObjGen()).second))
+            continue;
+
+        QPDFObjectHandle kids = node.getKey("/Kids");
+        for(int i = 0; kids.isArray() && i < kids.getArrayNItems(); ++i)
+            pending.push_back(kids.getArrayItem(i));
+
+        if(printableWidget(node))
+            return true;
+
+        QPDFObjectHandle page = node.getKey("/P");
+        if(page.isIndirect() && pages_seen.insert(page.getObjGen()).second)
+            pages.push_back(page);
+    }
+
+    for(size_t p = 0; p < pages.size(); ++p)
+    {
+        QPDFObjectHandle annots = pages[p].getKey("/Annots");
+        for(int i = 0; annots.isArray() && i < annots.getArrayNItems(); ++i)
+        {
+            if(printableWidget(annots.getArrayItem(i)))
+                return true;
+        }
+    }
+    return false;
+}
+
+//Snapshot of one widget taken during the extraction phase. Apart from the
+//appearance handle, which only the commit phase uses, it holds plain
+//values so that the build phase never has to touch QPDF objects
+struct WidgetSnapshot
+{
+    size_t annot_index;             //position in the page's /Annots
+    QPDFObjectHandle appearance;    //null if one has to be created
+    bool is_dictionary;             //appearance is a dictionary, not a stream
+    bool assign_name;               //appearance gets /Name at commit
+    bool button;                    //appearance picked by /AS
+    QPDFObjectHandle resources;     //reduced /Resources to install, null if unchanged
+    std::string name;
+    bool translate;
+    bool scale;
+    double rect[4];
+    double bbox[4];
+};
+
+//Everything the build and commit phases need to know about one page
+struct PageSnapshot
+{
+    QPDFObjectHandle page;
+    std::vector<QPDFObjectHandle> annotations;
+    std::vector<size_t> default_flags;      //annotations without /F
+    std::vector<WidgetSnapshot> widgets;
+
+    //how each content stream of the page nests the graphics state
+    std::vector<ContentBalance> balances;
+};
+
+//Result of the build phase for one page
+struct PagePlan
+{
+    std::string contents;                   //Flate encoded
+    std::vector<bool> remove;               //per annotation in /Annots
+    bool wrap;                              //old contents need a q...Q around them
+    bool skipped;                           //not built, the job ran out of time
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+//With a memory budget generated stream data goes to the spill file once
+//resident memory passes this share of it, checked every
+//SPILL_CHECK_INTERVAL streams
+static long long const SPILL_BUDGET_PERCENT = 50;
+static size_t const SPILL_CHECK_INTERVAL = 16;
+
+//Memory a page and a generated stream are assumed to take in a batch
+//until the first batch has been measured
+static long long const BUDGET_PAGE_KB = 1024;
+static long long const BUDGET_STREAM_KB = 64;
+
+//Generated streams shorter than this are written as they are
+static size_t const MIN_PRECOMPRESS_SIZE = 64;
+
+//Install generated stream data, parked in the spill file when memory
+//nears the budget so that it is only read back while the output is
+//written
+static void setStreamData(FlattenContext &context, QPDFObjectHandle stream,
+                          std::string const& data, QPDFObjectHandle filter)
+{
+    if(context.precompress && filter.isNull() && data.size() >= MIN_PRECOMPRESS_SIZE)
+        context.uncompressed[stream.getObjGen()] = stream;
+    else
+        context.uncompressed.erase(stream.getObjGen());
+
+    long long max_rss_kb = context.options.max_rss_kb;
+    if(max_rss_kb > 0 && context.streams_set++ % SPILL_CHECK_INTERVAL == 0)
+        context.spilling = currentRssKb() * 100 >= max_rss_kb * SPILL_BUDGET_PERCENT;
+    if(!context.spilling)
+    {
+        stream.replaceStreamData(data, filter, QPDFObjectHandle::newNull());
+        return;
+    }
+    if(context.spill == NULL)
+    {
+        context.spill = new SpillStore();
+        context.spill_provider = context.spill;
+    }
+    context.spill->put(stream.getObjGen(), data);
+    stream.replaceStreamData(context.spill_provider, filter, QPDFObjectHandle::newNull());
+}
+
+//The field index, built on first use. With a loaded plan it may not be
+//needed at all
+static FieldIndex &fieldIndex(FlattenContext &context)
+{
+    if(!context.index_built)
+    {
+        PhaseTimer timer(context.options.metrics, "index", &context.result.phase_seconds);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        context.index.build(context.pdf);
+        context.index_built = true;
+        context.discovery_seconds += secondsSince(start);
+    }
+    return context.index;
+}
+
+//Checked at points where the document is consistent: between pages and
+//between batches. Once the job has run out of time this either fails it
+//or, for a partial result, tells the caller to stop where it is
+static bool stopRequested(FlattenContext &context, char const* phase)
+{
+    if(context.result.cancelled)
+        return true;
+    if(!context.expired())
+        return false;
+
+    FlattenResult &result = context.result;
+    FlattenOptions const& options = context.options;
+    result.cancelled = true;
+    result.cancelled_in = phase;
+
+    std::ostringstream why;
+    if(options.cancel != NULL && options.cancel->cancelled())
+        why << "cancelled";
+    else
+        why << "deadline of " << options.deadline_ms << " ms exceeded";
+    why << " during " << phase;
+    for(std::map<std::string, double>::const_iterator it = result.phase_seconds.begin();
+        it != result.phase_seconds.end(); ++it)
+        why << (it == result.phase_seconds.begin() ? " (" : ", ") << it->first << " "
+            << static_cast<long long>(it->second * 1000) << " ms";
+    if(!result.phase_seconds.empty())
+        why << ")";
+
+    if(!options.deadline_partial)
+        throw std::runtime_error(why.str());
+    FLATTEN_LOG(options.log, FLATTEN_LOG_WARNING, why.str() << ", writing a partially flattened document");
+    return true;
+}
+
+//The dictionary whose /XObject entries page uses, pages sharing their
+//resources share one
+static QPDFObjGen xobjectHolder(QPDFObjectHandle page)
+{
+    QPDFObjectHandle resources = page.getKey("/Resources");
+    if(resources.isDictionary())
+    {
+        QPDFObjectHandle xobjects = resources.getKey("/XObject");
+        if(xobjects.isIndirect())
+            return xobjects.getObjGen();
+        if(resources.isIndirect())
+            return resources.getObjGen();
+    }
+    return page.getObjGen();
+}
+
+//Name under which appearance is drawn on page. preferred, if not empty,
+//is used when the page's /XObject dictionary has it free or bound to the
+//same object, otherwise a /ResX name new to the page is generated. The
+//name is reserved for appearance until the commit phase adds it
+static std::string xobjectName(FlattenContext &context, QPDFObjectHandle page,
+                               QPDFObjectHandle appearance, std::string const& preferred)
+{
+    std::map<std::string, QPDFObjGen> &names = context.xobject_names[xobjectHolder(page)];
+    if(names.empty())
+    {
+        QPDFObjectHandle resources = page.getKey("/Resources");
+        if(isKeyPresent(resources, "/XObject"))
+        {
+            std::map<std::string, QPDFObjectHandle> existing = resources.getKey("/XObject").getDictAsMap();
+            for(std::map<std::string, QPDFObjectHandle>::iterator it = existing.begin(); it != existing.end(); ++it)
+                names[it->first] = it->second.isIndirect() ? it->second.getObjGen() : QPDFObjGen();
+        }
+    }
+
+    QPDFObjGen id = appearance.isInitialized() && appearance.isIndirect() ? appearance.getObjGen() : QPDFObjGen();
+    if(!preferred.empty())
+    {
+        std::map<std::string, QPDFObjGen>::iterator bound = names.find(preferred);
+        if(bound == names.end())
+        {
+            names[preferred] = id;
+            return preferred;
+        }
+        if(bound->second == id && !(id == QPDFObjGen()))
+            return preferred;
+    }
+
+    std::string name;
+    do
+    {
+        std::ostringstream xobj_count;
+        xobj_count << ++context.next_xobject_name;
+        name = "/ResX" + xobj_count.str();
+    } while(names.count(name) != 0);
+    names[name] = id;
+    return name;
+}
+
+//Extraction phase: read the widget geometry, flags and appearance
+//references of one page. Nothing in the document is modified, names that
+//still have to be assigned are tracked in pending_names so that
+//appearances shared between widgets keep a single name where the pages
+//allow it. Widgets in layout, if given, take their field type and /Rect
+//from the plan
+void extractPage(QPDFObjectHandle page, PageSnapshot &snapshot,
+                 std::map<QPDFObjGen, std::string> &pending_names,
+                 AppearanceCache* appearance_cache, FlattenContext &context,
+                 PageLayout const* layout)
+{
+    FlattenResult &result = context.result;
+
+    Logger* log = context.options.log;
+    FLATTEN_LOG(log, FLATTEN_LOG_DEBUG2, "Extracting page " << page.getObjGen().getObj());
+    snapshot.page = page;
+
+    //Get all the annotations present in the page
+    snapshot.annotations = page.getKey("/Annots").getArrayAsVector();
+
+    std::vector<WidgetPlan const*> planned(snapshot.annotations.size(), NULL);
+    for(size_t i = 0; layout != NULL && i < layout->widgets.size(); ++i)
+    {
+        if(layout->widgets[i].annot_index < planned.size())
+            planned[layout->widgets[i].annot_index] = &layout->widgets[i];
+    }
+
+    for(size_t annot_num = 0; annot_num < snapshot.annotations.size(); ++annot_num)
+    {
+        QPDFObjectHandle annot = snapshot.annotations[annot_num];
+        FLATTEN_LOG(log, FLATTEN_LOG_DEBUG2, "Annotation " << annot_num << " "
+                    << annot.getKey("/Subtype").unparse());
+        unsigned int flags = 0;
+        if(!isKeyPresent(annot, "/F"))
+        {
+            //Assuming it is not hidden and invisible and is allowed to print
+            flags = 4;
+            snapshot.default_flags.push_back(annot_num);
+        }
+        else
+        {
+            std::stringstream s(annot.getKey("/F").unparse());
+            s >> flags;
+        }
+
+        //preserve non-widget type annotations
+        if(annot.getKey("/Subtype").unparse() != "/Widget")
+        {
+            result.annotations_preserved++;
+            continue;
+        }
+
+        //Honour the flags(/F) present in the annotation
+        if(!annotationAllowed(flags))
+            continue;
+
+        WidgetSnapshot widget;
+        widget.annot_index = annot_num;
+        widget.is_dictionary = false;
+        widget.assign_name = false;
+        widget.button = false;
+        widget.translate = true;
+        widget.scale = false;
+        for(int i = 0; i < 4; ++i)
+        {
+            widget.rect[i] = 0;
+            widget.bbox[i] = 0;
+        }
+
+        if(isKeyPresent(annot,"/AP"))
+        {
+            QPDFObjectHandle normal_appearance = annot.getKey("/AP").getKey("/N");
+
+            //button might have /Yes or /Off states, the field type
+            //may be inherited from the parent field
+            if(planned[annot_num] != NULL)
+                widget.button = planned[annot_num]->button;
+            else
+                widget.button = fieldIndex(context).get(fieldIndex(context).lookup(annot),
+                                                        FieldIndex::FT).unparse() == "/Btn";
+            if(widget.button)
+            {
+                std::string appearance_state = annot.getKey("/AS").unparse();
+
+                FLATTEN_LOG(log, FLATTEN_LOG_DEBUG2, "Button appearance state " << appearance_state);
+                //The state might not be present in /N dictionary in which
+                //case it should be fetched from /D dictionary
+                if(!isKeyPresent(normal_appearance, appearance_state))
+                    normal_appearance = annot.getKey("/AP").getKey("/D").getKey(appearance_state);
+                else
+                    normal_appearance = normal_appearance.getKey(appearance_state);
+            }
+
+            //identical appearances share one XObject across the document
+            if(appearance_cache)
+                normal_appearance = appearance_cache->canonical(normal_appearance);
+
+            widget.appearance = normal_appearance;
+            widget.is_dictionary = normal_appearance.isDictionary();
+
+            //only the first widget showing a stream carries its new resources
+            if(context.options.minimize_resources)
+                widget.resources = context.resources.minimizeAppearance(normal_appearance);
+        }
+
+        //the appearance keeps the name given to it earlier or its own
+        ///Name, unless the page already uses that name for another object
+        std::string preferred;
+        std::map<QPDFObjGen, std::string>::iterator pending = pending_names.end();
+        if(widget.appearance.isInitialized())
+            pending = pending_names.find(widget.appearance.getObjGen());
+
+        if(pending != pending_names.end())
+        {
+            //named earlier during this extraction
+            preferred = pending->second;
+        }
+        else if(!widget.appearance.isInitialized() ||
+                !isKeyPresent(widget.appearance, "/Name"))
+        {
+            widget.assign_name = true;
+        }
+        else
+        {
+            if(!widget.is_dictionary) //it is a stream
+                preferred = widget.appearance.getDict().getKey("/Name").unparse();
+            else //it is a dictionary
+                preferred = widget.appearance.getKey("/Name").unparse();
+        }
+
+        widget.name = xobjectName(context, page, widget.appearance, preferred);
+        if(widget.assign_name)
+        {
+            FLATTEN_LOG(log, FLATTEN_LOG_DEBUG2, "Appearance has no /Name, using " << widget.name);
+            if(widget.appearance.isInitialized() && widget.appearance.isIndirect())
+                pending_names[widget.appearance.getObjGen()] = widget.name;
+        }
+        else if(widget.name != preferred)
+        {
+            FLATTEN_LOG(log, FLATTEN_LOG_DEBUG2, "Appearance name " << preferred << " taken on page "
+                        << page.getObjGen().getObj() << ", using " << widget.name);
+        }
+
+        //A missing appearance is replaced by an empty stream, which has no
+        ///Resources, so it only needs translation. The geometry belongs to
+        //the appearance of this fill, a plan never supplies it
+        if(widget.appearance.isInitialized())
+        {
+            AppearanceGeometry const& geometry = context.geometry.lookup(widget.appearance);
+            widget.translate = geometry.translate;
+            widget.scale = geometry.scale;
+            for(int i = 0; i < 4; ++i)
+                widget.bbox[i] = geometry.bbox[i];
+        }
+
+        if(planned[annot_num] != NULL)
+        {
+            for(int i = 0; i < 4; ++i)
+                widget.rect[i] = planned[annot_num]->rect[i];
+        }
+        else if(widget.translate || widget.scale || result.plan_cache_used)
+        {
+            //a plan records the /Rect whatever this fill's appearance needs
+            QPDFObjectHandle rect = annot.getKey("/Rect");
+            for(int i = 0; i < 4; ++i)
+                widget.rect[i] = rect.getArrayItem(i).getNumericValue();
+        }
+
+        snapshot.widgets.push_back(widget);
+    }
+
+    if(snapshot.widgets.empty())
+        return;
+
+    //The contents are left as they are, only scanned while decoding to
+    //tell whether they need wrapping. Streams shared between pages, as
+    //with templates, are scanned once
+    std::vector<QPDFObjectHandle> contents = page.getPageContents();
+    for(size_t i = 0; i < contents.size(); ++i)
+    {
+        std::map<QPDFObjGen, ContentBalance>::iterator cached =
+            context.balances.find(contents[i].getObjGen());
+        if(cached != context.balances.end())
+        {
+            snapshot.balances.push_back(cached->second);
+            continue;
+        }
+
+        BalanceScanner scanner;
+        ContentBalance balance;
+        try
+        {
+            if(contents[i].pipeStreamData(&scanner, true, false, false))
+                balance = scanner.result();
+        }
+        catch(std::exception &e)
+        {
+            FLATTEN_LOG(log, FLATTEN_LOG_DEBUG, "Contents of page " << page.getObjGen().getObj()
+                        << " not decodable, wrapping them: " << e.what());
+        }
+        context.balances[contents[i].getObjGen()] = balance;
+        snapshot.balances.push_back(balance);
+    }
+}
+
+//Build phase: compute the overlay content stream for one page. Runs on a
+//worker thread, so it may only read the plain values of the snapshot
+//(copying or dropping QPDFObjectHandles is not thread-safe)
+void buildPagePlan(PageSnapshot const& snapshot, PagePlan &plan)
+{
+    plan.remove.assign(snapshot.annotations.size(), false);
+    plan.wrap = true;
+    plan.skipped = false;
+
+    //pages without printable widgets keep their contents as they are
+    if(snapshot.widgets.empty())
+        return;
+
+    //contents that restore the graphics state themselves need no q...Q
+    plan.wrap = !leavesStateUnchanged(snapshot.balances);
+
+    //Create the content stream appended to the page: the Q closing the
+    //q stream put in front of the existing contents if they are wrapped,
+    //followed by one q...Q block per widget
+    ContentEmitter emitter;
+    emitter.reserve(8 + snapshot.widgets.size() * 96);
+    if(plan.wrap)
+        emitter.op("Q");
+
+    for(std::vector<WidgetSnapshot>::const_iterator widget = snapshot.widgets.begin();
+        widget != snapshot.widgets.end(); ++widget)
+    {
+        //APPLY TRANSFORMATIONS
+        double transformation_matrix[6] = {1,0,0,1,0,0};
+
+        //Get the llx and lly values of the annotation rectangle
+        if(widget->translate)
+        {
+            transformation_matrix[4] = widget->rect[0];
+            transformation_matrix[5] = widget->rect[1];
+        }
+
+        if(widget->scale)
+        {
+            double BBox_width = widget->bbox[2] - widget->bbox[0];
+            double BBox_height = widget->bbox[3] - widget->bbox[1];
+
+            double rect_width = widget->rect[2] - widget->rect[0];
+            double rect_height = widget->rect[3] - widget->rect[1];
+
+            //If width of BBox and Rectangle do not match then the
+            //transformation matrix should scale the BBox to the
+            //size of the annotation Rectangle
+            if(BBox_width - rect_width != 0 && BBox_height - rect_height !=0)
+            {
+                double scaleX = rect_width / BBox_width;
+                double scaleY = rect_height / BBox_height;
+
+                transformation_matrix[0] = scaleX;
+                transformation_matrix[3] = scaleY;
+            }
+        }
+
+        emitter.op("q");
+        emitter.matrix(transformation_matrix);
+        emitter.name(widget->name);
+        emitter.op("Do");
+        emitter.op("Q");
+
+        //remove this annotation from the /Annots of the page
+        plan.remove[widget->annot_index] = true;
+    }
+
+    plan.contents = flateEncode(emitter.data());
+}
+
+//Commit phase: apply a built plan to the QPDF object graph
+void commitPage(FlattenContext &context, PageSnapshot &snapshot, PagePlan const& plan)
+{
+    QPDF &pdf = context.pdf;
+    FlattenResult &result = context.result;
+    ChangeTracker &changes = context.changes;
+    QPDFObjectHandle page = snapshot.page;
+    changes.touch(page);
+
+    for(size_t i = 0; i < snapshot.default_flags.size(); ++i)
+    {
+        snapshot.annotations[snapshot.default_flags[i]].replaceKey("/F", QPDFObjectHandle::newInteger(4));
+        changes.touch(snapshot.annotations[snapshot.default_flags[i]]);
+    }
+
+    //check if the page's /Resources contains /XObject
+    QPDFObjectHandle resources = page.getKey("/Resources");
+    if(!isKeyPresent(resources, "/XObject"))
+        resources.replaceKey("/XObject", QPDFObjectHandle::newDictionary());
+    QPDFObjectHandle page_resources_xobject = resources.getKey("/XObject");
+    changes.touch(resources);
+    changes.touch(page_resources_xobject);
+
+    //The existing contents stay in place, when they need wrapping behind
+    //a q stream shared by all pages, the Q starts the generated stream
+    if(!snapshot.widgets.empty() && plan.wrap)
+    {
+        if(!context.save_state.isInitialized())
+            context.save_state = QPDFObjectHandle::newStream(&pdf, "q");
+        page.addPageContents(context.save_state, true);
+    }
+
+    for(std::vector<WidgetSnapshot>::iterator widget = snapshot.widgets.begin();
+        widget != snapshot.widgets.end(); ++widget)
+    {
+        QPDFObjectHandle annot = snapshot.annotations[widget->annot_index];
+        if(!widget->appearance.isInitialized())
+        {
+            widget->appearance = QPDFObjectHandle::newStream(&pdf);
+            std::map<std::string, QPDFObjectHandle> N;
+            N.insert(std::pair<std::string, QPDFObjectHandle>("/N", widget->appearance));
+            annot.replaceKey("/AP", QPDFObjectHandle::newDictionary(N));
+            changes.touch(annot);
+        }
+
+        if(widget->resources.isInitialized() && !widget->resources.isNull())
+        {
+            changes.touch(widget->appearance);
+            widget->appearance.getDict().replaceKey("/Resources", widget->resources);
+        }
+
+        if(widget->assign_name)
+        {
+            changes.touch(widget->appearance);
+            QPDFObjectHandle name = QPDFObjectHandle::newName(widget->name);
+            if(!widget->is_dictionary) //it is a stream
+                widget->appearance.getDict().replaceKey("/Name", name);
+            else //it is a dictionary
+                widget->appearance.replaceKey("/Name", name);
+        }
+
+        //Insert the named XObject into /Resources. The extraction phase
+        //chose a name that is free on the page or already bound to it
+        page_resources_xobject.replaceKey(widget->name, widget->appearance);
+
+        result.widgets_flattened++;
+    }
+
+    if(!snapshot.widgets.empty())
+    {
+        QPDFObjectHandle content = QPDFObjectHandle::newStream(&pdf);
+        setStreamData(context, content, plan.contents, QPDFObjectHandle::newName("/FlateDecode"));
+        page.addPageContents(content, false);
+    }
+
+    //replace the orginal /Annots array with the annotations that are kept,
+    //compacted in place in a single pass
+    size_t kept = 0;
+    for(size_t i = 0; i < snapshot.annotations.size(); ++i)
+    {
+        if(plan.remove[i])
+            continue;
+        if(kept != i)
+            snapshot.annotations[kept] = snapshot.annotations[i];
+        kept++;
+    }
+    snapshot.annotations.resize(kept);
+    page.replaceKey("/Annots", QPDFObjectHandle::newArray(snapshot.annotations));
+}
+
+//Add the widget decisions of an extracted page to plan
+static void recordLayout(FlattenPlan &plan, PageSnapshot const& snapshot)
+{
+    PageLayout layout;
+    layout.page = snapshot.page.getObjGen();
+    layout.annotation_count = snapshot.annotations.size();
+    for(size_t i = 0; i < snapshot.widgets.size(); ++i)
+    {
+        WidgetSnapshot const& widget = snapshot.widgets[i];
+        WidgetPlan planned;
+        planned.annot_index = widget.annot_index;
+        planned.button = widget.button;
+        for(int c = 0; c < 4; ++c)
+            planned.rect[c] = widget.rect[c];
+        layout.widgets.push_back(planned);
+    }
+    plan.pages.push_back(layout);
+}
+
+//Drop the widgets in flattened from the field array under key of holder
+//and, recursively, from the /Kids of the fields in it, along with fields
+//left without kids. owner is the indirect object holder belongs to, it is
+//recorded as changed. Returns whether the array was emptied by this
+static bool detachWidgets(FlattenContext &context, QPDFObjectHandle holder, std::string const& key,
+                          QPDFObjectHandle owner, std::set<QPDFObjGen> const& flattened,
+                          std::set<QPDFObjGen> &seen)
+{
+    QPDFObjectHandle items = holder.getKey(key);
+    if(!items.isArray())
+        return false;
+
+    std::vector<QPDFObjectHandle> kept;
+    bool changed = false;
+    for(int i = 0; i < items.getArrayNItems(); ++i)
+    {
+        QPDFObjectHandle item = items.getArrayItem(i);
+        if(item.isIndirect() && flattened.count(item.getObjGen()) != 0)
+        {
+            changed = true;
+            continue;
+        }
+        if(item.isDictionary() && (!item.isIndirect() || seen.insert(item.getObjGen()).second) &&
+           detachWidgets(context, item, "/Kids", item.isIndirect() ? item : owner, flattened, seen))
+        {
+            changed = true;
+            continue;
+        }
+        kept.push_back(item);
+    }
+
+    if(!changed)
+        return false;
+    holder.replaceKey(key, QPDFObjectHandle::newArray(kept));
+    context.changes.touch(owner);
+    return kept.empty();
+}
+
+void NoNeedAppearances(FlattenContext &context)
+{
+    QPDF &pdf = context.pdf;
+    FlattenOptions const& options = context.options;
+    FlattenResult &result = context.result;
+
+    bool bounded = options.max_rss_kb > 0;
+    std::map<QPDFObjGen, std::string> pending_names;
+    AppearanceCache appearance_cache(!bounded);
+
+    //Only the pages that carry widgets are visited, as listed by the plan
+    //if there is one. With a memory budget they go through all three
+    //phases in batches sized to the memory left, and the state of a batch
+    //is released before the next one starts
+    std::vector<QPDFObjectHandle> widget_pages;
+    std::vector<PageLayout const*> layouts;
+    if(context.plan_loaded)
+    {
+        for(size_t i = 0; i < context.plan.pages.size(); ++i)
+        {
+            widget_pages.push_back(pdf.getObjectByObjGen(context.plan.pages[i].page));
+            layouts.push_back(&context.plan.pages[i]);
+        }
+    }
+    else
+    {
+        //the index has its own phase, finding the widget pages this one
+        FieldIndex &index = fieldIndex(context);
+        PhaseTimer timer(options.metrics, "pages", &result.phase_seconds);
+        widget_pages = index.widgetPages(pdf);
+        layouts.assign(widget_pages.size(), NULL);
+    }
+
+    MemoryBudget budget(options.max_rss_kb, BUDGET_PAGE_KB);
+    size_t flattened_pages = 0;
+    std::set<QPDFObjGen> flattened_widgets;
+
+    for(size_t first = 0, last = 0; first < widget_pages.size(); first = last)
+    {
+        if(stopRequested(context, "extract"))
+            break;
+        last = widget_pages.size();
+        if(bounded)
+            last = first + budget.nextBatch(widget_pages.size() - first);
+
+        //Extraction phase, serial since QPDF objects are not thread-safe
+        std::vector<PageSnapshot> snapshots;
+        {
+            PhaseTimer timer(options.metrics, "extract", &result.phase_seconds);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for(size_t i = first; i < last; ++i)
+            {
+                //pages not reached keep their widgets
+                if(stopRequested(context, "extract"))
+                    break;
+                result.pages_visited++;
+
+                //check if page has annotations
+                if(!isKeyPresent(widget_pages[i],"/Annots"))
+                    continue;
+
+                snapshots.push_back(PageSnapshot());
+                extractPage(widget_pages[i], snapshots.back(), pending_names,
+                            options.deduplicate_appearances ? &appearance_cache : NULL, context,
+                            layouts[i]);
+            }
+            context.discovery_seconds += secondsSince(start);
+
+            if(result.plan_cache_used && !context.plan_loaded)
+            {
+                for(size_t i = 0; i < snapshots.size(); ++i)
+                    recordLayout(context.plan, snapshots[i]);
+            }
+        }
+
+        //Build phase, the per page work is independent
+        std::vector<PagePlan> plans(snapshots.size());
+        {
+            PhaseTimer timer(options.metrics, "build", &result.phase_seconds);
+            parallelFor(snapshots.size(), options.jobs, [&](size_t i) {
+                if(context.expired())
+                {
+                    plans[i].skipped = true;
+                    return;
+                }
+                TraceSpan span(options.metrics, "build page");
+                buildPagePlan(snapshots[i], plans[i]);
+            });
+        }
+
+        //Commit phase, in page order so the output does not depend on the
+        //number of jobs
+        {
+            PhaseTimer timer(options.metrics, "commit", &result.phase_seconds);
+            for(size_t i = 0; i < snapshots.size(); ++i)
+            {
+                //pages are committed in order up to the first one missing
+                if(stopRequested(context, plans[i].skipped ? "build" : "commit"))
+                    break;
+                for(size_t w = 0; w < snapshots[i].widgets.size(); ++w)
+                {
+                    QPDFObjectHandle annot = snapshots[i].annotations[snapshots[i].widgets[w].annot_index];
+                    if(annot.isIndirect())
+                        flattened_widgets.insert(annot.getObjGen());
+                }
+                commitPage(context, snapshots[i], plans[i]);
+                flattened_pages++;
+            }
+        }
+
+        //measured while the batch is still held, its peak is what counts
+        if(bounded)
+            budget.batchDone(last - first);
+    }
+    result.appearances_deduplicated += appearance_cache.duplicates();
+    result.appearance_bytes_saved += appearance_cache.bytesSaved();
+    FLATTEN_LOG(options.log, FLATTEN_LOG_DEBUG, "Flattened " << result.widgets_flattened
+                << " widgets on " << flattened_pages << " pages");
+
+    //the widgets not flattened still belong to the form, the ones drawn
+    //into their pages leave it, so a viewer does not show them twice
+    if(result.cancelled)
+    {
+        QPDFObjectHandle root = pdf.getRoot();
+        QPDFObjectHandle acroform = root.getKey("/AcroForm");
+        std::set<QPDFObjGen> seen;
+        if(acroform.isDictionary() && !flattened_widgets.empty())
+            detachWidgets(context, acroform, "/Fields", acroform.isIndirect() ? acroform : root,
+                          flattened_widgets, seen);
+        return;
+    }
+
+    //remove the AcroForm from the PDF
+    pdf.getRoot().removeKey("/AcroForm");
+    context.changes.touch(pdf.getRoot());
+}
+
+//Field flags (/Ff) that change how text is laid out
+static long long const FLAG_MULTILINE = 1 << 12;
+static long long const FLAG_PASSWORD = 1 << 13;
+static long long const FLAG_COMBO = 1 << 17;
+static long long const FLAG_COMB = 1 << 24;
+
+//Text of a field value in the codes of the field's font. Selected choice
+//options go on separate lines
+static std::string fieldText(QPDFObjectHandle value, FontEncoding encoding)
+{
+    if(value.isArray())
+    {
+        std::string text;
+        for(int i = 0; i < value.getArrayNItems(); ++i)
+        {
+            if(i != 0)
+                text += '\n';
+            text += fieldText(value.getArrayItem(i), encoding);
+        }
+        return text;
+    }
+    if(value.isName())
+        return encodeText(value.getName().substr(1), encoding);
+    if(!value.isString())
+        return "";
+    return encodeText(value.getStringValue(), encoding);
+}
+
+//Border width of a widget from /BS or the older /Border array
+static double borderWidth(QPDFObjectHandle annotation)
+{
+    QPDFObjectHandle border_style = annotation.getKey("/BS");
+    if(border_style.isDictionary() && border_style.getKey("/W").isNumber())
+        return border_style.getKey("/W").getNumericValue();
+
+    QPDFObjectHandle border = annotation.getKey("/Border");
+    if(border.isArray() && border.getArrayNItems() >= 3 && border.getArrayItem(2).isNumber())
+        return border.getArrayItem(2).getNumericValue();
+    return 1;
+}
+
+//Generate the normal appearance of one text or choice widget from its
+//inherited field attributes
+void generateOneAppearance(QPDFObjectHandle &annotation, int node, FlattenContext &context)
+{
+    QPDF &pdf = context.pdf;
+    FieldIndex &index = fieldIndex(context);
+    FlattenResult &result = context.result;
+    context.changes.touch(annotation);
+
+    //buttons carry their own appearance states, signatures are not drawn
+    std::string field_type = index.get(node, FieldIndex::FT).unparse();
+    if(field_type != "/Tx" && field_type != "/Ch")
+        return;
+
+    //the form's /DA and /Q are the defaults of every field
+    QPDFObjectHandle acroform = pdf.getRoot().getKey("/AcroForm");
+    QPDFObjectHandle da_object = index.has(node, FieldIndex::DA) ?
+                                 index.get(node, FieldIndex::DA) : acroform.getKey("/DA");
+
+    //without a value or default appearance there is nothing to draw
+    if(!index.has(node, FieldIndex::V) || !da_object.isString())
+        return;
+
+    DefaultAppearance const& default_appearance =
+        context.default_appearances.parse(da_object.getStringValue());
+    if(!default_appearance.valid)
+    {
+        FLATTEN_LOG(context.options.log, FLATTEN_LOG_DEBUG, "No font in /DA of widget "
+                    << annotation.getObjGen().getObj() << ", appearance not generated");
+        return;
+    }
+
+    result.appearances_generated++;
+
+    //Get the Default Resources from the AcroForm
+    QPDFObjectHandle defaultResources = QPDFObjectHandle::newDictionary();
+    if(acroform.hasKey("/DR"))
+    {
+        defaultResources = acroform.getKey("/DR");
+    }
+    FontMetrics const& font = context.fonts.lookup(defaultResources, default_appearance.font);
+
+    //an existing normal appearance stream is rewritten in place
+    QPDFObjectHandle appearanceObject;
+    if(annotation.hasKey("/AP"))
+    {
+        QPDFObjectHandle currentNormalAppearance = annotation.getKey("/AP").getKey("/N");
+        if(currentNormalAppearance.isStream())
+            appearanceObject = currentNormalAppearance;
+        else if(currentNormalAppearance.isDictionary())
+            appearanceObject = currentNormalAppearance.getKey(annotation.getKey("/AS").unparse());
+
+        context.changes.touch(annotation.getKey("/AP"));
+        context.changes.touch(currentNormalAppearance);
+    }
+
+    //Get the /Rect entry from the annotation
+    double rect[4] = {0, 0, 0, 0};
+    for(int i = 0; i < 4; i++)
+    {
+        rect[i] = annotation.getKey("/Rect").getArrayItem(i).getNumericValue();
+    }
+
+    long long flags = 0;
+    if(index.get(node, FieldIndex::FF).isInteger())
+        flags = index.get(node, FieldIndex::FF).getIntValue();
+
+    TextBox box;
+    box.width = std::fabs(rect[2] - rect[0]);
+    box.height = std::fabs(rect[3] - rect[1]);
+    box.padding = std::max(1.0, 2 * borderWidth(annotation));
+    if(index.get(node, FieldIndex::Q).isInteger())
+        box.quadding = index.get(node, FieldIndex::Q).getIntValue();
+    else if(acroform.getKey("/Q").isInteger())
+        box.quadding = acroform.getKey("/Q").getIntValue();
+    if(index.get(node, FieldIndex::MAXLEN).isInteger())
+        box.max_len = index.get(node, FieldIndex::MAXLEN).getIntValue();
+    if(field_type == "/Tx")
+    {
+        box.multiline = (flags & FLAG_MULTILINE) != 0;
+        box.comb = (flags & FLAG_COMB) != 0 && !(flags & (FLAG_MULTILINE | FLAG_PASSWORD));
+    }
+    else
+    {
+        //list boxes show the selected options one per line
+        box.multiline = (flags & FLAG_COMBO) == 0;
+    }
+
+    //the existing stream may use its own coordinate box
+    if(appearanceObject.isStream())
+    {
+        QPDFObjectHandle bbox = appearanceObject.getDict().getKey("/BBox");
+        if(bbox.isArray() && bbox.getArrayNItems() == 4)
+        {
+            box.width = std::fabs(bbox.getArrayItem(2).getNumericValue() -
+                                  bbox.getArrayItem(0).getNumericValue());
+            box.height = std::fabs(bbox.getArrayItem(3).getNumericValue() -
+                                   bbox.getArrayItem(1).getNumericValue());
+        }
+    }
+
+    std::string text = fieldText(index.get(node, FieldIndex::V), font.encoding);
+    if(field_type == "/Tx" && (flags & FLAG_PASSWORD))
+        text.assign(text.size(), '*');
+    std::string streamContent = layoutText(text, box, default_appearance, font);
+
+    //only the font and colours the text uses, not all of /DR
+    QPDFObjectHandle appearanceResources = defaultResources;
+    if(context.options.minimize_resources)
+        appearanceResources = context.resources.minimize(defaultResources, streamContent);
+
+    if(!appearanceObject.isStream())
+    {
+        QPDFObjectHandle BBoxArray = QPDFObjectHandle::newArray();
+        BBoxArray.appendItem( QPDFObjectHandle::newReal(0) );
+        BBoxArray.appendItem( QPDFObjectHandle::newReal(0) );
+        BBoxArray.appendItem( QPDFObjectHandle::newReal(box.width) );
+        BBoxArray.appendItem( QPDFObjectHandle::newReal(box.height) );
+
+        QPDFObjectHandle normalDictionary = QPDFObjectHandle::newDictionary();
+        QPDFObjectHandle type = QPDFObjectHandle::newName("/XObject");
+        QPDFObjectHandle subtype = QPDFObjectHandle::newName("/Form");
+        normalDictionary.replaceKey("/Type", type);
+        normalDictionary.replaceKey("/Subtype", subtype);
+        normalDictionary.replaceKey("/Resources", appearanceResources);
+        normalDictionary.replaceKey("/BBox", BBoxArray);
+
+        QPDFObjectHandle normalAppearance = QPDFObjectHandle::newStream(&pdf);
+        normalAppearance.replaceDict(normalDictionary);
+        setStreamData(context, normalAppearance, streamContent, QPDFObjectHandle::newNull());
+    
+        //Add the /AP << /N object >> entry to the annotation
+        std::map<std::string, QPDFObjectHandle> N;
+        N.insert(std::pair<std::string, QPDFObjectHandle>("/N", normalAppearance));
+        annotation.replaceKey("/AP", QPDFObjectHandle::newDictionary(N));
+    }
+    else
+    {
+        appearanceObject.getDict().replaceKey("/Resources", appearanceResources);
+        context.changes.touch(appearanceObject);
+        setStreamData(context, appearanceObject, streamContent, QPDFObjectHandle::newNull());
+    }
+}   
+
+void needAppearances(FlattenContext &context)
+{
+    QPDF &pdf = context.pdf;
+    FieldIndex &index = fieldIndex(context);
+    //Only the pages that carry widgets are visited
+    std::vector<QPDFObjectHandle> widget_pages = index.widgetPages(pdf);
+    for(std::vector<QPDFObjectHandle>::iterator page_iter = widget_pages.begin();
+        page_iter < widget_pages.end(); ++page_iter)
+    {
+        if(stopRequested(context, "need appearances"))
+            break;
+        QPDFObjectHandle page = *page_iter;
+        FLATTEN_LOG(context.options.log, FLATTEN_LOG_DEBUG2,
+                    "Generating appearances on page " << page.getObjGen().getObj());
+
+        if(!isKeyPresent(page,"/Annots"))
+            continue;
+
+        //Get all the annotations present in the page
+        std::vector<QPDFObjectHandle> annotations = page.getKey("/Annots").getArrayAsVector();
+
+        //Iterate over every annotation present on the page       
+        for(std::vector<QPDFObjectHandle>::iterator annot_iter = annotations.begin(); 
+            annot_iter < annotations.end(); ++annot_iter)
+        {
+            QPDFObjectHandle annot = *annot_iter;
+            if(annot.getKey("/Subtype").unparse() != "/Widget")
+                continue;
+
+            //the inherited field attributes come from the index
+            generateOneAppearance(annot, index.lookup(annot), context);
+        }
+    }
+    FLATTEN_LOG(context.options.log, FLATTEN_LOG_DEBUG, "Generated " << context.result.appearances_generated
+                << " appearances, " << context.fonts.loads() << " font metrics loaded");
+}
+
+FlattenResult::FlattenResult()
+    : success(false),
+      acroform_present(false),
+      need_appearances(false),
+      cancelled(false),
+      pages_visited(0),
+      widgets_flattened(0),
+      annotations_preserved(0),
+      appearances_generated(0),
+      appearances_deduplicated(0),
+      appearance_bytes_saved(0),
+      passed_through(false),
+      resource_entries_dropped(0),
+      bytes_spilled(0),
+      streams_precompressed(0),
+      peak_rss_kb(0),
+      output_cache_hit(false),
+      plan_cache_used(false),
+      plan_cache_hit(false),
+      plan_seconds_saved(0),
+      bytes_written(0),
+      incremental_update(false),
+      profile(PROFILE_DEFAULT),
+      write_seconds(0)
+{
+}
+
+FlattenOptions::FlattenOptions()
+    : jobs(1),
+      deduplicate_appearances(true),
+      minimize_resources(true),
+      incremental(false),
+      max_rss_kb(0),
+      output_cache_max_kb(1024 * 1024),
+      profile(PROFILE_DEFAULT),
+      deadline_ms(0),
+      deadline_partial(false),
+      cancel(NULL),
+      log(NULL),
+      metrics(NULL)
+{
+}
+
+FormFlattener::FormFlattener()
+{
+}
+
+FormFlattener::FormFlattener(FlattenOptions const& options)
+    : options(options)
+{
+}
+
+//Flate encode the generated streams that were installed unfiltered, so
+//that the writer, which runs on one thread, only copies their bytes.
+//Reading and installing the data is serial, the encoding runs on the
+//worker threads. With a memory budget the streams go in batches
+static void precompressStreams(FlattenContext &context)
+{
+    FlattenOptions const& options = context.options;
+    if(context.uncompressed.empty())
+        return;
+    PhaseTimer timer(options.metrics, "compress", &context.result.phase_seconds);
+
+    std::vector<QPDFObjectHandle> streams;
+    for(std::map<QPDFObjGen, QPDFObjectHandle>::iterator it = context.uncompressed.begin();
+        it != context.uncompressed.end(); ++it)
+        streams.push_back(it->second);
+    context.uncompressed.clear();
+
+    //a stream's raw and encoded data are held at once, batches of them
+    //are sized to the memory budget like the pages
+    MemoryBudget budget(options.max_rss_kb, BUDGET_STREAM_KB);
+    for(size_t first = 0, last = 0; first < streams.size(); first = last)
+    {
+        //what is left is compressed by the writer
+        if(stopRequested(context, "compress"))
+            break;
+        last = streams.size();
+        if(options.max_rss_kb > 0)
+            last = first + budget.nextBatch(streams.size() - first);
+        size_t count = last - first;
+
+        std::vector<PointerHolder<Buffer> > raw;
+        for(size_t i = first; i < last; ++i)
+            raw.push_back(streams[i].getRawStreamData());
+
+        std::vector<std::string> encoded(raw.size());
+        parallelFor(raw.size(), options.jobs, [&](size_t i) {
+            Buffer const* data = raw[i].getPointer();
+            encoded[i] = flateEncode(std::string(reinterpret_cast<char const*>(data->getBuffer()),
+                                                 data->getSize()));
+        });
+
+        //keep streams that do not get any smaller as they are
+        for(size_t i = 0; i < raw.size(); ++i)
+        {
+            if(encoded[i].size() >= raw[i].getPointer()->getSize())
+                continue;
+            setStreamData(context, streams[first + i], encoded[i],
+                          QPDFObjectHandle::newName("/FlateDecode"));
+            context.result.streams_precompressed++;
+        }
+        if(options.max_rss_kb > 0)
+            budget.batchDone(count);
+    }
+}
+
+//Record the memory high water mark of a finished job and add its
+//counters to the caller's metrics
+static void publishResult(Metrics* metrics, FlattenResult &result)
+{
+    result.peak_rss_kb = peakRssKb();
+    if(metrics == NULL)
+        return;
+    metrics->maximum("peak_rss_kb", result.peak_rss_kb);
+    metrics->add("bytes_spilled", result.bytes_spilled);
+    metrics->add("streams_precompressed", result.streams_precompressed);
+    if(result.plan_cache_used)
+    {
+        metrics->add(result.plan_cache_hit ? "plan_cache_hits" : "plan_cache_misses", 1);
+        metrics->add("plan_ms_saved", static_cast<long long>(result.plan_seconds_saved * 1000));
+    }
+    metrics->add("documents", 1);
+    metrics->add("documents_failed", result.success ? 0 : 1);
+    metrics->add("documents_passed_through", result.passed_through ? 1 : 0);
+    metrics->add("documents_cancelled", result.cancelled ? 1 : 0);
+    metrics->add("pages_visited", result.pages_visited);
+    metrics->add("widgets_flattened", result.widgets_flattened);
+    metrics->add("annotations_preserved", result.annotations_preserved);
+    metrics->add("appearances_generated", result.appearances_generated);
+    metrics->add("appearances_deduplicated", result.appearances_deduplicated);
+    metrics->add("appearance_bytes_saved", result.appearance_bytes_saved);
+    metrics->add("resource_entries_dropped", result.resource_entries_dropped);
+    metrics->add("bytes_written", result.bytes_written);
+}
+
+FlattenContext::FlattenContext(QPDF &pdf, FlattenOptions const& options, FlattenResult &result,
+                               std::chrono::steady_clock::time_point started)
+    : pdf(pdf),
+      options(options),
+      result(result),
+      resources(pdf),
+      next_xobject_name(0),
+      spill(NULL),
+      spilling(false),
+      streams_set(0),
+      precompress(options.incremental ||
+                  (options.profile != PROFILE_FAST && options.profile != PROFILE_SMALL)),
+      plan_loaded(false),
+      index_built(false),
+      discovery_seconds(0),
+      deadline(started + std::chrono::milliseconds(options.deadline_ms))
+{
+}
+
+bool FlattenContext::expired() const
+{
+    if(options.cancel != NULL && options.cancel->cancelled())
+        return true;
+    return options.deadline_ms > 0 && std::chrono::steady_clock::now() >= deadline;
+}
+
+FlattenResult FormFlattener::flatten(QPDF &pdf)
+{
+    FlattenResult result;
+    try
+    {
+        FlattenContext context(pdf, options, result);
+        flattenDocument(context);
+        result.success = true;
+    }
+    catch(std::exception &e)
+    {
+        result.error = e.what();
+    }
+    publishResult(options.metrics, result);
+    return result;
+}
+
+FlattenResult FormFlattener::flattenBuffer(char const* buf, size_t len, Pipeline* output)
+{
+    if(!options.output_cache_dir.empty())
+        return flattenCached(buf, len, -1, output);
+
+    //wrap the caller's memory, BufferInputSource does not copy it
+    Buffer* buffer = new Buffer(reinterpret_cast<unsigned char*>(const_cast<char*>(buf)), len);
+    PointerHolder<InputSource> input = new BufferInputSource("memory buffer", buffer, true);
+    return flattenSource(input, buf, output);
+}
+
+FlattenResult FormFlattener::flattenFile(char const* filename, Pipeline* output)
+{
+    //regular files are parsed out of a mapping, the same as a buffer
+    MappedFile mapped;
+    if(mapped.open(filename))
+        return flattenBuffer(mapped.data(), mapped.size(), output);
+
+    FileInputSource* file = new FileInputSource();
+    PointerHolder<InputSource> input = file;
+    try
+    {
+        file->setFilename(filename);
+    }
+    catch(std::exception &e)
+    {
+        FlattenResult result;
+        result.error = e.what();
+        publishResult(options.metrics, result);
+        return result;
+    }
+    return flattenInputSource(input, output);
+}
+
+FlattenResult FormFlattener::flattenInputSource(PointerHolder<InputSource> input, Pipeline* output)
+{
+    return flattenSource(input, NULL, output);
+}
+
+//Passes everything on to next and writes a copy into copy
+class TeePipeline : public Pipeline
+{
+public:
+    TeePipeline(char const* identifier, Pipeline* next, Pipeline* copy)
+        : Pipeline(identifier, next),
+          copy(copy)
+    {
+    }
+
+    virtual void write(unsigned char* data, size_t len)
+    {
+        getNext()->write(data, len);
+        copy->write(data, len);
+    }
+
+    virtual void finish()
+    {
+        getNext()->finish();
+        copy->finish();
+    }
+
+private:
+    Pipeline* copy;
+};
+
+FlattenResult FormFlattener::flattenSource(PointerHolder<InputSource> input, char const* original_bytes,
+                                           Pipeline* output, Pipeline* copy)
+{
+    //the deadline counts from here, parsing included
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    FlattenResult result;
+    try
+    {
+        QPDF pdf;
+        {
+            PhaseTimer timer(options.metrics, "parse", &result.phase_seconds);
+            pdf.processInputSource(input);
+        }
+
+        //nothing would be printed differently: the input is the output
+        if(!needsFlattening(pdf))
+        {
+            PhaseTimer timer(options.metrics, "write", &result.phase_seconds);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            result.acroform_present = acroformPresent(pdf);
+            input->seek(0, SEEK_END);
+            qpdf_offset_t size = input->tell();
+            Pl_Count count("flattened output", output);
+            if(original_bytes != NULL)
+                count.write(reinterpret_cast<unsigned char*>(const_cast<char*>(original_bytes)), size);
+            else
+                copyOriginal(*input, size, &count);
+            count.finish();
+            result.bytes_written = count.getCount();
+            result.passed_through = true;
+            result.write_seconds = secondsSince(start);
+            result.success = true;
+            publishResult(options.metrics, result);
+            return result;
+        }
+
+        //the flattened output, unlike a document passed through, also
+        //goes into copy
+        TeePipeline tee("flattened output copy", output, copy);
+        if(copy != NULL)
+            output = &tee;
+
+        FlattenContext context(pdf, options, result, started);
+        flattenDocument(context);
+
+        if(options.incremental && !pdf.isEncrypted())
+        {
+            //original bytes first, then the update section behind them
+            PhaseTimer timer(options.metrics, "write", &result.phase_seconds);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            OriginalFile original = scanOriginal(*input);
+            Pl_Count count("flattened output", output);
+            if(original_bytes != NULL)
+                count.write(reinterpret_cast<unsigned char*>(const_cast<char*>(original_bytes)),
+                            original.size);
+            else
+                copyOriginal(*input, original.size, &count);
+            writeIncrementalUpdate(pdf, context.changes, original, &count);
+            result.bytes_written = count.getCount();
+            result.incremental_update = true;
+            result.write_seconds = secondsSince(start);
+        }
+        else
+        {
+            writeDocument(pdf, output, result);
+        }
+        result.success = true;
+    }
+    catch(std::exception &e)
+    {
+        result.error = e.what();
+    }
+    publishResult(options.metrics, result);
+    return result;
+}
+
+//Copy the first size bytes of a file to output_fd, inside the kernel
+//where possible
+static void copyFile(char const* filename, qpdf_offset_t size, int output_fd)
+{
+    int in_fd = open(filename, O_RDONLY);
+    bool copied = in_fd >= 0 && copyFdRange(in_fd, 0, size, output_fd);
+    if(in_fd >= 0)
+        close(in_fd);
+    if(!copied)
+        throw std::runtime_error(std::string("cannot copy original file: ") + strerror(errno));
+}
+
+FlattenResult FormFlattener::flattenFileToFd(char const* filename, int output_fd)
+{
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    FlattenResult result;
+    FILE* out = NULL;
+    try
+    {
+        //the mapping outlives the document parsed from it
+        MappedFile mapped;
+        PointerHolder<InputSource> input;
+        if(mapped.open(filename))
+        {
+            if(!options.output_cache_dir.empty())
+                return flattenCached(mapped.data(), mapped.size(), output_fd, NULL);
+
+            Buffer* buffer = new Buffer(reinterpret_cast<unsigned char*>(const_cast<char*>(mapped.data())),
+                                        mapped.size());
+            input = new BufferInputSource(filename, buffer, true);
+        }
+        else
+        {
+            FileInputSource* file = new FileInputSource();
+            input = file;
+            file->setFilename(filename);
+        }
+
+        QPDF pdf;
+        {
+            PhaseTimer timer(options.metrics, "parse", &result.phase_seconds);
+            pdf.processInputSource(input);
+        }
+
+        //nothing would be printed differently: the kernel copies the file
+        if(!needsFlattening(pdf))
+        {
+            PhaseTimer timer(options.metrics, "write", &result.phase_seconds);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            result.acroform_present = acroformPresent(pdf);
+            input->seek(0, SEEK_END);
+            qpdf_offset_t size = input->tell();
+            copyFile(filename, size, output_fd);
+            result.bytes_written = size;
+            result.passed_through = true;
+            result.write_seconds = secondsSince(start);
+            result.success = true;
+            publishResult(options.metrics, result);
+            return result;
+        }
+
+        FlattenContext context(pdf, options, result, started);
+        flattenDocument(context);
+
+        //a private stream on a duplicate, the caller keeps its descriptor
+        out = fdopen(dup(output_fd), "wb");
+        if(out == NULL)
+            throw std::runtime_error(std::string("cannot open output: ") + strerror(errno));
+        Pl_StdioFile sink("flattened output", out);
+
+        if(options.incremental && !pdf.isEncrypted())
+        {
+            //the unchanged original is copied by the kernel, only the
+            //update section passes through our buffers
+            PhaseTimer timer(options.metrics, "write", &result.phase_seconds);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            OriginalFile original = scanOriginal(*input);
+            copyFile(filename, original.size, output_fd);
+
+            Pl_Count count("incremental update", &sink);
+            writeIncrementalUpdate(pdf, context.changes, original, &count);
+            result.bytes_written = original.size + count.getCount();
+            result.incremental_update = true;
+            result.write_seconds = secondsSince(start);
+        }
+        else
+        {
+            writeDocument(pdf, &sink, result);
+        }
+
+        int closed = fclose(out);
+        out = NULL;
+        if(closed != 0)
+            throw std::runtime_error(std::string("cannot write output: ") + strerror(errno));
+        result.success = true;
+    }
+    catch(std::exception &e)
+    {
+        if(out != NULL)
+            fclose(out);
+        result.error = e.what();
+    }
+    publishResult(options.metrics, result);
+    return result;
+}
+
+//Everything in the options that changes the output, and the qpdf that
+//writes it. The number of jobs and the plan cache do not
+static unsigned long long outputFingerprint(FlattenOptions const& options)
+{
+    std::ostringstream fingerprint;
+    fingerprint << QPDF::QPDFVersion() << ' ' << outputProfileName(options.profile) << ' '
+                << options.incremental << ' ' << options.deduplicate_appearances << ' '
+                << options.minimize_resources << ' ' << (options.max_rss_kb > 0);
+    return hash64(fingerprint.str());
+}
+
+//Send size bytes from offset of fd into output_fd, or into output if it
+//is -1
+static void serveOutput(int fd, qpdf_offset_t offset, qpdf_offset_t size, int output_fd, Pipeline* output)
+{
+    if(output_fd >= 0)
+    {
+        if(!copyFdRange(fd, offset, size, output_fd))
+            throw std::runtime_error(std::string("cannot write output: ") + strerror(errno));
+        return;
+    }
+
+    MappedFile mapped;
+    if(!mapped.open(fd) || mapped.size() < static_cast<size_t>(offset + size))
+        throw std::runtime_error("cannot map cached output");
+    Pl_Count count("cached output", output);
+    count.write(reinterpret_cast<unsigned char*>(const_cast<char*>(mapped.data() + offset)), size);
+    count.finish();
+}
+
+FlattenResult FormFlattener::flattenCached(char const* data, size_t len, int output_fd, Pipeline* output)
+{
+    OutputCache cache(options.output_cache_dir, options.output_cache_max_kb);
+    OutputCacheKey key = outputCacheKey(data, len, outputFingerprint(options));
+
+    qpdf_offset_t offset = 0;
+    qpdf_offset_t size = 0;
+    int fd = cache.lookup(key, offset, size);
+    if(fd >= 0)
+    {
+        FlattenResult result;
+        {
+            PhaseTimer timer(options.metrics, "write", &result.phase_seconds);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            try
+            {
+                serveOutput(fd, offset, size, output_fd, output);
+                result.bytes_written = size;
+                result.output_cache_hit = true;
+                result.success = true;
+            }
+            catch(std::exception &e)
+            {
+                result.error = e.what();
+            }
+            result.write_seconds = secondsSince(start);
+        }
+        close(fd);
+        if(options.metrics != NULL)
+            options.metrics->add("output_cache_hits", 1);
+        FLATTEN_LOG(options.log, FLATTEN_LOG_DEBUG, "Output cache hit " << hashToHex(key.name));
+        publishResult(options.metrics, result);
+        return result;
+    }
+    if(options.metrics != NULL)
+        options.metrics->add("output_cache_misses", 1);
+
+    Buffer* buffer = new Buffer(reinterpret_cast<unsigned char*>(const_cast<char*>(data)), len);
+    PointerHolder<InputSource> input = new BufferInputSource("memory buffer", buffer, true);
+
+    //the output goes to the caller as it is written, and into a new entry
+    //unless the document is passed through unchanged
+    std::string temporary;
+    int entry_fd = cache.create(key, temporary);
+    FILE* entry = entry_fd >= 0 ? fdopen(entry_fd, "wb") : NULL;
+    if(entry == NULL)
+    {
+        FLATTEN_LOG(options.log, FLATTEN_LOG_WARNING, "Cannot add to the output cache "
+                    << options.output_cache_dir);
+        if(entry_fd >= 0)
+        {
+            close(entry_fd);
+            unlink(temporary.c_str());
+        }
+    }
+
+    FlattenResult result;
+    FILE* out = output_fd >= 0 ? fdopen(dup(output_fd), "wb") : NULL;
+    if(output_fd >= 0 && out == NULL)
+    {
+        result.error = std::string("cannot open output: ") + strerror(errno);
+        publishResult(options.metrics, result);
+    }
+    else
+    {
+        PointerHolder<Pipeline> sink;
+        if(out != NULL)
+        {
+            sink = new Pl_StdioFile("flattened output", out);
+            output = sink.getPointer();
+        }
+        PointerHolder<Pipeline> copy;
+        if(entry != NULL)
+            copy = new Pl_StdioFile("output cache entry", entry);
+        result = flattenSource(input, data, output, copy.getPointer());
+    }
+    if(out != NULL && fclose(out) != 0 && result.success)
+    {
+        result.success = false;
+        result.error = std::string("cannot write output: ") + strerror(errno);
+    }
+
+    //partial outputs are not what a later run with more time would write,
+    //and documents passed through are cheaper to copy again than to keep
+    if(entry != NULL)
+    {
+        bool keep = result.success && !result.cancelled && !result.passed_through;
+        if(fclose(entry) != 0)
+            keep = false;
+        if(!keep)
+        {
+            unlink(temporary.c_str());
+            return result;
+        }
+        int evicted = cache.insert(key, temporary);
+        if(evicted < 0)
+            FLATTEN_LOG(options.log, FLATTEN_LOG_WARNING, "Cannot add to the output cache "
+                        << options.output_cache_dir);
+        if(evicted > 0 && options.metrics != NULL)
+            options.metrics->add("output_cache_evictions", evicted);
+    }
+    return result;
+}
+
+void FormFlattener::flattenDocument(FlattenContext &context)
+{
+    QPDF &pdf = context.pdf;
+    FlattenResult &result = context.result;
+
+    //Check if /AcroForm is present, and if it is present
+    //then process further
+    result.acroform_present = acroformPresent(pdf);
+    if(!result.acroform_present)
+        return;
+
+    if(options.incremental)
+        context.changes.begin(pdf);
+
+    //a plan made for an earlier fill of the same form replaces finding the
+    //widgets and measuring their appearances. The field index is built
+    //when something still needs it
+    unsigned long long fingerprint = 0;
+    if(!options.plan_cache_dir.empty())
+    {
+        PhaseTimer timer(options.metrics, "plan", &result.phase_seconds);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        result.plan_cache_used = formFingerprint(pdf, fingerprint);
+        if(!result.plan_cache_used)
+            FLATTEN_LOG(options.log, FLATTEN_LOG_DEBUG, "Document has no /ID, not using the plan cache");
+        context.plan_loaded = result.plan_cache_used &&
+                              PlanCache(options.plan_cache_dir).load(fingerprint, context.plan) &&
+                              planMatches(pdf, context.plan);
+        if(!context.plan_loaded)
+            context.plan = FlattenPlan();
+        context.discovery_seconds += secondsSince(start);
+    }
+
+    QPDFObjectHandle root = pdf.getRoot();
+    if(!root.getKey("/AcroForm").hasKey("/NeedAppearances") ||
+       root.getKey("/AcroForm").getKey("/NeedAppearances").unparse() != "true")
+    {
+        NoNeedAppearances(context);
+    }
+    else
+    {
+        result.need_appearances = true;
+        {
+            PhaseTimer timer(options.metrics, "need appearances", &result.phase_seconds);
+            needAppearances(context);
+        }
+
+        //out of time, the viewer still has to generate the rest
+        if(!result.cancelled)
+        {
+            root.getKey("/AcroForm").removeKey("/NeedAppearances");
+            NoNeedAppearances(context);
+        }
+    }
+    result.resource_entries_dropped = context.resources.entriesDropped();
+
+    if(result.plan_cache_used)
+    {
+        result.plan_cache_hit = context.plan_loaded;
+        if(context.plan_loaded)
+        {
+            result.plan_seconds_saved = context.plan.extract_seconds - context.discovery_seconds;
+        }
+        else if(!result.cancelled)
+        {
+            //a plan of part of the widgets is of no use
+            context.plan.extract_seconds = context.discovery_seconds;
+            if(!PlanCache(options.plan_cache_dir).store(fingerprint, context.plan))
+                FLATTEN_LOG(options.log, FLATTEN_LOG_WARNING, "Cannot store flatten plan in "
+                            << options.plan_cache_dir);
+        }
+    }
+    precompressStreams(context);
+    if(context.spill != NULL)
+        result.bytes_spilled = context.spill->bytesSpilled();
+}
+
+void FormFlattener::writeDocument(QPDF &pdf, Pipeline* output, FlattenResult &result)
+{
+    PhaseTimer timer(options.metrics, "write", &result.phase_seconds);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    //count the bytes on their way into the caller's sink
+    Pl_Count count("flattened output", output);
+    QPDFWriter w(pdf);
+    w.setOutputPipeline(&count);
+    configureWriter(w, options.profile);
+    try
+    {
+        w.write();
+    }
+    catch(...)
+    {
+        resetOutputProfile(options.profile);
+        throw;
+    }
+    resetOutputProfile(options.profile);
+
+    result.bytes_written = count.getCount();
+    result.profile = options.profile;
+    result.write_seconds = secondsSince(start);
+}
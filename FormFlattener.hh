@@ -0,0 +1,197 @@
+#ifndef FORMFLATTENER_HH
+#define FORMFLATTENER_HH
+
+#include <qpdf/QPDF.hh>
+#include <qpdf/PointerHolder.hh>
+#include <qpdf/InputSource.hh>
+#include <qpdf/Pipeline.hh>
+
+#include "FieldIndex.hh"
+#include "IncrementalWriter.hh"
+#include "OutputProfile.hh"
+#include "Metrics.hh"
+#include "FontMetrics.hh"
+#include "TextLayout.hh"
+#include "ResourceMinimizer.hh"
+#include "SpillStore.hh"
+#include "PlanCache.hh"
+#include "AppearanceGeometry.hh"
+#include "ContentBalance.hh"
+#include "CancelToken.hh"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <cstddef>
+
+class Logger;
+
+//Tunables for a FormFlattener
+struct FlattenOptions
+{
+    FlattenOptions();
+
+    unsigned int jobs;              //worker threads for page building, 0 = all cores
+    bool deduplicate_appearances;   //share identical appearance streams
+    bool minimize_resources;        //cut appearance /Resources to what is used
+    bool incremental;               //append an update instead of rewriting
+    long long max_rss_kb;           //memory budget, 0 for none
+    std::string plan_cache_dir;     //flatten plans of known forms, empty for none
+    std::string output_cache_dir;   //outputs of inputs seen before, empty for none
+    long long output_cache_max_kb;  //least recently used outputs evicted above, 0 for no limit
+    OutputProfile profile;          //writer settings, unused for updates
+
+    //A job that runs out of time or is cancelled fails, or with
+    //deadline_partial is written with the widgets flattened so far, which
+    //leave /AcroForm /Fields; the rest stay annotations of a still
+    //interactive form
+    long long deadline_ms;          //wall time per job from its start, 0 for none
+    bool deadline_partial;
+    CancelToken* cancel;            //cancellation from another thread, NULL for none
+
+    Logger* log;                    //diagnostics, NULL for none
+    Metrics* metrics;               //counters and phase timings, NULL for none
+};
+
+//Outcome of flattening one document. Nothing is printed by the
+//library, callers inspect this instead
+struct FlattenResult
+{
+    FlattenResult();
+
+    bool success;                   //false if processing stopped on an error
+    std::string error;              //description of the error, if any
+
+    bool acroform_present;          //document had an /AcroForm
+    bool need_appearances;          //appearances had to be generated first
+    bool cancelled;                 //stopped early by the deadline or the token
+    std::string cancelled_in;       //phase running when it stopped
+
+    size_t pages_visited;
+    size_t widgets_flattened;
+    size_t annotations_preserved;   //non-widget annotations left in /Annots
+    size_t appearances_generated;
+    size_t appearances_deduplicated;
+    long long appearance_bytes_saved;   //raw stream bytes not written twice
+    bool passed_through;            //nothing to flatten, input copied unchanged
+    size_t resource_entries_dropped;    //unused appearance resources removed
+    long long bytes_spilled;        //generated stream data kept on disk
+    size_t streams_precompressed;   //generated streams Flate encoded before writing
+    long long peak_rss_kb;          //process high water mark after the job
+
+    bool output_cache_hit;          //output served from the output cache, nothing parsed
+
+    bool plan_cache_used;           //a plan cache was configured and the document has an /ID
+    bool plan_cache_hit;            //the form's plan came from it
+    double plan_seconds_saved;      //discovery time saved by the plan
+
+    long long bytes_written;        //bytes sent to the output pipeline
+    bool incremental_update;        //output is the original plus an update
+    OutputProfile profile;          //profile the output was written with
+    double write_seconds;           //wall time spent writing the output
+
+    //wall time of each phase of this job, up to the point of cancellation
+    std::map<std::string, double> phase_seconds;
+};
+
+//Per-document state shared by the flattening passes
+struct FlattenContext
+{
+    FlattenContext(QPDF &pdf, FlattenOptions const& options, FlattenResult &result,
+                   std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now());
+
+    //the deadline passed or the job was cancelled, safe on any thread
+    bool expired() const;
+
+    QPDF &pdf;
+    FlattenOptions const& options;
+    FlattenResult &result;
+
+    FieldIndex index;
+    ChangeTracker changes;
+    FontMetricsCache fonts;                         //fonts of /DR used by generated text
+    DefaultAppearanceCache default_appearances;     //parsed /DA strings
+    ResourceMinimizer resources;                    //reduced appearance resources
+    AppearanceGeometryCache geometry;               //placement of appearance streams
+    std::map<QPDFObjGen, ContentBalance> balances;  //q/Q nesting of page content streams
+    QPDFObjectHandle save_state;                    //the "q" stream in front of wrapped contents
+
+    //names bound in the /XObject dictionaries of the pages, including the
+    //ones the commit phase has yet to add, by the dictionary holding them.
+    //Appearances missing or direct are bound to QPDFObjGen()
+    std::map<QPDFObjGen, std::map<std::string, QPDFObjGen> > xobject_names;
+    unsigned long next_xobject_name;                //last generated /ResX number
+
+    //generated stream data store, created when a memory budget first
+    //makes data spill, NULL before; owned by spill_provider, which the
+    //streams share
+    SpillStore* spill;
+    PointerHolder<QPDFObjectHandle::StreamDataProvider> spill_provider;
+    bool spilling;                  //resident memory is past the spill share of the budget
+    size_t streams_set;             //generated streams so far, paces the memory checks
+
+    //generated streams installed without a filter, encoded in parallel
+    //before the document is written. Not with the fast profile, which
+    //skips compression, or the small one, where the writer recompresses
+    bool precompress;
+    std::map<QPDFObjGen, QPDFObjectHandle> uncompressed;
+
+    //layout of the form, from the plan cache when plan_loaded, otherwise
+    //recorded for it while the widgets are found
+    FlattenPlan plan;
+    bool plan_loaded;
+    bool index_built;               //index is built on first use
+    double discovery_seconds;       //spent finding and measuring widgets
+
+    std::chrono::steady_clock::time_point deadline;     //when deadline_ms is set
+};
+
+//Flattens the interactive form of PDF documents so that the filled in
+//values become part of the page contents. One instance can be reused
+//for any number of jobs
+class FormFlattener
+{
+public:
+    FormFlattener();
+    FormFlattener(FlattenOptions const& options);
+
+    //Flatten an already opened document in place, the caller writes it
+    FlattenResult flatten(QPDF &pdf);
+
+    //Parse the document, flatten it and write the result into output.
+    //Documents without a printable widget are copied through byte for
+    //byte. Regular files are memory mapped rather than read. With an
+    //output cache, inputs in memory or in regular files are looked up by
+    //their bytes first
+    FlattenResult flattenBuffer(char const* buf, size_t len, Pipeline* output);
+    FlattenResult flattenFile(char const* filename, Pipeline* output);
+    FlattenResult flattenInputSource(PointerHolder<InputSource> input, Pipeline* output);
+
+    //Like flattenFile, writing into a file descriptor. In incremental mode
+    //the original bytes are copied inside the kernel
+    FlattenResult flattenFileToFd(char const* filename, int output_fd);
+
+private:
+    //original_bytes is the whole input when it is in memory, so that an
+    //incremental update can write it out without reading it again. A
+    //flattened output is also written into copy, if given
+    FlattenResult flattenSource(PointerHolder<InputSource> input, char const* original_bytes,
+                                Pipeline* output, Pipeline* copy = NULL);
+    //Serve the output for the len bytes at data from the output cache, or
+    //flatten them while writing a new entry. Into output_fd unless it is
+    //-1, into output otherwise. Documents passed through get no entry
+    FlattenResult flattenCached(char const* data, size_t len, int output_fd, Pipeline* output);
+    void flattenDocument(FlattenContext &context);
+    void writeDocument(QPDF &pdf, Pipeline* output, FlattenResult &result);
+
+    FlattenOptions options;
+};
+
+//Lower level entry points used by FormFlattener
+bool acroformPresent(QPDF &pdf);
+bool needsFlattening(QPDF &pdf);
+bool annotationAllowed(unsigned int flags);
+void NoNeedAppearances(FlattenContext &context);
+void needAppearances(FlattenContext &context);
+
+#endif
@@ -0,0 +1,63 @@
+#include "Hash.hh"
+
+#include <cstring>
+
+unsigned long long hash64(void const* data, size_t len, unsigned long long seed)
+{
+    const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    unsigned long long h = seed ^ (len * m);
+
+    unsigned char const* bytes = static_cast<unsigned char const*>(data);
+    unsigned char const* end = bytes + (len / 8) * 8;
+
+    for(; bytes != end; bytes += 8)
+    {
+        unsigned long long k;
+        memcpy(&k, bytes, 8);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    //remaining tail bytes
+    switch(len & 7)
+    {
+    case 7: h ^= (unsigned long long)bytes[6] << 48; //fall through
+    case 6: h ^= (unsigned long long)bytes[5] << 40; //fall through
+    case 5: h ^= (unsigned long long)bytes[4] << 32; //fall through
+    case 4: h ^= (unsigned long long)bytes[3] << 24; //fall through
+    case 3: h ^= (unsigned long long)bytes[2] << 16; //fall through
+    case 2: h ^= (unsigned long long)bytes[1] << 8;  //fall through
+    case 1: h ^= (unsigned long long)bytes[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+unsigned long long hash64(std::string const& data, unsigned long long seed)
+{
+    return hash64(data.data(), data.size(), seed);
+}
+
+std::string hashToHex(unsigned long long hash)
+{
+    static char const digits[] = "0123456789abcdef";
+    std::string hex(16, '0');
+    for(int i = 15; i >= 0; --i)
+    {
+        hex[i] = digits[hash & 0xf];
+        hash >>= 4;
+    }
+    return hex;
+}
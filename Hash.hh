@@ -0,0 +1,16 @@
+#ifndef HASH_HH
+#define HASH_HH
+
+#include <string>
+#include <cstddef>
+
+//Fast non-cryptographic 64 bit hash (MurmurHash64A), used to key
+//caches on content. Equal hashes still have to be confirmed by comparing
+//the data where a collision would matter
+unsigned long long hash64(void const* data, size_t len, unsigned long long seed = 0);
+unsigned long long hash64(std::string const& data, unsigned long long seed = 0);
+
+//Lower case hexadecimal form of a hash, for file names and reports
+std::string hashToHex(unsigned long long hash);
+
+#endif
@@ -0,0 +1,348 @@
+#include "IncrementalWriter.hh"
+
+#include <qpdf/Buffer.hh>
+#include <qpdf/Pl_Count.hh>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+static void writeString(Pipeline* output, std::string const& data)
+{
+    output->write(reinterpret_cast<unsigned char*>(const_cast<char*>(data.data())), data.size());
+}
+
+ChangeTracker::ChangeTracker()
+    : first_new_id(0)
+{
+}
+
+void ChangeTracker::begin(QPDF &pdf)
+{
+    //qpdf numbers new objects after the highest existing one, so the
+    //number given to a throwaway object marks the first new object. The
+    //probe itself is never referenced and therefore never written
+    first_new_id = pdf.makeIndirectObject(QPDFObjectHandle::newNull()).getObjectID();
+    touched.clear();
+}
+
+bool ChangeTracker::active() const
+{
+    return first_new_id != 0;
+}
+
+void ChangeTracker::touch(QPDFObjectHandle object)
+{
+    if(active() && object.isInitialized() && object.isIndirect())
+        touched.insert(object.getObjGen());
+}
+
+void ChangeTracker::addReferences(QPDFObjectHandle object, std::vector<QPDFObjectHandle> &pending,
+                                  std::set<QPDFObjGen> &seen)
+{
+    std::vector<QPDFObjectHandle> children;
+    if(object.isStream())
+        object = object.getDict();
+
+    if(object.isDictionary())
+    {
+        std::set<std::string> keys = object.getKeys();
+        for(std::set<std::string>::iterator key = keys.begin(); key != keys.end(); ++key)
+            children.push_back(object.getKey(*key));
+    }
+    else if(object.isArray())
+    {
+        children = object.getArrayAsVector();
+    }
+
+    for(size_t i = 0; i < children.size(); ++i)
+    {
+        QPDFObjectHandle child = children[i];
+        if(!child.isIndirect())
+        {
+            addReferences(child, pending, seen);
+        }
+        else if(child.getObjectID() >= first_new_id && seen.insert(child.getObjGen()).second)
+        {
+            pending.push_back(child);
+        }
+    }
+}
+
+static bool objectNumberLess(QPDFObjectHandle a, QPDFObjectHandle b)
+{
+    return a.getObjGen() < b.getObjGen();
+}
+
+std::vector<QPDFObjectHandle> ChangeTracker::collect(QPDF &pdf)
+{
+    std::vector<QPDFObjectHandle> objects;
+    std::vector<QPDFObjectHandle> pending;
+    std::set<QPDFObjGen> seen(touched);
+
+    for(std::set<QPDFObjGen>::iterator og = touched.begin(); og != touched.end(); ++og)
+        pending.push_back(pdf.getObjectByObjGen(*og));
+
+    while(!pending.empty())
+    {
+        QPDFObjectHandle object = pending.back();
+        pending.pop_back();
+
+        //objects that were replaced by null are gone, nothing to write
+        if(object.isNull())
+            continue;
+
+        objects.push_back(object);
+        addReferences(object, pending, seen);
+    }
+
+    std::sort(objects.begin(), objects.end(), objectNumberLess);
+    return objects;
+}
+
+OriginalFile scanOriginal(InputSource &input)
+{
+    OriginalFile original;
+    input.seek(0, SEEK_END);
+    original.size = input.tell();
+
+    //startxref has to be within the last 1024 bytes
+    qpdf_offset_t tail_size = std::min<qpdf_offset_t>(original.size, 1024);
+    std::string tail(tail_size, '\0');
+    input.seek(original.size - tail_size, SEEK_SET);
+    tail.resize(input.read(&tail[0], tail_size));
+
+    size_t pos = tail.rfind("startxref");
+    if(pos == std::string::npos)
+        throw std::runtime_error("original file has no startxref, cannot append an update");
+    original.startxref = strtoll(tail.c_str() + pos + 9, NULL, 10);
+
+    original.ends_with_eol = !tail.empty() &&
+                             (tail[tail.size() - 1] == '\n' || tail[tail.size() - 1] == '\r');
+
+    char start[4] = {0, 0, 0, 0};
+    input.seek(original.startxref, SEEK_SET);
+    input.read(start, sizeof(start));
+    original.xref_stream = memcmp(start, "xref", 4) != 0;
+
+    return original;
+}
+
+void copyOriginal(InputSource &input, qpdf_offset_t size, Pipeline* output)
+{
+    unsigned char buf[65536];
+    input.seek(0, SEEK_SET);
+    while(size > 0)
+    {
+        size_t len = input.read(reinterpret_cast<char*>(buf),
+                                std::min<qpdf_offset_t>(size, sizeof(buf)));
+        if(len == 0)
+            throw std::runtime_error("original file shrank while copying it");
+        output->write(buf, len);
+        size -= len;
+    }
+}
+
+bool copyFdRange(int in_fd, qpdf_offset_t offset, qpdf_offset_t size, int out_fd)
+{
+    loff_t in_offset = offset;
+
+    //both regular files: let the file system share or copy the blocks
+    while(size > 0)
+    {
+        ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, NULL, size, 0);
+        if(copied <= 0)
+            break;
+        size -= copied;
+    }
+
+    //any output descriptor: at least avoid the trip through user space
+    while(size > 0)
+    {
+        off_t sendfile_offset = in_offset;
+        ssize_t copied = sendfile(out_fd, in_fd, &sendfile_offset, size);
+        if(copied < 0 && errno == EINTR)
+            continue;
+        if(copied <= 0)
+            break;
+        in_offset = sendfile_offset;
+        size -= copied;
+    }
+
+    char buf[65536];
+    while(size > 0)
+    {
+        ssize_t len = pread(in_fd, buf, std::min<qpdf_offset_t>(size, sizeof(buf)), in_offset);
+        if(len < 0 && errno == EINTR)
+            continue;
+        if(len <= 0)
+            return false;
+
+        for(ssize_t done = 0; done < len; )
+        {
+            ssize_t written = write(out_fd, buf + done, len - done);
+            if(written < 0 && errno == EINTR)
+                continue;
+            if(written <= 0)
+                return false;
+            done += written;
+        }
+        in_offset += len;
+        size -= len;
+    }
+    return true;
+}
+
+//Serialize one object; streams get their raw data with a direct /Length
+static void writeObject(QPDFObjectHandle object, Pipeline* output)
+{
+    writeString(output, std::to_string(object.getObjectID()) + " " +
+                        std::to_string(object.getGeneration()) + " obj\n");
+
+    if(object.isStream())
+    {
+        PointerHolder<Buffer> data = object.getRawStreamData();
+        QPDFObjectHandle dict = object.getDict().shallowCopy();
+        dict.replaceKey("/Length", QPDFObjectHandle::newInteger(data->getSize()));
+        writeString(output, dict.unparse() + "\nstream\n");
+        output->write(data->getBuffer(), data->getSize());
+        writeString(output, "\nendstream\nendobj\n");
+    }
+    else
+    {
+        writeString(output, object.unparseResolved() + "\nendobj\n");
+    }
+}
+
+//Append a big endian field of the given width to a cross-reference stream
+static void appendField(std::string &data, unsigned long long value, int width)
+{
+    for(int i = width - 1; i >= 0; --i)
+        data.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+size_t writeIncrementalUpdate(QPDF &pdf, ChangeTracker &changes,
+                              OriginalFile const& original, Pipeline* output)
+{
+    std::vector<QPDFObjectHandle> objects = changes.collect(pdf);
+
+    //offsets in the new section are relative to the end of the original
+    Pl_Count count("incremental update", output);
+
+    //nothing changed, the original is the result
+    if(objects.empty())
+    {
+        count.finish();
+        return 0;
+    }
+
+    qpdf_offset_t base = original.size;
+    if(!original.ends_with_eol)
+        writeString(&count, "\n");
+
+    std::vector<std::pair<QPDFObjGen, qpdf_offset_t> > offsets;
+    for(size_t i = 0; i < objects.size(); ++i)
+    {
+        offsets.push_back(std::make_pair(objects[i].getObjGen(), base + count.getCount()));
+        writeObject(objects[i], &count);
+    }
+
+    QPDFObjectHandle trailer = pdf.getTrailer();
+    long long size = trailer.getKey("/Size").getIntValue();
+    if(!objects.empty())
+        size = std::max<long long>(size, objects.back().getObjectID() + 1);
+
+    QPDFObjectHandle new_trailer = QPDFObjectHandle::newDictionary();
+    static char const* const kept_keys[] = {"/Root", "/Info", "/ID"};
+    for(size_t i = 0; i < sizeof(kept_keys) / sizeof(kept_keys[0]); ++i)
+    {
+        if(trailer.hasKey(kept_keys[i]))
+            new_trailer.replaceKey(kept_keys[i], trailer.getKey(kept_keys[i]));
+    }
+    new_trailer.replaceKey("/Prev", QPDFObjectHandle::newInteger(original.startxref));
+
+    qpdf_offset_t xref_offset = base + count.getCount();
+    if(!original.xref_stream)
+    {
+        new_trailer.replaceKey("/Size", QPDFObjectHandle::newInteger(size));
+
+        //one subsection per run of consecutive object numbers
+        std::string xref = "xref\n";
+        for(size_t start = 0; start < offsets.size(); )
+        {
+            size_t end = start + 1;
+            while(end < offsets.size() &&
+                  offsets[end].first.getObj() == offsets[end - 1].first.getObj() + 1)
+                end++;
+
+            xref.append(std::to_string(offsets[start].first.getObj()) + " " +
+                        std::to_string(end - start) + "\n");
+            for(size_t i = start; i < end; ++i)
+            {
+                char entry[32];
+                snprintf(entry, sizeof(entry), "%010lld %05d n\r\n",
+                         static_cast<long long>(offsets[i].second), offsets[i].first.getGen());
+                xref.append(entry);
+            }
+            start = end;
+        }
+        writeString(&count, xref + "trailer\n" + new_trailer.unparse() + "\n");
+    }
+    else
+    {
+        //the original uses cross-reference streams, so does the update.
+        //The stream describes itself as the last entry
+        int xref_id = size++;
+        offsets.push_back(std::make_pair(QPDFObjGen(xref_id, 0), xref_offset));
+
+        int offset_width = 1;
+        while(offset_width < 8 && (static_cast<unsigned long long>(xref_offset) >> (8 * offset_width)) != 0)
+            offset_width++;
+
+        std::string data;
+        QPDFObjectHandle index = QPDFObjectHandle::newArray();
+        for(size_t start = 0; start < offsets.size(); )
+        {
+            size_t end = start + 1;
+            while(end < offsets.size() &&
+                  offsets[end].first.getObj() == offsets[end - 1].first.getObj() + 1)
+                end++;
+
+            index.appendItem(QPDFObjectHandle::newInteger(offsets[start].first.getObj()));
+            index.appendItem(QPDFObjectHandle::newInteger(end - start));
+            for(size_t i = start; i < end; ++i)
+            {
+                appendField(data, 1, 1);
+                appendField(data, offsets[i].second, offset_width);
+                appendField(data, offsets[i].first.getGen(), 2);
+            }
+            start = end;
+        }
+
+        QPDFObjectHandle widths = QPDFObjectHandle::newArray();
+        widths.appendItem(QPDFObjectHandle::newInteger(1));
+        widths.appendItem(QPDFObjectHandle::newInteger(offset_width));
+        widths.appendItem(QPDFObjectHandle::newInteger(2));
+
+        new_trailer.replaceKey("/Type", QPDFObjectHandle::newName("/XRef"));
+        new_trailer.replaceKey("/Size", QPDFObjectHandle::newInteger(size));
+        new_trailer.replaceKey("/W", widths);
+        new_trailer.replaceKey("/Index", index);
+        new_trailer.replaceKey("/Length", QPDFObjectHandle::newInteger(data.size()));
+
+        writeString(&count, std::to_string(xref_id) + " 0 obj\n" + new_trailer.unparse() +
+                            "\nstream\n" + data + "\nendstream\nendobj\n");
+    }
+
+    writeString(&count, "startxref\n" + std::to_string(xref_offset) + "\n%%EOF\n");
+    count.finish();
+
+    return objects.size();
+}
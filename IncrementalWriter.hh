@@ -0,0 +1,67 @@
+#ifndef INCREMENTALWRITER_HH
+#define INCREMENTALWRITER_HH
+
+#include <qpdf/QPDF.hh>
+#include <qpdf/QPDFObjectHandle.hh>
+#include <qpdf/InputSource.hh>
+#include <qpdf/Pipeline.hh>
+#include <qpdf/Types.h>
+
+#include <set>
+#include <vector>
+
+//Records the objects modified while flattening, so that only those need
+//to be written in an incremental update. Objects created after begin()
+//are picked up automatically when a recorded object refers to them
+class ChangeTracker
+{
+public:
+    ChangeTracker();
+
+    //Remember where new object numbers start. Must be called before the
+    //document is modified
+    void begin(QPDF &pdf);
+    bool active() const;
+
+    //Record a modified object. Direct objects are ignored, the indirect
+    //object containing them has to be recorded as well
+    void touch(QPDFObjectHandle object);
+
+    //Modified objects plus every new object reachable from them, sorted
+    //by object number
+    std::vector<QPDFObjectHandle> collect(QPDF &pdf);
+
+private:
+    void addReferences(QPDFObjectHandle object, std::vector<QPDFObjectHandle> &pending,
+                       std::set<QPDFObjGen> &seen);
+
+    int first_new_id;
+    std::set<QPDFObjGen> touched;
+};
+
+//Layout of the original file needed to append to it
+struct OriginalFile
+{
+    qpdf_offset_t size;             //length of the original bytes
+    qpdf_offset_t startxref;        //offset of the last cross-reference section
+    bool xref_stream;               //that section is a cross-reference stream
+    bool ends_with_eol;
+};
+
+//Locate the final startxref of the original document
+OriginalFile scanOriginal(InputSource &input);
+
+//Copy the original bytes unchanged into output
+void copyOriginal(InputSource &input, qpdf_offset_t size, Pipeline* output);
+
+//Copy size bytes of in_fd starting at offset to the current position of
+//out_fd, inside the kernel where possible. Returns false on error
+bool copyFdRange(int in_fd, qpdf_offset_t offset, qpdf_offset_t size, int out_fd);
+
+//Write the incremental update section for the recorded changes. output
+//must be positioned right after the original bytes. Without changes
+//nothing is appended. Returns the number of objects written
+size_t writeIncrementalUpdate(QPDF &pdf, ChangeTracker &changes,
+                              OriginalFile const& original, Pipeline* output);
+
+#endif
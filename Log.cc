@@ -0,0 +1,85 @@
+#include "Log.hh"
+
+#include <cerrno>
+
+#include <unistd.h>
+
+//write(2) the buffer once it gets this large
+static size_t const FLUSH_THRESHOLD = 8192;
+
+static char const* levelPrefix(LogLevel level)
+{
+    switch(level)
+    {
+    case FLATTEN_LOG_ERROR:
+        return "ERROR: ";
+    case FLATTEN_LOG_WARNING:
+        return "WARNING: ";
+    case FLATTEN_LOG_INFO:
+        return "INFO: ";
+    case FLATTEN_LOG_DEBUG:
+        return "DEBUG: ";
+    case FLATTEN_LOG_DEBUG2:
+        return "DEBUG2: ";
+    default:
+        return "";
+    }
+}
+
+bool parseLogLevel(std::string const& name, LogLevel &level)
+{
+    char const* names[] = {"none", "error", "warning", "info", "debug", "debug2"};
+    for(int i = FLATTEN_LOG_NONE; i <= FLATTEN_LOG_DEBUG2; ++i)
+    {
+        if(name == names[i])
+        {
+            level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+Logger::Logger(LogLevel level, int fd)
+    : level(level),
+      fd(fd)
+{
+}
+
+Logger::~Logger()
+{
+    flush();
+}
+
+void Logger::write(LogLevel level, std::string const& message)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer += levelPrefix(level);
+    buffer += message;
+    buffer += '\n';
+
+    //errors must not be lost if the process dies right after
+    if(level <= FLATTEN_LOG_ERROR || buffer.size() >= FLUSH_THRESHOLD)
+        flushLocked();
+}
+
+void Logger::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    flushLocked();
+}
+
+void Logger::flushLocked()
+{
+    size_t done = 0;
+    while(done < buffer.size())
+    {
+        ssize_t n = ::write(fd, buffer.data() + done, buffer.size() - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;      //nowhere to report it, drop the rest
+        done += n;
+    }
+    buffer.clear();
+}
@@ -0,0 +1,68 @@
+#ifndef LOG_HH
+#define LOG_HH
+
+#include <mutex>
+#include <sstream>
+#include <string>
+
+//Message levels, in the order of increasing verbosity. The prefixes are
+//the ones cupsd understands on a filter's stderr. Prefixed, as syslog.h
+//defines LOG_WARNING, LOG_INFO and LOG_DEBUG as macros
+enum LogLevel
+{
+    FLATTEN_LOG_NONE,
+    FLATTEN_LOG_ERROR,
+    FLATTEN_LOG_WARNING,
+    FLATTEN_LOG_INFO,
+    FLATTEN_LOG_DEBUG,
+    FLATTEN_LOG_DEBUG2
+};
+
+//Parse "none", "error", "warning", "info", "debug" or "debug2". Returns
+//false for anything else
+bool parseLogLevel(std::string const& name, LogLevel &level);
+
+//Buffered, leveled log written to a file descriptor. Messages above the
+//level are dropped before they are formatted, see FLATTEN_LOG. Lines are
+//collected and written in large blocks, errors are written at once.
+//Safe to use from several threads
+class Logger
+{
+public:
+    Logger(LogLevel level = FLATTEN_LOG_DEBUG, int fd = 2);
+    ~Logger();
+
+    bool enabled(LogLevel level) const { return level <= this->level && level != FLATTEN_LOG_NONE; }
+    void setLevel(LogLevel level) { this->level = level; }
+
+    //Queue one line, the prefix and newline are added here
+    void write(LogLevel level, std::string const& message);
+    void flush();
+
+private:
+    Logger(Logger const&);
+    Logger& operator=(Logger const&);
+
+    void flushLocked();
+
+    LogLevel level;
+    int fd;
+    std::string buffer;
+    std::mutex mutex;
+};
+
+//Log a streamed message if logger is set and the level is enabled, so a
+//disabled level costs one comparison
+#define FLATTEN_LOG(logger, level, message)                             \
+    do                                                                  \
+    {                                                                   \
+        Logger* flatten_log_ = (logger);                                \
+        if(flatten_log_ != NULL && flatten_log_->enabled(level))        \
+        {                                                               \
+            std::ostringstream flatten_log_message_;                    \
+            flatten_log_message_ << message;                            \
+            flatten_log_->write(level, flatten_log_message_.str());     \
+        }                                                               \
+    } while(0)
+
+#endif
@@ -0,0 +1,57 @@
+#include "MappedFile.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile()
+    : address(MAP_FAILED),
+      length(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if(address != MAP_FAILED)
+        munmap(address, length);
+}
+
+bool MappedFile::open(char const* filename)
+{
+    int fd = ::open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+    bool mapped = open(fd);
+    close(fd);
+    return mapped;
+}
+
+bool MappedFile::open(int fd)
+{
+    struct stat info;
+    if(address != MAP_FAILED || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+        return false;
+
+    //mmap refuses empty files, they fail to parse later like any other
+    //file that is not a PDF
+    if(info.st_size == 0)
+        return false;
+
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapped == MAP_FAILED)
+        return false;
+    address = mapped;
+    length = info.st_size;
+    return true;
+}
+
+char const* MappedFile::data() const
+{
+    return static_cast<char const*>(address);
+}
+
+size_t MappedFile::size() const
+{
+    return length;
+}
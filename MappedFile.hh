@@ -0,0 +1,33 @@
+#ifndef MAPPEDFILE_HH
+#define MAPPEDFILE_HH
+
+#include <cstddef>
+
+//Read only mapping of a whole regular file. The parser reads the document
+//straight out of the page cache, with no stdio buffer in between, and
+//unchanged bytes can be written from the mapping without staging them
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    //Map a file by name or an open descriptor, which stays with the
+    //caller. The whole file is mapped, whatever the descriptor's offset.
+    //False if it is not a regular file or cannot be mapped, the caller
+    //then has to read it normally
+    bool open(char const* filename);
+    bool open(int fd);
+
+    char const* data() const;
+    size_t size() const;
+
+private:
+    MappedFile(MappedFile const&);
+    MappedFile& operator=(MappedFile const&);
+
+    void* address;
+    size_t length;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "Metrics.hh"
+
+#include <ctime>
+
+//CPU time used by all threads of the process, in seconds
+static double processCpuSeconds()
+{
+    struct timespec ts;
+    if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long microseconds(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+Metrics::Metrics(bool trace)
+    : trace(trace),
+      origin(std::chrono::steady_clock::now())
+{
+}
+
+void Metrics::add(std::string const& counter, long long delta)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    counters[counter] += delta;
+}
+
+void Metrics::maximum(std::string const& counter, long long value)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, long long>::iterator it = counters.find(counter);
+    if(it == counters.end())
+        counters[counter] = value;
+    else if(it->second < value)
+        it->second = value;
+}
+
+long long Metrics::counter(std::string const& counter) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, long long>::const_iterator it = counters.find(counter);
+    return it == counters.end() ? 0 : it->second;
+}
+
+void Metrics::recordPhase(char const* name, std::chrono::steady_clock::time_point start,
+                          double wall_seconds, double cpu_seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, PhaseTotal>::iterator it = phases.find(name);
+    if(it == phases.end())
+    {
+        //report the phases in the order they first ran
+        phase_order.push_back(name);
+        PhaseTotal total = {0, 0, 0};
+        it = phases.insert(std::make_pair(std::string(name), total)).first;
+    }
+    it->second.calls++;
+    it->second.wall_seconds += wall_seconds;
+    it->second.cpu_seconds += cpu_seconds;
+
+    if(trace)
+    {
+        TraceEvent event = {name, microseconds(start - origin),
+                            static_cast<long long>(wall_seconds * 1e6), threadNumberLocked()};
+        events.push_back(event);
+    }
+}
+
+void Metrics::recordSpan(char const* name, std::chrono::steady_clock::time_point start,
+                         std::chrono::steady_clock::time_point end)
+{
+    if(!trace)
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    TraceEvent event = {name, microseconds(start - origin), microseconds(end - start),
+                        threadNumberLocked()};
+    events.push_back(event);
+}
+
+//Small stable thread numbers read better in a trace viewer than ids
+int Metrics::threadNumberLocked()
+{
+    std::thread::id id = std::this_thread::get_id();
+    std::map<std::thread::id, int>::iterator it = threads.find(id);
+    if(it == threads.end())
+        it = threads.insert(std::make_pair(id, static_cast<int>(threads.size()) + 1)).first;
+    return it->second;
+}
+
+void Metrics::writeReport(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "{\n  \"counters\": {";
+    for(std::map<std::string, long long>::const_iterator it = counters.begin();
+        it != counters.end(); ++it)
+    {
+        out << (it == counters.begin() ? "\n" : ",\n")
+            << "    \"" << it->first << "\": " << it->second;
+    }
+    out << "\n  },\n  \"phases\": {";
+    for(size_t i = 0; i < phase_order.size(); ++i)
+    {
+        PhaseTotal const& total = phases.find(phase_order[i])->second;
+        out << (i == 0 ? "\n" : ",\n")
+            << "    \"" << phase_order[i] << "\": {\"calls\": " << total.calls
+            << ", \"wall_ms\": " << total.wall_seconds * 1000
+            << ", \"cpu_ms\": " << total.cpu_seconds * 1000 << "}";
+    }
+    out << "\n  }\n}\n";
+}
+
+void Metrics::writeTrace(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for(size_t i = 0; i < events.size(); ++i)
+    {
+        TraceEvent const& event = events[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "{\"name\": \"" << event.name << "\", \"cat\": \"flatten\", \"ph\": \"X\""
+            << ", \"ts\": " << event.start_us << ", \"dur\": " << event.duration_us
+            << ", \"pid\": 1, \"tid\": " << event.thread << "}";
+    }
+    out << "\n]}\n";
+}
+
+PhaseTimer::PhaseTimer(Metrics* metrics, char const* name, std::map<std::string, double>* job)
+    : metrics(metrics),
+      job(job),
+      name(name),
+      cpu_start(0)
+{
+    if(metrics == NULL && job == NULL)
+        return;
+    start = std::chrono::steady_clock::now();
+    if(metrics != NULL)
+        cpu_start = processCpuSeconds();
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    if(metrics == NULL && job == NULL)
+        return;
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+    if(job != NULL)
+        (*job)[name] += wall.count();
+    if(metrics != NULL)
+        metrics->recordPhase(name, start, wall.count(), processCpuSeconds() - cpu_start);
+}
+
+TraceSpan::TraceSpan(Metrics* metrics, char const* name)
+    : metrics(metrics != NULL && metrics->tracing() ? metrics : NULL),
+      name(name)
+{
+    if(this->metrics != NULL)
+        start = std::chrono::steady_clock::now();
+}
+
+TraceSpan::~TraceSpan()
+{
+    if(metrics != NULL)
+        metrics->recordSpan(name, start, std::chrono::steady_clock::now());
+}
@@ -0,0 +1,108 @@
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Counters and per phase timings collected over one or more jobs. The
+//library only records into a Metrics the caller passed in FlattenOptions,
+//without one nothing is measured. Safe to use from several threads
+class Metrics
+{
+public:
+    //With trace set every timed span is also kept as an event for
+    //writeTrace, otherwise only the totals per phase are kept
+    Metrics(bool trace = false);
+
+    bool tracing() const { return trace; }
+
+    void add(std::string const& counter, long long delta);
+    //Raise counter to value if it is lower, for high water marks
+    void maximum(std::string const& counter, long long value);
+    long long counter(std::string const& counter) const;
+
+    //Add one run of a phase to its totals, and to the trace
+    void recordPhase(char const* name, std::chrono::steady_clock::time_point start,
+                     double wall_seconds, double cpu_seconds);
+
+    //Add a span to the trace only, for per item work inside a phase
+    void recordSpan(char const* name, std::chrono::steady_clock::time_point start,
+                    std::chrono::steady_clock::time_point end);
+
+    //{"counters": {...}, "phases": {"name": {"calls", "wall_ms", "cpu_ms"}}}
+    void writeReport(std::ostream &out) const;
+
+    //Chrome trace event format, loadable in chrome://tracing or Perfetto
+    void writeTrace(std::ostream &out) const;
+
+private:
+    struct PhaseTotal
+    {
+        long long calls;
+        double wall_seconds;
+        double cpu_seconds;
+    };
+    struct TraceEvent
+    {
+        char const* name;
+        long long start_us;
+        long long duration_us;
+        int thread;
+    };
+
+    int threadNumberLocked();
+
+    bool trace;
+    std::chrono::steady_clock::time_point origin;
+    std::map<std::string, long long> counters;
+    std::vector<std::string> phase_order;
+    std::map<std::string, PhaseTotal> phases;
+    std::vector<TraceEvent> events;
+    std::map<std::thread::id, int> threads;
+    mutable std::mutex mutex;
+};
+
+//Times the enclosing scope as a phase: wall clock and the CPU time of the
+//whole process, so work handed to other threads is included. The wall
+//time is also added to job, the phase times of a single job, if given.
+//Does nothing when both are NULL
+class PhaseTimer
+{
+public:
+    PhaseTimer(Metrics* metrics, char const* name, std::map<std::string, double>* job = NULL);
+    ~PhaseTimer();
+
+private:
+    PhaseTimer(PhaseTimer const&);
+    PhaseTimer& operator=(PhaseTimer const&);
+
+    Metrics* metrics;
+    std::map<std::string, double>* job;
+    char const* name;
+    std::chrono::steady_clock::time_point start;
+    double cpu_start;
+};
+
+//Records the enclosing scope as a trace span. Does nothing unless
+//metrics is set and tracing, so it can sit in per page loops
+class TraceSpan
+{
+public:
+    TraceSpan(Metrics* metrics, char const* name);
+    ~TraceSpan();
+
+private:
+    TraceSpan(TraceSpan const&);
+    TraceSpan& operator=(TraceSpan const&);
+
+    Metrics* metrics;
+    char const* name;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
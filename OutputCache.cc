@@ -0,0 +1,176 @@
+#include "OutputCache.hh"
+#include "Hash.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Every entry starts with a header of this size: the format, the check
+//hash and the size of the input, padded with spaces
+static char const* const OUTPUT_MAGIC = "flatten-output 1";
+static size_t const OUTPUT_HEADER_SIZE = 64;
+
+//Seed of the check hash, anything different from the options
+static unsigned long long const OUTPUT_CHECK_SEED = 0x9e3779b97f4a7c15ULL;
+
+//Temporaries left behind by a process that died are removed after this
+static time_t const OUTPUT_STALE_SECONDS = 3600;
+
+OutputCacheKey outputCacheKey(char const* data, size_t len, unsigned long long options)
+{
+    OutputCacheKey key;
+    key.name = hash64(data, len, options);
+    key.check = hash64(data, len, OUTPUT_CHECK_SEED);
+    key.size = len;
+    return key;
+}
+
+//The header of an entry for key
+static std::string entryHeader(OutputCacheKey const& key)
+{
+    char header[OUTPUT_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header), "%s %s %llu", OUTPUT_MAGIC, hashToHex(key.check).c_str(), key.size);
+    std::string padded = header;
+    padded.resize(OUTPUT_HEADER_SIZE - 1, ' ');
+    padded += '\n';
+    return padded;
+}
+
+OutputCache::OutputCache(std::string const& directory, long long max_kb)
+    : directory(directory),
+      max_kb(max_kb)
+{
+}
+
+std::string OutputCache::path(unsigned long long name) const
+{
+    return directory + "/" + hashToHex(name) + ".pdf";
+}
+
+int OutputCache::lookup(OutputCacheKey const& key, qpdf_offset_t &offset, qpdf_offset_t &size) const
+{
+    int fd = open(path(key.name).c_str(), O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    //the same name with another input is a collision, not a hit
+    char header[OUTPUT_HEADER_SIZE];
+    struct stat st;
+    if(pread(fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+       std::string(header, sizeof(header)) != entryHeader(key) ||
+       fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    //the modification time orders the entries for eviction
+    futimens(fd, NULL);
+
+    offset = OUTPUT_HEADER_SIZE;
+    size = st.st_size - OUTPUT_HEADER_SIZE;
+    return fd;
+}
+
+int OutputCache::create(OutputCacheKey const& key, std::string &temporary) const
+{
+    if(mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+        return -1;
+
+    temporary = directory + "/.output-XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if(fd < 0)
+        return -1;
+
+    std::string header = entryHeader(key);
+    if(write(fd, header.data(), header.size()) != static_cast<ssize_t>(header.size()))
+    {
+        close(fd);
+        unlink(temporary.c_str());
+        return -1;
+    }
+    return fd;
+}
+
+int OutputCache::insert(OutputCacheKey const& key, std::string const& temporary) const
+{
+    //readers see either no entry or a complete one
+    if(rename(temporary.c_str(), path(key.name).c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return -1;
+    }
+    return evict();
+}
+
+int OutputCache::evict() const
+{
+    struct Entry
+    {
+        std::string path;
+        struct timespec used;
+        long long kb;
+    };
+
+    DIR* dir = opendir(directory.c_str());
+    if(dir == NULL)
+        return 0;
+
+    std::vector<Entry> entries;
+    long long total_kb = 0;
+    time_t now = time(NULL);
+    int evicted = 0;
+    struct dirent* ent;
+    while((ent = readdir(dir)) != NULL)
+    {
+        std::string name = ent->d_name;
+        std::string path = directory + "/" + name;
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if(name.compare(0, 8, ".output-") == 0)
+        {
+            if(now - st.st_mtime > OUTPUT_STALE_SECONDS)
+                unlink(path.c_str());
+            continue;
+        }
+        if(name.size() < 4 || name.compare(name.size() - 4, 4, ".pdf") != 0)
+            continue;
+
+        Entry entry;
+        entry.path = path;
+        entry.used = st.st_mtim;
+        entry.kb = (st.st_size + 1023) / 1024;
+        entries.push_back(entry);
+        total_kb += entry.kb;
+    }
+    closedir(dir);
+
+    if(max_kb <= 0 || total_kb <= max_kb)
+        return 0;
+
+    //least recently used first. Another process may evict at the same
+    //time, a missing file simply counts as gone
+    std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b)
+    {
+        if(a.used.tv_sec != b.used.tv_sec)
+            return a.used.tv_sec < b.used.tv_sec;
+        return a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for(size_t i = 0; i < entries.size() && total_kb > max_kb; ++i)
+    {
+        if(unlink(entries[i].path.c_str()) == 0)
+            ++evicted;
+        total_kb -= entries[i].kb;
+    }
+    return evicted;
+}
@@ -0,0 +1,57 @@
+#ifndef OUTPUTCACHE_HH
+#define OUTPUTCACHE_HH
+
+#include <qpdf/Types.h>
+
+#include <string>
+#include <cstddef>
+
+//Identifies the output of flattening one input with one set of options
+struct OutputCacheKey
+{
+    unsigned long long name;    //hash of the input and the options, names the entry
+    unsigned long long check;   //independent hash of the input, confirms a hit
+    unsigned long long size;    //of the input
+};
+
+//Key for the len bytes of input at data, flattened with options, a hash
+//of everything in the options that changes the output
+OutputCacheKey outputCacheKey(char const* data, size_t len, unsigned long long options);
+
+//Flattened documents stored in a directory, one file per input and
+//options, so that a resubmitted document is served without parsing it.
+//Entries are published by an atomic rename and the least recently used
+//are removed once the directory grows over its limit, so concurrent
+//processes can share a directory. A reader keeps a removed entry it has
+//open
+class OutputCache
+{
+public:
+    //max_kb 0 for no limit
+    OutputCache(std::string const& directory, long long max_kb);
+
+    //Open the output stored for key and mark it as recently used. -1 on a
+    //miss, otherwise the output is the size bytes from offset of the
+    //returned descriptor, which the caller closes
+    int lookup(OutputCacheKey const& key, qpdf_offset_t &offset, qpdf_offset_t &size) const;
+
+    //Start a new entry for key: a temporary file in the directory with the
+    //entry's header written, positioned where the output goes. -1 if it
+    //cannot be created
+    int create(OutputCacheKey const& key, std::string &temporary) const;
+
+    //Publish a complete entry under its name, replacing an existing one,
+    //then evict the least recently used entries over the limit. Returns
+    //the number evicted, or -1 if the entry could not be published, in
+    //which case temporary is removed
+    int insert(OutputCacheKey const& key, std::string const& temporary) const;
+
+private:
+    std::string path(unsigned long long name) const;
+    int evict() const;
+
+    std::string directory;
+    long long max_kb;
+};
+
+#endif
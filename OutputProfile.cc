@@ -0,0 +1,115 @@
+#include "OutputProfile.hh"
+
+#include <qpdf/Pl_Flate.hh>
+
+#include <condition_variable>
+#include <mutex>
+
+static char const* const profile_names[] = {"default", "fast", "small", "web"};
+
+//Holders of the process wide Flate level, all at level 9 or all at the
+//default. flate_waiting counts those queued for each level; while one of
+//the other level waits no new holder joins, so neither side starves
+static std::mutex flate_lock;
+static std::condition_variable flate_released;
+static int flate_holders = 0;
+static bool flate_small = false;
+static int flate_waiting[2] = {0, 0};
+
+bool parseOutputProfile(std::string const& name, OutputProfile &profile)
+{
+    for(size_t i = 0; i < sizeof(profile_names) / sizeof(profile_names[0]); ++i)
+    {
+        if(name == profile_names[i])
+        {
+            profile = static_cast<OutputProfile>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+char const* outputProfileName(OutputProfile profile)
+{
+    return profile_names[profile];
+}
+
+void configureWriter(QPDFWriter &writer, OutputProfile profile)
+{
+    switch(profile)
+    {
+    case PROFILE_DEFAULT:
+        break;
+
+    case PROFILE_FAST:
+        //copy stream data exactly as it is stored and write every object
+        //on its own, so no stream passes through a filter
+        writer.setDecodeLevel(qpdf_dl_none);
+        writer.setCompressStreams(false);
+        writer.setObjectStreamMode(qpdf_o_disable);
+        break;
+
+    case PROFILE_SMALL:
+        writer.setObjectStreamMode(qpdf_o_generate);
+        writer.setCompressStreams(true);
+        writer.setDecodeLevel(qpdf_dl_generalized);
+        writer.setRecompressFlate(true);
+        break;
+
+    case PROFILE_WEB:
+        writer.setLinearization(true);
+        writer.setObjectStreamMode(qpdf_o_preserve);
+        break;
+    }
+    beginFlate(profile);
+}
+
+void resetOutputProfile(OutputProfile profile)
+{
+    endFlate(profile);
+}
+
+void beginFlate(OutputProfile profile)
+{
+    //the fast profile passes stream data through without a filter
+    if(profile == PROFILE_FAST)
+        return;
+
+    bool small = profile == PROFILE_SMALL;
+    std::unique_lock<std::mutex> guard(flate_lock);
+    ++flate_waiting[small];
+    flate_released.wait(guard, [small]()
+    {
+        return flate_holders == 0 || (flate_small == small && flate_waiting[!small] == 0);
+    });
+    --flate_waiting[small];
+
+    if(flate_holders++ == 0 && flate_small != small)
+    {
+        //-1 is zlib's Z_DEFAULT_COMPRESSION
+        Pl_Flate::setCompressionLevel(small ? 9 : -1);
+        flate_small = small;
+    }
+}
+
+void endFlate(OutputProfile profile)
+{
+    if(profile == PROFILE_FAST)
+        return;
+
+    std::lock_guard<std::mutex> guard(flate_lock);
+    if(--flate_holders == 0)
+    {
+        //anything compressing outside the gate gets the default again
+        if(flate_small)
+        {
+            Pl_Flate::setCompressionLevel(-1);
+            flate_small = false;
+        }
+        flate_released.notify_all();
+    }
+    else if(flate_waiting[0] != 0 || flate_waiting[1] != 0)
+    {
+        flate_released.notify_all();
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef OUTPUTPROFILE_HH
+#define OUTPUTPROFILE_HH
+
+#include <qpdf/QPDFWriter.hh>
+
+#include <string>
+
+//How the flattened document is serialized, trading CPU against size
+enum OutputProfile
+{
+    PROFILE_DEFAULT,    //qpdf's defaults
+    PROFILE_FAST,       //pass encoded streams through, no object streams
+    PROFILE_SMALL,      //object streams, everything recompressed at level 9
+    PROFILE_WEB         //linearized for viewers that stream the file
+};
+
+//Map a profile name as given on the command line, false if unknown
+bool parseOutputProfile(std::string const& name, OutputProfile &profile);
+char const* outputProfileName(OutputProfile profile);
+
+//Apply a profile to a writer before write() is called, and release it
+//with resetOutputProfile() after writing. Holds the Flate level of the
+//profile in between, see beginFlate()
+void configureWriter(QPDFWriter &writer, OutputProfile profile);
+void resetOutputProfile(OutputProfile profile);
+
+//qpdf's Flate level is one setting for the whole process, so jobs on
+//other threads would compress at the small profile's level 9 while it
+//writes. Anything that compresses holds the level of its profile from
+//beginFlate() to endFlate(): holders of the same level run at once,
+//holders of different levels take turns. A thread must not hold it twice
+void beginFlate(OutputProfile profile);
+void endFlate(OutputProfile profile);
+
+#endif
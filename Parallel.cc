@@ -0,0 +1,164 @@
+#include "Parallel.hh"
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+unsigned int resolveJobs(unsigned int jobs)
+{
+    if(jobs != 0)
+        return jobs;
+
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores == 0 ? 1 : cores;
+}
+
+void parallelFor(size_t count, unsigned int jobs, std::function<void(size_t)> const& task)
+{
+    jobs = resolveJobs(jobs);
+    if(jobs > count)
+        jobs = count;
+
+    //nothing to gain from threads, keep it simple
+    if(jobs <= 1)
+    {
+        for(size_t i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_lock;
+
+    auto worker = [&]()
+    {
+        size_t i;
+        while(!failed && (i = next++) < count)
+        {
+            try
+            {
+                task(i);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if(!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned int t = 1; t < jobs; ++t)
+        threads.push_back(std::thread(worker));
+    worker();
+
+    for(size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+
+    if(error)
+        std::rethrow_exception(error);
+}
+
+void stealingFor(size_t count, unsigned int jobs, std::function<void(size_t)> const& task)
+{
+    jobs = resolveJobs(jobs);
+    if(jobs > count)
+        jobs = count;
+
+    if(jobs <= 1)
+    {
+        for(size_t i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<size_t> items;
+    };
+    std::vector<Queue> queues(jobs);
+    for(size_t i = 0; i < count; ++i)
+        queues[i % jobs].items.push_back(i);
+
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_lock;
+
+    //own queue first, then the back of the fullest other one
+    auto take = [&](unsigned int self, size_t &item) -> bool
+    {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if(!queues[self].items.empty())
+            {
+                item = queues[self].items.front();
+                queues[self].items.pop_front();
+                return true;
+            }
+        }
+
+        while(true)
+        {
+            unsigned int victim = self;
+            size_t most = 0;
+            for(unsigned int q = 0; q < jobs; ++q)
+            {
+                std::lock_guard<std::mutex> guard(queues[q].lock);
+                if(queues[q].items.size() > most)
+                {
+                    most = queues[q].items.size();
+                    victim = q;
+                }
+            }
+            if(most == 0)
+                return false;
+
+            //the victim may have emptied its queue meanwhile, look again
+            std::lock_guard<std::mutex> guard(queues[victim].lock);
+            if(!queues[victim].items.empty())
+            {
+                item = queues[victim].items.back();
+                queues[victim].items.pop_back();
+                return true;
+            }
+        }
+    };
+
+    auto worker = [&](unsigned int self)
+    {
+        size_t i;
+        while(!failed && take(self, i))
+        {
+            try
+            {
+                task(i);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if(!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned int t = 1; t < jobs; ++t)
+        threads.push_back(std::thread(worker, t));
+    worker(0);
+
+    for(size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+
+    if(error)
+        std::rethrow_exception(error);
+}
@@ -0,0 +1,24 @@
+#ifndef PARALLEL_HH
+#define PARALLEL_HH
+
+#include <functional>
+#include <cstddef>
+
+//Number of worker threads to use for a requested job count, 0 meaning
+//one per available core
+unsigned int resolveJobs(unsigned int jobs);
+
+//Run task(i) for every i in [0, count) on up to jobs threads. Indexes are
+//handed out one at a time so that uneven items balance out. The calling
+//thread takes part in the work. If a task throws, the remaining indexes
+//are skipped and the first exception is rethrown once all workers stopped
+void parallelFor(size_t count, unsigned int jobs, std::function<void(size_t)> const& task);
+
+//Like parallelFor, for few items of very uneven cost such as whole
+//documents. Items are dealt round robin into one queue per thread, so
+//thread t starts with t, t + jobs, t + 2 * jobs and so on. A thread
+//takes from the front of its own queue and, once that is empty, steals
+//from the back of the fullest other queue
+void stealingFor(size_t count, unsigned int jobs, std::function<void(size_t)> const& task);
+
+#endif
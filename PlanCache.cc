@@ -0,0 +1,206 @@
+#include "PlanCache.hh"
+#include "Hash.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Format of the plan files, bumped when their meaning changes
+static char const* const PLAN_MAGIC = "flatten-plan 3";
+
+WidgetPlan::WidgetPlan()
+    : annot_index(0),
+      button(false)
+{
+    for(int i = 0; i < 4; ++i)
+        rect[i] = 0;
+}
+
+PageLayout::PageLayout()
+    : annotation_count(0)
+{
+}
+
+FlattenPlan::FlattenPlan()
+    : extract_seconds(0)
+{
+}
+
+//Entries of a field or widget that decide whether and where it is drawn,
+//none of them changes with the value
+static char const* const FINGERPRINT_KEYS[] = {"/FT", "/Ff", "/Subtype", "/F", "/Rect"};
+
+bool formFingerprint(QPDF &pdf, unsigned long long &fingerprint)
+{
+    //the first /ID entry is kept by every later update of a file
+    QPDFObjectHandle id = pdf.getTrailer().getKey("/ID");
+    if(!id.isArray() || id.getArrayNItems() == 0 || !id.getArrayItem(0).isString() ||
+       id.getArrayItem(0).getStringValue().empty())
+        return false;
+    std::string structure = id.getArrayItem(0).getStringValue();
+    structure += '\n';
+
+    std::vector<QPDFObjectHandle> pending;
+    QPDFObjectHandle acroform = pdf.getRoot().getKey("/AcroForm");
+    if(acroform.isDictionary() && acroform.getKey("/Fields").isArray())
+        pending = acroform.getKey("/Fields").getArrayAsVector();
+    std::reverse(pending.begin(), pending.end());
+
+    //fields and their widgets in tree order, each object once
+    std::set<QPDFObjGen> seen;
+    while(!pending.empty())
+    {
+        QPDFObjectHandle node = pending.back();
+        pending.pop_back();
+        if(!node.isDictionary())
+            continue;
+        if(node.isIndirect() && !seen.insert(node.getObjGen()).second)
+            continue;
+
+        std::ostringstream entry;
+        entry << node.getObjectID() << ' ' << node.getGeneration();
+        for(size_t k = 0; k < sizeof(FINGERPRINT_KEYS) / sizeof(FINGERPRINT_KEYS[0]); ++k)
+        {
+            if(node.hasKey(FINGERPRINT_KEYS[k]))
+                entry << ' ' << FINGERPRINT_KEYS[k] << node.getKey(FINGERPRINT_KEYS[k]).unparseResolved();
+        }
+        //the page by reference only
+        if(node.hasKey("/P"))
+            entry << " /P" << node.getKey("/P").unparse();
+        structure += entry.str();
+        structure += '\n';
+
+        if(node.getKey("/Kids").isArray())
+        {
+            std::vector<QPDFObjectHandle> kids = node.getKey("/Kids").getArrayAsVector();
+            pending.insert(pending.end(), kids.rbegin(), kids.rend());
+        }
+    }
+    fingerprint = hash64(structure);
+    return true;
+}
+
+bool planMatches(QPDF &pdf, FlattenPlan const& plan)
+{
+    for(size_t p = 0; p < plan.pages.size(); ++p)
+    {
+        PageLayout const& layout = plan.pages[p];
+        QPDFObjectHandle page = pdf.getObjectByObjGen(layout.page);
+        if(!page.isPageObject())
+            return false;
+
+        QPDFObjectHandle annots = page.getKey("/Annots");
+        if(!annots.isArray() || static_cast<size_t>(annots.getArrayNItems()) != layout.annotation_count)
+            return false;
+
+        for(size_t w = 0; w < layout.widgets.size(); ++w)
+        {
+            size_t index = layout.widgets[w].annot_index;
+            if(index >= layout.annotation_count)
+                return false;
+            QPDFObjectHandle annot = annots.getArrayItem(index);
+            if(!annot.isDictionary() || annot.getKey("/Subtype").unparse() != "/Widget")
+                return false;
+        }
+    }
+    return true;
+}
+
+PlanCache::PlanCache(std::string const& directory)
+    : directory(directory)
+{
+}
+
+std::string PlanCache::path(unsigned long long fingerprint) const
+{
+    return directory + "/" + hashToHex(fingerprint) + ".plan";
+}
+
+bool PlanCache::load(unsigned long long fingerprint, FlattenPlan &plan) const
+{
+    std::ifstream in(path(fingerprint).c_str());
+    std::string line;
+    if(!std::getline(in, line) || line != PLAN_MAGIC)
+        return false;
+
+    FlattenPlan loaded;
+    std::string keyword;
+    while(in >> keyword)
+    {
+        if(keyword == "extract_seconds")
+        {
+            in >> loaded.extract_seconds;
+        }
+        else if(keyword == "page")
+        {
+            int object = 0;
+            int generation = 0;
+            loaded.pages.push_back(PageLayout());
+            in >> object >> generation >> loaded.pages.back().annotation_count;
+            loaded.pages.back().page = QPDFObjGen(object, generation);
+        }
+        else if(keyword == "widget" && !loaded.pages.empty())
+        {
+            WidgetPlan widget;
+            in >> widget.annot_index >> widget.button;
+            for(int i = 0; i < 4; ++i)
+                in >> widget.rect[i];
+            loaded.pages.back().widgets.push_back(widget);
+        }
+        else
+        {
+            return false;
+        }
+        if(!in)
+            return false;
+    }
+
+    plan = loaded;
+    return true;
+}
+
+bool PlanCache::store(unsigned long long fingerprint, FlattenPlan const& plan) const
+{
+    if(mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+        return false;
+
+    std::string temporary = directory + "/.plan-XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if(fd < 0)
+        return false;
+    close(fd);
+
+    std::ofstream out(temporary.c_str());
+    out.precision(17);
+    out << PLAN_MAGIC << "\n";
+    out << "extract_seconds " << plan.extract_seconds << "\n";
+    for(size_t p = 0; p < plan.pages.size(); ++p)
+    {
+        PageLayout const& layout = plan.pages[p];
+        out << "page " << layout.page.getObj() << " " << layout.page.getGen() << " "
+            << layout.annotation_count << "\n";
+        for(size_t w = 0; w < layout.widgets.size(); ++w)
+        {
+            WidgetPlan const& widget = layout.widgets[w];
+            out << "widget " << widget.annot_index << " " << widget.button;
+            for(int i = 0; i < 4; ++i)
+                out << " " << widget.rect[i];
+            out << "\n";
+        }
+    }
+    out.close();
+
+    //readers see either the old plan or the complete new one
+    if(!out || rename(temporary.c_str(), path(fingerprint).c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef PLANCACHE_HH
+#define PLANCACHE_HH
+
+#include <qpdf/QPDF.hh>
+
+#include <string>
+#include <vector>
+
+//What flattening found about one widget, independent of its value. The
+//placement of the appearance depends on the fill and is not part of it
+struct WidgetPlan
+{
+    WidgetPlan();
+
+    size_t annot_index;     //position in the page's /Annots
+    bool button;            //appearance is picked by /AS
+    double rect[4];         ///Rect of the widget
+};
+
+//The widgets of one page
+struct PageLayout
+{
+    PageLayout();
+
+    QPDFObjGen page;            //the page object
+    size_t annotation_count;    //size of /Annots when the plan was made
+    std::vector<WidgetPlan> widgets;
+};
+
+//Layout of a form's widgets, which is the same for every fill of one
+//blank template. Appearance streams, their geometry, names and values are
+//still looked up on every run, the plan only replaces discovering the
+//widget pages and walking the field tree for their types
+struct FlattenPlan
+{
+    FlattenPlan();
+
+    double extract_seconds;     //time the discovery took without the plan
+    std::vector<PageLayout> pages;
+};
+
+//Fingerprint of the structure of a form: the permanent /ID and the field
+//tree under /AcroForm /Fields with the object number, field type, flags,
+///Rect and page of every node, but not values or appearances. Fills of
+//one template that keep the objects of the template get the same
+//fingerprint. Returns false for a file without an /ID, where object
+//numbers alone could match an unrelated file
+bool formFingerprint(QPDF &pdf, unsigned long long &fingerprint);
+
+//Check that a plan still fits pdf: its pages are page objects, their
+///Annots have the recorded sizes and the planned annotations are widgets.
+//Only the pages of the plan are read
+bool planMatches(QPDF &pdf, FlattenPlan const& plan);
+
+//Plans stored as text files named by fingerprint in a directory, which is
+//created when needed. Files are replaced atomically, so concurrent jobs
+//can share a directory
+class PlanCache
+{
+public:
+    PlanCache(std::string const& directory);
+
+    bool load(unsigned long long fingerprint, FlattenPlan &plan) const;
+
+    //Returns false if the plan could not be written, which only costs
+    //the next run the time to make it again
+    bool store(unsigned long long fingerprint, FlattenPlan const& plan) const;
+
+private:
+    std::string path(unsigned long long fingerprint) const;
+
+    std::string directory;
+};
+
+#endif
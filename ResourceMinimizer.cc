@@ -0,0 +1,173 @@
+#include "ResourceMinimizer.hh"
+
+#include <qpdf/Buffer.hh>
+
+#include <cctype>
+#include <cstring>
+#include <exception>
+#include <vector>
+
+//Resource categories that content operators can refer to by name
+static char const* const categories[] =
+{
+    "/ExtGState", "/ColorSpace", "/Pattern", "/Shading", "/XObject", "/Font", "/Properties"
+};
+
+static bool isDelimiter(unsigned char c)
+{
+    return isspace(c) || c == '\0' || strchr("()<>[]{}/%", c) != NULL;
+}
+
+static int hexValue(unsigned char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+std::set<std::string> contentNames(std::string const& content)
+{
+    std::set<std::string> names;
+    size_t i = 0;
+    while(i < content.size())
+    {
+        if(content[i] != '/')
+        {
+            ++i;
+            continue;
+        }
+
+        //qpdf keeps names in their unescaped form, so #xx is decoded
+        std::string name = "/";
+        for(++i; i < content.size() && !isDelimiter(content[i]); ++i)
+        {
+            if(content[i] == '#' && i + 2 < content.size() &&
+               hexValue(content[i + 1]) >= 0 && hexValue(content[i + 2]) >= 0)
+            {
+                name.push_back(static_cast<char>(hexValue(content[i + 1]) * 16 + hexValue(content[i + 2])));
+                i += 2;
+            }
+            else
+            {
+                name.push_back(content[i]);
+            }
+        }
+        names.insert(name);
+    }
+    return names;
+}
+
+ResourceMinimizer::ResourceMinimizer(QPDF &pdf)
+    : pdf(pdf),
+      dropped(0)
+{
+}
+
+QPDFObjectHandle ResourceMinimizer::minimize(QPDFObjectHandle resources, std::string const& content)
+{
+    bool changed = false;
+    return reduce(resources, content, changed);
+}
+
+QPDFObjectHandle ResourceMinimizer::reduce(QPDFObjectHandle resources, std::string const& content,
+                                           bool &changed)
+{
+    changed = false;
+    if(!resources.isDictionary())
+        return resources;
+
+    std::set<std::string> names = contentNames(content);
+    QPDFObjectHandle reduced = QPDFObjectHandle::newDictionary();
+    size_t removed = 0;
+
+    std::set<std::string> keys = resources.getKeys();
+    for(std::set<std::string>::iterator key = keys.begin(); key != keys.end(); ++key)
+    {
+        if(*key == "/ProcSet")
+        {
+            reduced.replaceKey(*key, resources.getKey(*key));
+            continue;
+        }
+
+        bool known = false;
+        for(size_t c = 0; c < sizeof(categories) / sizeof(categories[0]); ++c)
+            known = known || *key == categories[c];
+        QPDFObjectHandle category = resources.getKey(*key);
+        if(!known || !category.isDictionary())
+        {
+            removed++;
+            continue;
+        }
+
+        QPDFObjectHandle kept = QPDFObjectHandle::newDictionary();
+        std::set<std::string> entries = category.getKeys();
+        for(std::set<std::string>::iterator entry = entries.begin(); entry != entries.end(); ++entry)
+        {
+            if(!names.count(*entry))
+            {
+                removed++;
+                continue;
+            }
+
+            //a form without resources of its own borrows ours, then
+            //nothing can be known to be unused
+            QPDFObjectHandle value = category.getKey(*entry);
+            if(*key == "/XObject" && value.isStream() &&
+               value.getDict().getKey("/Subtype").unparse() == "/Form" &&
+               !value.getDict().hasKey("/Resources"))
+                return resources;
+            kept.replaceKey(*entry, value);
+        }
+        if(!kept.getKeys().empty())
+            reduced.replaceKey(*key, kept);
+    }
+
+    if(removed == 0)
+        return resources;
+    dropped += removed;
+    changed = true;
+
+    //appearances of the same font and colours share one dictionary
+    std::string key = reduced.unparse();
+    std::map<std::string, QPDFObjectHandle>::iterator it = shared.find(key);
+    if(it == shared.end())
+        it = shared.insert(std::make_pair(key, pdf.makeIndirectObject(reduced))).first;
+    return it->second;
+}
+
+QPDFObjectHandle ResourceMinimizer::minimizeAppearance(QPDFObjectHandle appearance)
+{
+    if(!appearance.isStream())
+        return QPDFObjectHandle::newNull();
+    if(appearance.isIndirect() && !visited.insert(appearance.getObjGen()).second)
+        return QPDFObjectHandle::newNull();
+
+    QPDFObjectHandle resources = appearance.getDict().getKey("/Resources");
+    if(!resources.isDictionary() || resources.getKeys().empty())
+        return QPDFObjectHandle::newNull();
+
+    std::string content;
+    try
+    {
+        PointerHolder<Buffer> data = appearance.getStreamData();
+        content.assign(reinterpret_cast<char const*>(data->getBuffer()), data->getSize());
+    }
+    catch(std::exception &)
+    {
+        //cannot tell what it uses, leave it alone
+        return QPDFObjectHandle::newNull();
+    }
+
+    bool changed = false;
+    QPDFObjectHandle reduced = reduce(resources, content, changed);
+    return changed ? reduced : QPDFObjectHandle::newNull();
+}
+
+size_t ResourceMinimizer::entriesDropped() const
+{
+    return dropped;
+}
@@ -0,0 +1,46 @@
+#ifndef RESOURCEMINIMIZER_HH
+#define RESOURCEMINIMIZER_HH
+
+#include <qpdf/QPDF.hh>
+#include <qpdf/QPDFObjectHandle.hh>
+
+#include <map>
+#include <set>
+#include <string>
+
+//Every name token in a content stream, without the slash's escapes
+//resolved as #xx. Used to decide which resources the content can refer
+//to, so it errs on the side of finding too many
+std::set<std::string> contentNames(std::string const& content);
+
+//Cuts the /Resources of appearance streams down to the entries their
+//content refers to. /AcroForm /DR is typically attached whole to every
+//appearance, dragging all of its fonts into the output. The reduced
+//dictionaries are indirect and shared between streams that keep the same
+//entries. Categories other than the standard ones are dropped, /ProcSet
+//is kept as it is
+class ResourceMinimizer
+{
+public:
+    ResourceMinimizer(QPDF &pdf);
+
+    //Resources for content, or resources itself if nothing can be dropped
+    QPDFObjectHandle minimize(QPDFObjectHandle resources, std::string const& content);
+
+    //Reduced /Resources for an existing appearance stream, decoding its
+    //data. A null object if the stream was handled before, its resources
+    //are complete already or its data cannot be decoded
+    QPDFObjectHandle minimizeAppearance(QPDFObjectHandle appearance);
+
+    size_t entriesDropped() const;
+
+private:
+    QPDFObjectHandle reduce(QPDFObjectHandle resources, std::string const& content, bool &changed);
+
+    QPDF &pdf;
+    std::map<std::string, QPDFObjectHandle> shared;     //by unparsed contents
+    std::set<QPDFObjGen> visited;
+    size_t dropped;
+};
+
+#endif
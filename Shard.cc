@@ -0,0 +1,351 @@
+#include "Shard.hh"
+#include "Parallel.hh"
+
+#include <qpdf/QPDFWriter.hh>
+#include <qpdf/Pl_Count.hh>
+#include <qpdf/Pl_StdioFile.hh>
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+//Catalog entries that change how pages are rendered or identified: the
+//print condition, the default visibility of layers, the language and the
+//metadata that names the PDF/X or PDF/A conformance, and the version
+static char const* const SHARD_CATALOG_KEYS[] = {
+    "/OutputIntents", "/OCProperties", "/Lang", "/Metadata", "/MarkInfo", "/Version"
+};
+
+//Bytes an object costs in the file besides its stream data: its number,
+//dictionary and xref entry, roughly
+static long long const SHARD_OBJECT_OVERHEAD = 64;
+
+ShardOptions::ShardOptions()
+    : count(0),
+      target_bytes(0),
+      prefix("output"),
+      jobs(0),
+      profile(PROFILE_DEFAULT),
+      metrics(NULL)
+{
+}
+
+Shard::Shard()
+    : first_page(0),
+      page_count(0),
+      bytes_estimated(0),
+      bytes_written(0),
+      seconds(0)
+{
+}
+
+//Add the stream bytes of page and everything it refers to that is not in
+//seen yet. Other pages, reached through /Parent or link destinations, are
+//not followed: they belong to their own shard or are not copied at all
+static long long pageBytes(QPDFObjectHandle page, std::set<QPDFObjGen> &seen)
+{
+    QPDFObjGen self = page.getObjGen();
+    long long bytes = 0;
+    std::vector<QPDFObjectHandle> pending(1, page);
+    while(!pending.empty())
+    {
+        QPDFObjectHandle object = pending.back();
+        pending.pop_back();
+
+        if(object.isIndirect())
+        {
+            if(object.isPageObject() && !(object.getObjGen() == self))
+                continue;
+            if(!seen.insert(object.getObjGen()).second)
+                continue;
+            bytes += SHARD_OBJECT_OVERHEAD;
+        }
+
+        if(object.isStream())
+        {
+            QPDFObjectHandle dict = object.getDict();
+            QPDFObjectHandle length = dict.getKey("/Length");
+            if(length.isInteger())
+                bytes += length.getIntValue();
+            object = dict;
+        }
+
+        if(object.isArray())
+        {
+            std::vector<QPDFObjectHandle> items = object.getArrayAsVector();
+            pending.insert(pending.end(), items.begin(), items.end());
+        }
+        else if(object.isDictionary())
+        {
+            std::map<std::string, QPDFObjectHandle> entries = object.getDictAsMap();
+            for(std::map<std::string, QPDFObjectHandle>::iterator it = entries.begin();
+                it != entries.end(); ++it)
+            {
+                if(it->first != "/Parent")
+                    pending.push_back(it->second);
+            }
+        }
+    }
+    return bytes;
+}
+
+std::vector<Shard> planShards(QPDF &pdf, ShardOptions const& options)
+{
+    std::vector<QPDFObjectHandle> pages = pdf.getAllPages();
+    std::vector<Shard> shards;
+    if(pages.empty())
+        return shards;
+
+    if(options.target_bytes > 0)
+    {
+        std::set<QPDFObjGen> seen;
+        Shard current;
+        for(size_t i = 0; i < pages.size(); ++i)
+        {
+            long long bytes = pageBytes(pages[i], seen);
+            if(current.page_count != 0 && current.bytes_estimated + bytes > options.target_bytes)
+            {
+                //the page opens the next shard, which has to carry its
+                //shared resources again
+                shards.push_back(current);
+                current = Shard();
+                seen.clear();
+                bytes = pageBytes(pages[i], seen);
+            }
+            if(current.page_count == 0)
+                current.first_page = i + 1;
+            current.page_count++;
+            current.bytes_estimated += bytes;
+        }
+        shards.push_back(current);
+    }
+    else
+    {
+        size_t count = options.count == 0 ? 1 : std::min(options.count, pages.size());
+        size_t first = 0;
+        for(size_t n = 0; n < count; ++n)
+        {
+            //the first pages.size() % count shards take one page more
+            Shard shard;
+            shard.first_page = first + 1;
+            shard.page_count = pages.size() / count + (n < pages.size() % count ? 1 : 0);
+            std::set<QPDFObjGen> seen;
+            for(size_t i = first; i < first + shard.page_count; ++i)
+                shard.bytes_estimated += pageBytes(pages[i], seen);
+            first += shard.page_count;
+            shards.push_back(shard);
+        }
+    }
+
+    for(size_t n = 0; n < shards.size(); ++n)
+    {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "-%03zu.pdf", n + 1);
+        shards[n].filename = options.prefix + suffix;
+    }
+    return shards;
+}
+
+void writeShardManifest(std::ostream &out, std::vector<Shard> const& shards)
+{
+    out << "shard\tfile\tfirst_page\tlast_page\n";
+    for(size_t n = 0; n < shards.size(); ++n)
+    {
+        Shard const& shard = shards[n];
+        out << n + 1 << "\t"
+            << shard.filename << "\t"
+            << shard.first_page << "\t"
+            << shard.first_page + shard.page_count - 1 << "\n";
+    }
+}
+
+//Copy value from another document into pdf. qpdf only copies indirect
+//objects, direct arrays and dictionaries are rebuilt around them
+static QPDFObjectHandle copyInto(QPDF &pdf, QPDFObjectHandle value)
+{
+    if(value.isIndirect())
+        return pdf.copyForeignObject(value);
+
+    if(value.isArray())
+    {
+        QPDFObjectHandle copy = QPDFObjectHandle::newArray();
+        for(int i = 0; i < value.getArrayNItems(); ++i)
+            copy.appendItem(copyInto(pdf, value.getArrayItem(i)));
+        return copy;
+    }
+    if(value.isDictionary())
+    {
+        QPDFObjectHandle copy = QPDFObjectHandle::newDictionary();
+        std::map<std::string, QPDFObjectHandle> entries = value.getDictAsMap();
+        for(std::map<std::string, QPDFObjectHandle>::iterator it = entries.begin(); it != entries.end(); ++it)
+            copy.replaceKey(it->first, copyInto(pdf, it->second));
+        return copy;
+    }
+    //scalars belong to no document
+    return value;
+}
+
+//Parsed copies of the document for the shard writers. QPDF objects are
+//not safe to share between threads, not even their reference counts, so
+//a copy is lent to one writer at a time, which keeps it until its shard
+//is written as the copied pages still refer to it. A copy is only parsed
+//when all others are lent out, so there are at most as many as writers
+//run at once and a single writer reuses the parse the shards were
+//planned on
+class SourcePool
+{
+public:
+    SourcePool(QPDF &planned, char const* data, size_t len)
+        : data(data),
+          len(len)
+    {
+        //attributes inherited from /Pages would be lost with the page tree
+        planned.pushInheritedAttributesToPage();
+        idle.push_back(&planned);
+    }
+
+    QPDF& acquire()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(!idle.empty())
+            {
+                QPDF* source = idle.back();
+                idle.pop_back();
+                return *source;
+            }
+        }
+
+        //objects are read lazily, so only the pages of the shards this
+        //copy serves and what they use are parsed
+        QPDF* source;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            parsed.emplace_back();
+            source = &parsed.back();
+        }
+        source->processMemoryFile("flattened document", data, len);
+        source->pushInheritedAttributesToPage();
+        return *source;
+    }
+
+    void release(QPDF &source)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        idle.push_back(&source);
+    }
+
+private:
+    char const* data;
+    size_t len;
+    std::mutex lock;
+    std::vector<QPDF*> idle;
+    std::list<QPDF> parsed;     //stable addresses
+};
+
+//Copy the pages of shard out of source into a new document and write it
+//to temporary
+static void writeShard(QPDF &source, Shard &shard, ShardOptions const& options, std::string const& temporary)
+{
+    std::vector<QPDFObjectHandle> pages = source.getAllPages();
+
+    QPDF pdf;
+    pdf.emptyPDF();
+    QPDFObjectHandle source_root = source.getRoot();
+    QPDFObjectHandle root = pdf.getRoot();
+    for(size_t k = 0; k < sizeof(SHARD_CATALOG_KEYS) / sizeof(SHARD_CATALOG_KEYS[0]); ++k)
+    {
+        if(!source_root.hasKey(SHARD_CATALOG_KEYS[k]))
+            continue;
+        QPDFObjectHandle value = source_root.getKey(SHARD_CATALOG_KEYS[k]);
+        root.replaceKey(SHARD_CATALOG_KEYS[k], copyInto(pdf, value));
+    }
+    for(size_t i = shard.first_page - 1; i < shard.first_page - 1 + shard.page_count; ++i)
+        pdf.addPage(pdf.copyForeignObject(pages[i]), false);
+
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if(out == NULL)
+        throw std::runtime_error("cannot create " + temporary + ": " + strerror(errno));
+    try
+    {
+        Pl_StdioFile file("shard", out);
+        Pl_Count count("shard output", &file);
+        QPDFWriter w(pdf);
+        w.setOutputPipeline(&count);
+        //the blank document starts out at an older version than the pages need
+        w.setMinimumPDFVersion(source.getPDFVersion());
+        configureWriter(w, options.profile);
+        try
+        {
+            w.write();
+        }
+        catch(...)
+        {
+            resetOutputProfile(options.profile);
+            throw;
+        }
+        resetOutputProfile(options.profile);
+        shard.bytes_written = count.getCount();
+    }
+    catch(...)
+    {
+        fclose(out);
+        throw;
+    }
+    if(fclose(out) != 0)
+        throw std::runtime_error("cannot write " + temporary + ": " + strerror(errno));
+}
+
+void writeShards(QPDF &source, char const* data, size_t len, std::vector<Shard> &shards,
+                 ShardOptions const& options)
+{
+    PhaseTimer timer(options.metrics, "shard");
+    SourcePool sources(source, data, len);
+
+    //indexes are handed out in order, so the first shards start first
+    parallelFor(shards.size(), options.jobs, [&](size_t n)
+    {
+        Shard &shard = shards[n];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        //consumers only ever see complete shards under the final name
+        std::string temporary = shard.filename + ".part";
+        QPDF &copy = sources.acquire();
+        try
+        {
+            writeShard(copy, shard, options, temporary);
+        }
+        catch(...)
+        {
+            sources.release(copy);
+            unlink(temporary.c_str());
+            throw;
+        }
+        sources.release(copy);
+        if(rename(temporary.c_str(), shard.filename.c_str()) != 0)
+        {
+            int error = errno;
+            unlink(temporary.c_str());
+            throw std::runtime_error("cannot write " + shard.filename + ": " + strerror(error));
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        shard.seconds = elapsed.count();
+        if(options.metrics != NULL)
+        {
+            options.metrics->recordSpan("shard", start, std::chrono::steady_clock::now());
+            options.metrics->add("shards_written", 1);
+            options.metrics->add("shard_bytes_written", shard.bytes_written);
+        }
+    });
+}
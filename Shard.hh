@@ -0,0 +1,62 @@
+#ifndef SHARD_HH
+#define SHARD_HH
+
+#include "OutputProfile.hh"
+#include "Metrics.hh"
+
+#include <qpdf/QPDF.hh>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+//How a flattened document is split into standalone PDFs of consecutive
+//pages, for consumers such as a RIP farm that work on several at once
+struct ShardOptions
+{
+    ShardOptions();
+
+    size_t count;               //split into this many page ranges, 0 for none
+    long long target_bytes;     //or into shards of about this size, 0 for none
+    std::string prefix;         //shard n is written to prefix-NNN.pdf
+    unsigned int jobs;          //shards written at once, 0 = all cores
+    OutputProfile profile;      //writer settings of the shards
+    Metrics* metrics;           //counters and phase timings, NULL for none
+};
+
+//One shard and, once written, what it cost
+struct Shard
+{
+    Shard();
+
+    std::string filename;
+    size_t first_page;          //1 based, in document page order
+    size_t page_count;
+    long long bytes_estimated;  //stream bytes of its pages and their resources
+    long long bytes_written;
+    double seconds;             //wall time to copy and write it
+};
+
+//Page ranges for options. By size, a page joins the current shard unless
+//that would take it past target_bytes; resources it shares with earlier
+//pages of the shard are only counted once, as they are only written once
+std::vector<Shard> planShards(QPDF &pdf, ShardOptions const& options);
+
+//Tab separated shard number, file, first and last page of every shard in
+//order, with a header line
+void writeShardManifest(std::ostream &out, std::vector<Shard> const& shards);
+
+//Write every shard on up to options.jobs threads, lowest page first.
+//source is the document the shards were planned on, parsed from the len
+//bytes at data. The first thread copies its pages from source, threads
+//that find it busy parse their own copy of data once and keep it for the
+//shards they write after. The pages of a shard are copied into an empty
+//document, so shared fonts and XObjects are written once per shard, along
+//with the catalog entries that affect rendering. A shard is written
+//under a temporary name and renamed when complete, so a consumer may
+//start on any shard whose file exists. Throws std::runtime_error if a
+//shard cannot be written, removing its partial file
+void writeShards(QPDF &source, char const* data, size_t len, std::vector<Shard> &shards,
+                 ShardOptions const& options);
+
+#endif
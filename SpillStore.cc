@@ -0,0 +1,155 @@
+#include "SpillStore.hh"
+
+#include <qpdf/Pipeline.hh>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+SpillStore::SpillStore()
+    : fd(-1),
+      size(0)
+{
+    char const* dir = getenv("TMPDIR");
+    std::string path = std::string(dir != NULL && *dir != '\0' ? dir : "/tmp") + "/flatten-XXXXXX";
+    fd = mkstemp(&path[0]);
+    if(fd < 0)
+        throw std::runtime_error("cannot create spill file in " + path + ": " + strerror(errno));
+
+    //nothing else needs the name, the space is freed when fd closes
+    unlink(path.c_str());
+}
+
+SpillStore::~SpillStore()
+{
+    if(fd >= 0)
+        close(fd);
+}
+
+void SpillStore::put(QPDFObjGen const& og, std::string const& data)
+{
+    size_t done = 0;
+    while(done < data.size())
+    {
+        ssize_t n = pwrite(fd, data.data() + done, data.size() - done, size + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            throw std::runtime_error(std::string("cannot write spill file: ") + strerror(errno));
+        done += n;
+    }
+
+    extents[og] = std::make_pair(size, static_cast<long long>(data.size()));
+    size += data.size();
+}
+
+void SpillStore::provideStreamData(int objid, int generation, Pipeline* pipeline)
+{
+    std::map<QPDFObjGen, std::pair<long long, long long> >::iterator extent =
+        extents.find(QPDFObjGen(objid, generation));
+    if(extent == extents.end())
+        throw std::logic_error("stream not in spill file");
+
+    unsigned char buf[65536];
+    long long offset = extent->second.first;
+    long long remaining = extent->second.second;
+    while(remaining > 0)
+    {
+        size_t want = remaining < static_cast<long long>(sizeof(buf)) ? remaining : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            throw std::runtime_error(std::string("cannot read spill file: ") + strerror(errno));
+        pipeline->write(buf, n);
+        offset += n;
+        remaining -= n;
+    }
+    pipeline->finish();
+}
+
+long long SpillStore::bytesSpilled() const
+{
+    return size;
+}
+
+MemoryBudget::MemoryBudget(long long max_rss_kb, long long item_kb)
+    : max_rss_kb(max_rss_kb),
+      kb_per_item(item_kb > 0 ? item_kb : 1),
+      measured(false),
+      batch_start_kb(0)
+{
+}
+
+size_t MemoryBudget::nextBatch(size_t remaining)
+{
+    batch_start_kb = currentRssKb();
+    long long items = (max_rss_kb - batch_start_kb) / 2 / kb_per_item;
+    if(items < 1)
+        items = 1;
+    return std::min(remaining, static_cast<size_t>(items));
+}
+
+void MemoryBudget::batchDone(size_t items)
+{
+    //memory freed to the allocator is rarely returned, growth is what
+    //counts
+    long long grown_kb = currentRssKb() - batch_start_kb;
+    if(items == 0 || grown_kb <= 0)
+        return;
+    long long per_item = (grown_kb + items - 1) / items;
+    if(!measured || per_item > kb_per_item)
+        kb_per_item = per_item;
+    measured = true;
+}
+
+//A kB value of /proc/self/status, -1 if not there
+static long long statusKb(char const* key)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t length = strlen(key);
+    while(std::getline(status, line))
+    {
+        if(line.compare(0, length, key) == 0)
+            return strtoll(line.c_str() + length, NULL, 10);
+    }
+    return -1;
+}
+
+long long peakRssKb()
+{
+    //VmHWM is the one resetPeakRss clears, ru_maxrss only ever grows
+    long long peak = statusKb("VmHWM:");
+    if(peak >= 0)
+        return peak;
+
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss;
+}
+
+long long currentRssKb()
+{
+    long long current = statusKb("VmRSS:");
+    return current >= 0 ? current : peakRssKb();
+}
+
+bool resetPeakRss()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if(fd < 0)
+        return false;
+    bool reset = write(fd, "5", 1) == 1;
+    close(fd);
+    return reset;
+}
@@ -0,0 +1,74 @@
+#ifndef SPILLSTORE_HH
+#define SPILLSTORE_HH
+
+#include <qpdf/QPDFObjectHandle.hh>
+#include <qpdf/QPDFObjGen.hh>
+
+#include <map>
+#include <string>
+#include <utility>
+
+//Stream data parked in an unlinked temporary file until the writer asks
+//for it, so generated contents do not stay in memory between flattening
+//and writing. Streams get the store as their StreamDataProvider after
+//put(); the data is handed out exactly as stored, so the stream's /Filter
+//has to describe it. The file lives in $TMPDIR, /tmp if unset
+class SpillStore : public QPDFObjectHandle::StreamDataProvider
+{
+public:
+    SpillStore();
+    virtual ~SpillStore();
+
+    //Append the data of the stream og
+    void put(QPDFObjGen const& og, std::string const& data);
+
+    virtual void provideStreamData(int objid, int generation, Pipeline* pipeline);
+
+    long long bytesSpilled() const;
+
+private:
+    SpillStore(SpillStore const&);
+    SpillStore& operator=(SpillStore const&);
+
+    int fd;
+    long long size;
+    std::map<QPDFObjGen, std::pair<long long, long long> > extents;     //offset, length
+};
+
+//Splits work into batches that fit a memory budget. A batch gets as many
+//items as half of the resident memory left below the budget holds, at
+//the most one item has been seen to add, so batches shrink as the process
+//nears the budget and grow while it is well below it
+class MemoryBudget
+{
+public:
+    //item_kb is what an item is assumed to take until a batch is measured
+    MemoryBudget(long long max_rss_kb, long long item_kb);
+
+    //Items of the next batch, at least one and at most remaining
+    size_t nextBatch(size_t remaining);
+
+    //The batch from the last nextBatch is done, items of it were processed
+    void batchDone(size_t items);
+
+private:
+    long long max_rss_kb;
+    long long kb_per_item;      //most an item added, a guess until measured
+    bool measured;
+    long long batch_start_kb;   //resident memory when the batch started
+};
+
+//Peak resident set size of the process so far, or since resetPeakRss,
+//in kilobytes
+long long peakRssKb();
+
+//Resident set size of the process now, in kilobytes. The peak where the
+//system does not report it
+long long currentRssKb();
+
+//Start counting the peak of peakRssKb again from the current resident
+//set size. Returns false where the system does not allow it, as outside
+//Linux, and the peak keeps covering the whole process
+bool resetPeakRss();
+
+#endif
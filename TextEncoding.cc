@@ -0,0 +1,230 @@
+#include "TextEncoding.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+static uint64_t const HIGH_BITS = 0x8080808080808080ULL;
+static uint64_t const LOW_BITS = 0x0101010101010101ULL;
+
+//Unicode values of the PDFDocEncoding codes that differ from Latin-1,
+//0x18 to 0x1f and 0x80 to 0xa0. 0 where the code is undefined
+static unsigned short const pdf_doc_low[8] =
+{
+    0x02d8, 0x02c7, 0x02c6, 0x02d9, 0x02dd, 0x02db, 0x02da, 0x02dc
+};
+
+static unsigned short const pdf_doc_high[33] =
+{
+    0x2022, 0x2020, 0x2021, 0x2026, 0x2014, 0x2013, 0x0192, 0x2044,
+    0x2039, 0x203a, 0x2212, 0x2030, 0x201e, 0x201c, 0x201d, 0x2018,
+    0x2019, 0x201a, 0x2122, 0xfb01, 0xfb02, 0x0141, 0x0152, 0x0160,
+    0x0178, 0x017d, 0x0131, 0x0142, 0x0153, 0x0161, 0x017e, 0x0000,
+    0x20ac
+};
+
+//Unicode values of WinAnsiEncoding 0x80 to 0x9f, 0 where undefined. The
+//rest of the upper half is Latin-1
+static unsigned short const win_ansi_high[32] =
+{
+    0x20ac, 0x0000, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+    0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x0000, 0x017d, 0x0000,
+    0x0000, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+    0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x0000, 0x017e, 0x0178
+};
+
+//Lookup tables derived from the ones above once per process
+struct EncodingTables
+{
+    EncodingTables()
+    {
+        //Latin-1 maps onto itself apart from the C1 controls, which
+        //WinAnsiEncoding uses for other characters
+        for(int c = 0; c < 256; ++c)
+            latin1_to_win_ansi[c] = (c >= 0x80 && c < 0xa0) ? '?' : c;
+
+        for(int c = 0; c < 32; ++c)
+        {
+            if(win_ansi_high[c] != 0)
+                specials.push_back(std::make_pair(win_ansi_high[c], static_cast<unsigned char>(0x80 + c)));
+        }
+        std::sort(specials.begin(), specials.end());
+
+        for(int c = 0; c < 256; ++c)
+        {
+            unsigned int unicode = c;
+            if(c >= 0x18 && c <= 0x1f)
+                unicode = pdf_doc_low[c - 0x18];
+            else if(c >= 0x80 && c <= 0xa0)
+                unicode = pdf_doc_high[c - 0x80];
+            pdf_doc_to_win_ansi[c] = toWinAnsi(unicode);
+        }
+    }
+
+    unsigned char toWinAnsi(unsigned int unicode) const
+    {
+        if(unicode < 256)
+            return latin1_to_win_ansi[unicode];
+        std::vector<std::pair<unsigned short, unsigned char> >::const_iterator it =
+            std::lower_bound(specials.begin(), specials.end(),
+                             std::make_pair(static_cast<unsigned short>(unicode > 0xffff ? 0xffff : unicode),
+                                            static_cast<unsigned char>(0)));
+        if(it != specials.end() && it->first == unicode)
+            return it->second;
+        return '?';
+    }
+
+    unsigned char latin1_to_win_ansi[256];
+    unsigned char pdf_doc_to_win_ansi[256];
+    std::vector<std::pair<unsigned short, unsigned char> > specials;     //sorted by Unicode value
+};
+
+static EncodingTables const& tables()
+{
+    static EncodingTables const instance;
+    return instance;
+}
+
+unsigned int winAnsiUnicode(unsigned char code)
+{
+    if(code >= 0x80 && code < 0xa0)
+        return win_ansi_high[code - 0x80];
+    return code;
+}
+
+//Nonzero if any byte of word is zero
+static inline uint64_t zeroByte(uint64_t word)
+{
+    return (word - LOW_BITS) & ~word & HIGH_BITS;
+}
+
+//ASCII without the codes 0x18 to 0x1f, which PDFDocEncoding uses for
+//accents. Eight bytes are tested at a time
+bool isPlainText(char const* data, size_t size)
+{
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        if((word & HIGH_BITS) != 0 ||
+           zeroByte((word & 0xf8f8f8f8f8f8f8f8ULL) ^ 0x1818181818181818ULL) != 0)
+            return false;
+    }
+    for(; i < size; ++i)
+    {
+        unsigned char c = data[i];
+        if(c >= 0x80 || (c >= 0x18 && c <= 0x1f))
+            return false;
+    }
+    return true;
+}
+
+//Append one character of a font with encoding
+static inline void appendCode(std::string &out, unsigned int unicode, FontEncoding encoding)
+{
+    if(encoding == ENCODING_WIN_ANSI)
+        out.push_back(tables().toWinAnsi(unicode));
+    else
+        out.push_back(unicode < 256 ? static_cast<char>(unicode) : '?');
+}
+
+static std::string fromUtf16(std::string const& text, FontEncoding encoding)
+{
+    std::string out;
+    out.reserve(text.size() / 2);
+    size_t i = 2;
+
+    //runs of ASCII, four code units of 0x00nn with nn below 0x80 at a time
+    for(; i + 8 <= text.size(); i += 8)
+    {
+        unsigned char const* units = reinterpret_cast<unsigned char const*>(text.data() + i);
+        uint64_t word;
+        memcpy(&word, units, 8);
+        //byte order independent: every even byte 0, every odd byte < 0x80
+        if((units[0] | units[2] | units[4] | units[6]) != 0 || (word & HIGH_BITS) != 0)
+            break;
+        out.push_back(units[1]);
+        out.push_back(units[3]);
+        out.push_back(units[5]);
+        out.push_back(units[7]);
+    }
+
+    for(; i + 1 < text.size(); i += 2)
+    {
+        unsigned int unit = (static_cast<unsigned char>(text[i]) << 8) |
+                            static_cast<unsigned char>(text[i + 1]);
+
+        //a surrogate pair is one character outside any single byte encoding
+        if(unit >= 0xd800 && unit < 0xdc00 && i + 3 < text.size())
+        {
+            unsigned int next = (static_cast<unsigned char>(text[i + 2]) << 8) |
+                                static_cast<unsigned char>(text[i + 3]);
+            if(next >= 0xdc00 && next < 0xe000)
+                i += 2;
+            out.push_back('?');
+            continue;
+        }
+        appendCode(out, unit, encoding);
+    }
+    return out;
+}
+
+static std::string fromUtf8(std::string const& text, FontEncoding encoding)
+{
+    std::string out;
+    out.reserve(text.size() - 3);
+    size_t i = 3;
+    while(i < text.size())
+    {
+        unsigned char lead = text[i];
+        if(lead < 0x80)
+        {
+            out.push_back(lead);
+            ++i;
+            continue;
+        }
+
+        //sequence length and payload bits of the lead byte, malformed
+        //sequences give one '?' per byte
+        int length = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 0;
+        unsigned int unicode = length == 4 ? (lead & 0x07) : length == 3 ? (lead & 0x0f) : (lead & 0x1f);
+        bool valid = length != 0 && i + length <= text.size();
+        for(int k = 1; valid && k < length; ++k)
+        {
+            unsigned char c = text[i + k];
+            valid = (c & 0xc0) == 0x80;
+            unicode = (unicode << 6) | (c & 0x3f);
+        }
+        if(!valid)
+        {
+            out.push_back('?');
+            ++i;
+            continue;
+        }
+        appendCode(out, unicode, encoding);
+        i += length;
+    }
+    return out;
+}
+
+std::string encodeText(std::string const& text, FontEncoding encoding)
+{
+    unsigned char const* bytes = reinterpret_cast<unsigned char const*>(text.data());
+    if(text.size() >= 2 && bytes[0] == 0xfe && bytes[1] == 0xff)
+        return fromUtf16(text, encoding);
+    if(text.size() >= 3 && bytes[0] == 0xef && bytes[1] == 0xbb && bytes[2] == 0xbf)
+        return fromUtf8(text, encoding);
+
+    //PDFDocEncoding, which symbolic fonts get unchanged
+    if(encoding != ENCODING_WIN_ANSI || isPlainText(text.data(), text.size()))
+        return text;
+
+    unsigned char const* table = tables().pdf_doc_to_win_ansi;
+    std::string out(text.size(), '\0');
+    for(size_t i = 0; i < text.size(); ++i)
+        out[i] = table[bytes[i]];
+    return out;
+}
@@ -0,0 +1,28 @@
+#ifndef TEXTENCODING_HH
+#define TEXTENCODING_HH
+
+#include <cstddef>
+#include <string>
+
+//How a simple font maps single byte codes to glyphs, as far as text
+//conversion is concerned
+enum FontEncoding
+{
+    ENCODING_WIN_ANSI,      //WinAnsiEncoding, also assumed without /Encoding
+    ENCODING_BUILTIN        //symbolic or unknown, bytes are shown as stored
+};
+
+//Convert a PDF text string, PDFDocEncoding or UTF-16BE or UTF-8 with a
+//byte order mark, into codes of a font with the given encoding. Characters
+//the font encoding lacks become '?'. The result still needs escaping
+//before it goes into a content stream
+std::string encodeText(std::string const& text, FontEncoding encoding);
+
+//Unicode value of a WinAnsiEncoding code, 0 where the code is undefined
+unsigned int winAnsiUnicode(unsigned char code);
+
+//True if data is the same in PDFDocEncoding and WinAnsiEncoding, which
+//is the case for nearly all form values
+bool isPlainText(char const* data, size_t size);
+
+#endif
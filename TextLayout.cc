@@ -0,0 +1,255 @@
+#include "TextLayout.hh"
+#include "ContentEmitter.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+//Size used for auto sized multiline fields before shrinking, and the
+//smallest size auto sizing goes down to
+static double const AUTO_SIZE_MAX = 12;
+static double const AUTO_SIZE_MIN = 4;
+
+DefaultAppearance::DefaultAppearance()
+    : valid(false),
+      size(0)
+{
+}
+
+DefaultAppearance const& DefaultAppearanceCache::parse(std::string const& da)
+{
+    std::map<std::string, DefaultAppearance>::iterator it = parsed.find(da);
+    if(it != parsed.end())
+        return it->second;
+
+    std::vector<std::string> tokens;
+    std::istringstream in(da);
+    std::string token;
+    while(in >> token)
+        tokens.push_back(token);
+
+    //the last Tf wins, as it would when the stream is interpreted
+    DefaultAppearance appearance;
+    size_t tf = tokens.size();
+    for(size_t i = tokens.size(); i-- > 2; )
+    {
+        if(tokens[i] == "Tf" && tokens[i - 2][0] == '/')
+        {
+            tf = i;
+            break;
+        }
+    }
+
+    if(tf != tokens.size())
+    {
+        appearance.valid = true;
+        appearance.font = tokens[tf - 2];
+        appearance.size = std::fabs(strtod(tokens[tf - 1].c_str(), NULL));
+        for(size_t i = 0; i < tf - 2; ++i)
+            appearance.before += tokens[i] + " ";
+        for(size_t i = tf + 1; i < tokens.size(); ++i)
+            appearance.after += tokens[i] + " ";
+    }
+    return parsed.insert(std::make_pair(da, appearance)).first->second;
+}
+
+TextBox::TextBox()
+    : width(0),
+      height(0),
+      padding(2),
+      quadding(0),
+      multiline(false),
+      comb(false),
+      max_len(0)
+{
+}
+
+static double lineHeight(FontMetrics const& font, double size)
+{
+    return std::max(1.0, (font.ascent - font.descent) / 1000) * size;
+}
+
+//Break text into lines no wider than limit at size. Explicit line
+//breaks are kept, words longer than a line are split between characters
+static std::vector<std::string> wrapText(std::string const& text, double limit,
+                                         FontMetrics const& font, double size)
+{
+    std::vector<std::string> lines;
+    double scale = size / 1000;
+
+    std::string paragraph;
+    for(size_t i = 0; i <= text.size(); ++i)
+    {
+        if(i < text.size() && text[i] != '\r' && text[i] != '\n')
+        {
+            paragraph.push_back(text[i]);
+            continue;
+        }
+        if(i < text.size() && text[i] == '\r' && i + 1 < text.size() && text[i + 1] == '\n')
+            ++i;
+
+        std::string line;
+        double line_width = 0;
+        size_t pos = 0;
+        while(pos < paragraph.size())
+        {
+            size_t end = paragraph.find(' ', pos);
+            if(end == std::string::npos)
+                end = paragraph.size();
+            std::string word = paragraph.substr(pos, end - pos);
+            pos = end + 1;
+
+            double space = line.empty() ? 0 : font.widths[' '] * scale;
+            double word_width = font.width(word) * scale;
+            if(!line.empty() && line_width + space + word_width > limit)
+            {
+                lines.push_back(line);
+                line.clear();
+                line_width = 0;
+                space = 0;
+            }
+
+            if(line.empty() && word_width > limit)
+            {
+                //a word wider than the box, split it anywhere
+                for(size_t c = 0; c < word.size(); ++c)
+                {
+                    double char_width = font.widths[static_cast<unsigned char>(word[c])] * scale;
+                    if(!line.empty() && line_width + char_width > limit)
+                    {
+                        lines.push_back(line);
+                        line.clear();
+                        line_width = 0;
+                    }
+                    line.push_back(word[c]);
+                    line_width += char_width;
+                }
+                continue;
+            }
+
+            if(!line.empty())
+                line.push_back(' ');
+            line += word;
+            line_width += space + word_width;
+        }
+        lines.push_back(line);
+        paragraph.clear();
+    }
+    return lines;
+}
+
+static void showText(ContentEmitter &content, std::string const& text, double x, double y)
+{
+    double matrix[6] = {1, 0, 0, 1, x, y};
+    for(int i = 0; i < 6; ++i)
+        content.number(matrix[i]);
+    content.op("Tm");
+    content.literal(text);
+    content.op("Tj");
+}
+
+std::string layoutText(std::string const& text, TextBox const& box,
+                       DefaultAppearance const& da, FontMetrics const& font)
+{
+    double inner_width = std::max(0.0, box.width - 2 * box.padding);
+    double inner_height = std::max(0.0, box.height - 2 * box.padding);
+    bool comb = box.comb && box.max_len > 0 && !box.multiline;
+
+    //pick the size first, everything else depends on it
+    double size = da.size;
+    std::vector<std::string> lines;
+    if(box.multiline)
+    {
+        if(size == 0)
+        {
+            for(size = AUTO_SIZE_MAX; size > AUTO_SIZE_MIN; size -= 0.5)
+            {
+                lines = wrapText(text, inner_width, font, size);
+                if(lines.size() * lineHeight(font, size) <= inner_height)
+                    break;
+            }
+        }
+        lines = wrapText(text, inner_width, font, size);
+    }
+    else
+    {
+        //single line fields show everything on one line
+        std::string line = text;
+        std::replace(line.begin(), line.end(), '\r', ' ');
+        std::replace(line.begin(), line.end(), '\n', ' ');
+        if(comb && line.size() > static_cast<size_t>(box.max_len))
+            line.resize(box.max_len);
+
+        if(size == 0)
+        {
+            size = inner_height * 1000 / std::max(1.0, font.ascent - font.descent);
+            double text_width = comb ? font.widths['W'] : font.width(line);
+            double available = comb ? box.width / box.max_len - 2 * box.padding : inner_width;
+            if(text_width > 0)
+                size = std::min(size, available * 1000 / text_width);
+            size = std::max(size, AUTO_SIZE_MIN);
+        }
+        lines.push_back(line);
+    }
+    double scale = size / 1000;
+
+    ContentEmitter content;
+    content.reserve(128 + text.size() * 2);
+    content.op("/Tx BMC");
+    content.op("q");
+
+    //keep the text inside the border
+    content.number(box.padding);
+    content.number(box.padding);
+    content.number(inner_width);
+    content.number(inner_height);
+    content.op("re W n");
+
+    content.op("BT");
+    content.append(da.before);
+    content.name(da.font);
+    content.number(size);
+    content.op("Tf");
+    if(!da.after.empty())
+        content.op(da.after.c_str());
+
+    if(comb)
+    {
+        //characters centered in max_len equal cells across the field
+        double cell = box.width / box.max_len;
+        double y = (box.height - (font.ascent - font.descent) * scale) / 2 - font.descent * scale;
+        std::string const& line = lines[0];
+        for(size_t i = 0; i < line.size(); ++i)
+        {
+            double char_width = font.widths[static_cast<unsigned char>(line[i])] * scale;
+            showText(content, line.substr(i, 1), i * cell + (cell - char_width) / 2, y);
+        }
+    }
+    else
+    {
+        double leading = lineHeight(font, size);
+        double y;
+        if(box.multiline)
+            y = box.height - box.padding - font.ascent * scale;
+        else
+            y = (box.height - (font.ascent - font.descent) * scale) / 2 - font.descent * scale;
+
+        for(size_t i = 0; i < lines.size(); ++i, y -= leading)
+        {
+            double line_width = font.width(lines[i]) * scale;
+            double x = box.padding;
+            if(box.quadding == 1)
+                x = (box.width - line_width) / 2;
+            else if(box.quadding == 2)
+                x = box.width - box.padding - line_width;
+            showText(content, lines[i], x, y);
+        }
+    }
+
+    content.op("ET");
+    content.op("Q");
+    content.op("EMC");
+    return content.data();
+}
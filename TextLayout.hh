@@ -0,0 +1,53 @@
+#ifndef TEXTLAYOUT_HH
+#define TEXTLAYOUT_HH
+
+#include "FontMetrics.hh"
+
+#include <map>
+#include <string>
+
+//A parsed /DA string: the Tf operands pulled out so that the font size
+//can be replaced, the remaining operators kept as they are
+struct DefaultAppearance
+{
+    DefaultAppearance();
+
+    bool valid;             //false if there is no Tf operator
+    std::string font;       //resource name with the slash
+    double size;            //0 means auto size
+    std::string before;     //operators in front of Tf
+    std::string after;      //operators behind Tf
+};
+
+//Parses each distinct /DA string once per document
+class DefaultAppearanceCache
+{
+public:
+    DefaultAppearance const& parse(std::string const& da);
+
+private:
+    std::map<std::string, DefaultAppearance> parsed;
+};
+
+//Geometry and flags of the field to lay out
+struct TextBox
+{
+    TextBox();
+
+    double width;
+    double height;
+    double padding;     //inset from the border on every side
+    int quadding;       //0 left, 1 centered, 2 right
+    bool multiline;
+    bool comb;          //one character per cell, needs max_len
+    int max_len;        //0 if unlimited
+};
+
+//Content stream of a /Tx or /Ch appearance showing text in box: clipped
+//to the inset box, aligned by quadding, word wrapped when multiline, one
+//character per cell for combs. A font size of 0 picks the largest size
+//that fits. text is in the font's single byte encoding
+std::string layoutText(std::string const& text, TextBox const& box,
+                       DefaultAppearance const& da, FontMetrics const& font);
+
+#endif
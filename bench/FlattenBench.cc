@@ -0,0 +1,295 @@
+//Time the phases of flattening synthetic or real forms and emit JSON.
+//Optionally compare against a stored baseline produced by an earlier run
+
+#include "../FormFlattener.hh"
+#include "../SpillStore.hh"
+
+#include <qpdf/Pl_Count.hh>
+#include <qpdf/Pl_Discard.hh>
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//Phases of FlattenResult::phase_seconds reported for every document, in
+//the order they run. A phase a document skips is reported as 0
+static char const* const BENCH_PHASES[] = {
+    "parse", "plan", "index", "pages", "need appearances",
+    "extract", "build", "commit", "compress", "write"
+};
+static size_t const BENCH_PHASE_COUNT = sizeof(BENCH_PHASES) / sizeof(BENCH_PHASES[0]);
+
+//Timings of one document, in milliseconds
+struct BenchRun
+{
+    std::string name;
+    long long widget_pages;
+    long long widgets;
+    bool passed_through;
+    bool output_cache_hit;
+    bool plan_cache_hit;
+    double phase_ms[BENCH_PHASE_COUNT];
+    double total_ms;
+    long long output_bytes;
+    long long peak_rss_kb;
+};
+
+void usage()
+{
+    std::cerr << "Usage: FlattenBench [options] <input_file>..." << std::endl;
+    std::cerr << "  --jobs N           build threads (default 1)" << std::endl;
+    std::cerr << "  --repeat N         runs per file, the fastest is kept (default 3)" << std::endl;
+    std::cerr << "  --plan-cache DIR   use a plan cache, later runs hit it" << std::endl;
+    std::cerr << "  --output-cache DIR use an output cache, later runs hit it" << std::endl;
+    std::cerr << "  --output FILE      write the JSON report to FILE instead of stdout" << std::endl;
+    std::cerr << "  --baseline FILE    compare with an earlier report" << std::endl;
+    std::cerr << "  --tolerance PCT    allowed slowdown per widget (default 25)" << std::endl;
+    exit(2);
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+//Report key of a phase, "need appearances" becomes need_appearances_ms
+std::string phaseKey(std::string phase)
+{
+    for(size_t i = 0; i < phase.size(); ++i)
+    {
+        if(phase[i] == ' ')
+            phase[i] = '_';
+    }
+    return phase + "_ms";
+}
+
+//Flatten the document in data the way Flatten does, through
+//FormFlattener::flattenBuffer, so pass-through, the caches and
+//precompression are part of the time
+BenchRun runOnce(std::string const& filename, std::string const& data, FlattenOptions const& options)
+{
+    BenchRun run;
+    run.name = filename;
+
+    //the peak of this run only, where the system can reset it
+    resetPeakRss();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Pl_Discard discard;
+    Pl_Count count("bench output", &discard);
+    FormFlattener flattener(options);
+    FlattenResult result = flattener.flattenBuffer(data.data(), data.size(), &count);
+    run.total_ms = millisecondsSince(start);
+    if(!result.success)
+        throw std::runtime_error(result.error);
+
+    run.widget_pages = result.pages_visited;
+    run.widgets = result.widgets_flattened;
+    run.passed_through = result.passed_through;
+    run.output_cache_hit = result.output_cache_hit;
+    run.plan_cache_hit = result.plan_cache_hit;
+    for(size_t p = 0; p < BENCH_PHASE_COUNT; ++p)
+    {
+        std::map<std::string, double>::const_iterator phase = result.phase_seconds.find(BENCH_PHASES[p]);
+        run.phase_ms[p] = phase != result.phase_seconds.end() ? phase->second * 1000 : 0;
+    }
+    run.output_bytes = count.getCount();
+    run.peak_rss_kb = result.peak_rss_kb;
+    return run;
+}
+
+void writeReport(std::ostream &out, std::vector<BenchRun> const& runs)
+{
+    out << "{\n  \"runs\": [\n";
+    for(size_t i = 0; i < runs.size(); ++i)
+    {
+        BenchRun const& run = runs[i];
+        out << "    {\n"
+            << "      \"name\": \"" << run.name << "\",\n"
+            << "      \"widget_pages\": " << run.widget_pages << ",\n"
+            << "      \"widgets\": " << run.widgets << ",\n"
+            << "      \"passed_through\": " << run.passed_through << ",\n"
+            << "      \"output_cache_hit\": " << run.output_cache_hit << ",\n"
+            << "      \"plan_cache_hit\": " << run.plan_cache_hit << ",\n";
+        for(size_t p = 0; p < BENCH_PHASE_COUNT; ++p)
+            out << "      \"" << phaseKey(BENCH_PHASES[p]) << "\": " << run.phase_ms[p] << ",\n";
+        out << "      \"total_ms\": " << run.total_ms << ",\n"
+            << "      \"output_bytes\": " << run.output_bytes << ",\n"
+            << "      \"peak_rss_kb\": " << run.peak_rss_kb << "\n"
+            << "    }" << (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+//Read the numeric fields of each run back from a report written by
+//writeReport. This is not a general JSON parser
+std::map<std::string, std::map<std::string, double> > readReport(std::string const& filename)
+{
+    std::map<std::string, std::map<std::string, double> > runs;
+    std::ifstream in(filename.c_str());
+    std::string line;
+    std::string current;
+    while(std::getline(in, line))
+    {
+        size_t key_start = line.find('"');
+        if(key_start == std::string::npos)
+            continue;
+        size_t key_end = line.find('"', key_start + 1);
+        size_t colon = line.find(':', key_end);
+        if(key_end == std::string::npos || colon == std::string::npos)
+            continue;
+
+        std::string key = line.substr(key_start + 1, key_end - key_start - 1);
+        std::string value = line.substr(colon + 1);
+        if(key == "name")
+        {
+            size_t value_start = value.find('"');
+            size_t value_end = value.rfind('"');
+            if(value_start != value_end)
+                current = value.substr(value_start + 1, value_end - value_start - 1);
+        }
+        else if(!current.empty())
+        {
+            runs[current][key] = strtod(value.c_str(), NULL);
+        }
+    }
+    return runs;
+}
+
+//Compare the time per widget of every phase, so that a corpus document
+//that changed size still compares sensibly. Returns the regression count
+int compareWithBaseline(std::vector<BenchRun> const& runs, std::string const& filename, double tolerance)
+{
+    std::map<std::string, std::map<std::string, double> > baseline = readReport(filename);
+    int regressions = 0;
+
+    for(size_t i = 0; i < runs.size(); ++i)
+    {
+        BenchRun const& run = runs[i];
+        if(baseline.find(run.name) == baseline.end())
+        {
+            std::cerr << run.name << ": not in baseline" << std::endl;
+            continue;
+        }
+        std::map<std::string, double> &old = baseline[run.name];
+
+        std::vector<std::pair<std::string, double> > phases;
+        for(size_t p = 0; p < BENCH_PHASE_COUNT; ++p)
+            phases.push_back(std::make_pair(phaseKey(BENCH_PHASES[p]), run.phase_ms[p]));
+        phases.push_back(std::make_pair(std::string("total_ms"), run.total_ms));
+
+        double widgets = run.widgets > 0 ? run.widgets : 1;
+        double old_widgets = old["widgets"] > 0 ? old["widgets"] : 1;
+        for(size_t p = 0; p < phases.size(); ++p)
+        {
+            double now = phases[p].second / widgets;
+            double before = old[phases[p].first] / old_widgets;
+
+            //sub millisecond phases are all noise
+            if(phases[p].second < 1.0 && old[phases[p].first] < 1.0)
+                continue;
+
+            double change = before > 0 ? (now - before) / before * 100 : 0;
+            if(change > tolerance)
+            {
+                std::cerr << "REGRESSION " << run.name << " " << phases[p].first
+                          << ": " << old[phases[p].first] << " -> " << phases[p].second
+                          << " ms (" << change << "% per widget)" << std::endl;
+                regressions++;
+            }
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv)
+{
+    FlattenOptions options;
+    int repeat = 3;
+    double tolerance = 25;
+    std::string output;
+    std::string baseline;
+    std::vector<std::string> inputs;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "--jobs" && i + 1 < argc)
+            options.jobs = atoi(argv[++i]);
+        else if(arg == "--repeat" && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if(arg == "--plan-cache" && i + 1 < argc)
+            options.plan_cache_dir = argv[++i];
+        else if(arg == "--output-cache" && i + 1 < argc)
+            options.output_cache_dir = argv[++i];
+        else if(arg == "--output" && i + 1 < argc)
+            output = argv[++i];
+        else if(arg == "--baseline" && i + 1 < argc)
+            baseline = argv[++i];
+        else if(arg == "--tolerance" && i + 1 < argc)
+            tolerance = strtod(argv[++i], NULL);
+        else if(arg[0] != '-')
+            inputs.push_back(arg);
+        else
+            usage();
+    }
+    if(inputs.empty() || repeat < 1)
+        usage();
+
+    std::vector<BenchRun> runs;
+    for(size_t i = 0; i < inputs.size(); ++i)
+    {
+        BenchRun best;
+        try
+        {
+            //read once, so the disk is not part of the time
+            std::ifstream in(inputs[i].c_str(), std::ios::binary);
+            std::ostringstream contents;
+            contents << in.rdbuf();
+            if(!in)
+                throw std::runtime_error("cannot read " + inputs[i]);
+            std::string data = contents.str();
+
+            for(int r = 0; r < repeat; ++r)
+            {
+                BenchRun run = runOnce(inputs[i], data, options);
+                if(r == 0 || run.total_ms < best.total_ms)
+                    best = run;
+            }
+        }
+        catch(std::exception &e)
+        {
+            std::cerr << inputs[i] << ": " << e.what() << std::endl;
+            return 1;
+        }
+        std::cerr << inputs[i] << ": " << best.total_ms << " ms" << std::endl;
+        runs.push_back(best);
+    }
+
+    if(output.empty())
+    {
+        writeReport(std::cout, runs);
+    }
+    else
+    {
+        std::ofstream out(output.c_str());
+        writeReport(out, runs);
+    }
+
+    if(!baseline.empty())
+    {
+        int regressions = compareWithBaseline(runs, baseline, tolerance);
+        if(regressions != 0)
+            return 1;
+        std::cerr << "No regressions against " << baseline << std::endl;
+    }
+    return 0;
+}
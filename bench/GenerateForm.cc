@@ -0,0 +1,262 @@
+//Generate synthetic AcroForm documents for the benchmarks
+
+#include <qpdf/QPDF.hh>
+#include <qpdf/QPDFWriter.hh>
+#include <qpdf/QPDFObjectHandle.hh>
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct FormParameters
+{
+    int pages;
+    int widgets_per_page;
+    int depth;              //levels of the field tree, 1 = flat /Fields
+    int text_weight;        //text : checkbox : radio mix
+    int checkbox_weight;
+    int radio_weight;
+    bool shared;            //one appearance per kind instead of one per widget
+    bool need_appearances;  //text fields come without /AP
+};
+
+void usage()
+{
+    std::cerr << "Usage: GenerateForm [options] <output_file>" << std::endl;
+    std::cerr << "  --pages N              pages (default 10)" << std::endl;
+    std::cerr << "  --widgets N            widgets per page (default 20)" << std::endl;
+    std::cerr << "  --depth N              field tree depth (default 1)" << std::endl;
+    std::cerr << "  --mix T:C:R            text:checkbox:radio ratio (default 1:0:0)" << std::endl;
+    std::cerr << "  --shared | --unique    shared or per widget appearances (default unique)" << std::endl;
+    std::cerr << "  --need-appearances     set /NeedAppearances true" << std::endl;
+    exit(2);
+}
+
+std::string number(long long n)
+{
+    std::ostringstream s;
+    s << n;
+    return s.str();
+}
+
+QPDFObjectHandle rectangle(double llx, double lly, double urx, double ury)
+{
+    QPDFObjectHandle rect = QPDFObjectHandle::newArray();
+    rect.appendItem(QPDFObjectHandle::newReal(llx, 2));
+    rect.appendItem(QPDFObjectHandle::newReal(lly, 2));
+    rect.appendItem(QPDFObjectHandle::newReal(urx, 2));
+    rect.appendItem(QPDFObjectHandle::newReal(ury, 2));
+    return rect;
+}
+
+//Form XObject with the given contents, its /BBox at the origin
+QPDFObjectHandle formXObject(QPDF &pdf, std::string const& contents,
+                             double width, double height, QPDFObjectHandle resources)
+{
+    QPDFObjectHandle stream = QPDFObjectHandle::newStream(&pdf, contents);
+    QPDFObjectHandle dict = stream.getDict();
+    dict.replaceKey("/Type", QPDFObjectHandle::newName("/XObject"));
+    dict.replaceKey("/Subtype", QPDFObjectHandle::newName("/Form"));
+    dict.replaceKey("/BBox", rectangle(0, 0, width, height));
+    dict.replaceKey("/Resources", resources);
+    return stream;
+}
+
+std::string textAppearance(std::string const& value)
+{
+    return "/Tx BMC q BT /Helv 10 Tf 0 g 2 4 Td (" + value + ") Tj ET Q EMC\n";
+}
+
+int main(int argc, char** argv)
+{
+    FormParameters params;
+    params.pages = 10;
+    params.widgets_per_page = 20;
+    params.depth = 1;
+    params.text_weight = 1;
+    params.checkbox_weight = 0;
+    params.radio_weight = 0;
+    params.shared = false;
+    params.need_appearances = false;
+
+    char const* output = NULL;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "--pages" && i + 1 < argc)
+            params.pages = atoi(argv[++i]);
+        else if(arg == "--widgets" && i + 1 < argc)
+            params.widgets_per_page = atoi(argv[++i]);
+        else if(arg == "--depth" && i + 1 < argc)
+            params.depth = atoi(argv[++i]);
+        else if(arg == "--mix" && i + 1 < argc)
+        {
+            if(sscanf(argv[++i], "%d:%d:%d", &params.text_weight,
+                      &params.checkbox_weight, &params.radio_weight) != 3)
+                usage();
+        }
+        else if(arg == "--shared")
+            params.shared = true;
+        else if(arg == "--unique")
+            params.shared = false;
+        else if(arg == "--need-appearances")
+            params.need_appearances = true;
+        else if(arg[0] != '-' && output == NULL)
+            output = argv[i];
+        else
+            usage();
+    }
+
+    int total_weight = params.text_weight + params.checkbox_weight + params.radio_weight;
+    if(output == NULL || params.pages < 1 || params.widgets_per_page < 0 ||
+       params.depth < 1 || total_weight <= 0)
+        usage();
+
+    QPDF pdf;
+    pdf.emptyPDF();
+
+    QPDFObjectHandle font = pdf.makeIndirectObject(QPDFObjectHandle::parse(
+        "<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica /Encoding /WinAnsiEncoding >>"));
+    QPDFObjectHandle zapf = pdf.makeIndirectObject(QPDFObjectHandle::parse(
+        "<< /Type /Font /Subtype /Type1 /BaseFont /ZapfDingbats >>"));
+
+    QPDFObjectHandle fonts = QPDFObjectHandle::newDictionary();
+    fonts.replaceKey("/Helv", font);
+    fonts.replaceKey("/ZaDb", zapf);
+    QPDFObjectHandle default_resources = QPDFObjectHandle::newDictionary();
+    default_resources.replaceKey("/Font", fonts);
+    default_resources = pdf.makeIndirectObject(default_resources);
+
+    //appearances reused by every widget in shared mode
+    QPDFObjectHandle shared_text = formXObject(pdf, textAppearance("N/A"), 150, 16, default_resources);
+    QPDFObjectHandle shared_on = formXObject(pdf, "q BT /ZaDb 10 Tf 2 3 Td (4) Tj ET Q\n", 14, 14, default_resources);
+    QPDFObjectHandle shared_off = formXObject(pdf, "", 14, 14, default_resources);
+
+    QPDFObjectHandle fields = QPDFObjectHandle::newArray();
+    long long widget_number = 0;
+
+    for(int p = 0; p < params.pages; ++p)
+    {
+        QPDFObjectHandle page = QPDFObjectHandle::parse(
+            "<< /Type /Page /MediaBox [0 0 612 792] >>");
+        QPDFObjectHandle page_resources = QPDFObjectHandle::newDictionary();
+        QPDFObjectHandle page_fonts = QPDFObjectHandle::newDictionary();
+        page_fonts.replaceKey("/F1", font);
+        page_resources.replaceKey("/Font", page_fonts);
+        page.replaceKey("/Resources", page_resources);
+        page.replaceKey("/Contents", QPDFObjectHandle::newStream(&pdf,
+            "BT /F1 18 Tf 72 740 Td (Synthetic form page " + number(p + 1) + ") Tj ET\n"));
+        page = pdf.makeIndirectObject(page);
+
+        //chain of non-terminal fields above this page's widgets
+        QPDFObjectHandle parent;
+        for(int level = 1; level < params.depth; ++level)
+        {
+            QPDFObjectHandle field = QPDFObjectHandle::newDictionary();
+            field.replaceKey("/T", QPDFObjectHandle::newString("p" + number(p) + "l" + number(level)));
+            field.replaceKey("/Kids", QPDFObjectHandle::newArray());
+            field = pdf.makeIndirectObject(field);
+            if(parent.isInitialized())
+            {
+                field.replaceKey("/Parent", parent);
+                parent.getKey("/Kids").appendItem(field);
+            }
+            else
+            {
+                fields.appendItem(field);
+            }
+            parent = field;
+        }
+
+        QPDFObjectHandle annots = QPDFObjectHandle::newArray();
+        for(int w = 0; w < params.widgets_per_page; ++w, ++widget_number)
+        {
+            double llx = 72 + (w % 3) * 160;
+            double lly = 700 - (w / 3) * 24;
+            while(lly < 36)
+                lly += 640;
+
+            QPDFObjectHandle widget = QPDFObjectHandle::newDictionary();
+            widget.replaceKey("/Type", QPDFObjectHandle::newName("/Annot"));
+            widget.replaceKey("/Subtype", QPDFObjectHandle::newName("/Widget"));
+            widget.replaceKey("/F", QPDFObjectHandle::newInteger(4));
+            widget.replaceKey("/P", page);
+            widget.replaceKey("/T", QPDFObjectHandle::newString("w" + number(widget_number)));
+
+            //pick the kind deterministically from the mix
+            int slot = widget_number % total_weight;
+            if(slot < params.text_weight)
+            {
+                std::string value = params.shared ? "N/A" : "Value " + number(widget_number);
+                widget.replaceKey("/Rect", rectangle(llx, lly, llx + 150, lly + 16));
+                widget.replaceKey("/FT", QPDFObjectHandle::newName("/Tx"));
+                widget.replaceKey("/DA", QPDFObjectHandle::newString("/Helv 10 Tf 0 g"));
+                widget.replaceKey("/V", QPDFObjectHandle::newString(value));
+                if(!params.need_appearances)
+                {
+                    QPDFObjectHandle appearance = params.shared ? shared_text :
+                        formXObject(pdf, textAppearance(value), 150, 16, default_resources);
+                    QPDFObjectHandle ap = QPDFObjectHandle::newDictionary();
+                    ap.replaceKey("/N", appearance);
+                    widget.replaceKey("/AP", ap);
+                }
+            }
+            else
+            {
+                bool radio = slot >= params.text_weight + params.checkbox_weight;
+                std::string on_state = radio ? "/Choice" + number(w % 4) : "/Yes";
+                bool checked = (widget_number % 2) == 0;
+
+                widget.replaceKey("/Rect", rectangle(llx, lly, llx + 14, lly + 14));
+                widget.replaceKey("/FT", QPDFObjectHandle::newName("/Btn"));
+                if(radio)
+                    widget.replaceKey("/Ff", QPDFObjectHandle::newInteger(1 << 15));
+                widget.replaceKey("/V", QPDFObjectHandle::newName(checked ? on_state : "/Off"));
+                widget.replaceKey("/AS", QPDFObjectHandle::newName(checked ? on_state : "/Off"));
+
+                QPDFObjectHandle on = params.shared ? shared_on :
+                    formXObject(pdf, "q BT /ZaDb 10 Tf 2 3 Td (4) Tj ET Q\n", 14, 14, default_resources);
+                QPDFObjectHandle off = params.shared ? shared_off :
+                    formXObject(pdf, "", 14, 14, default_resources);
+                QPDFObjectHandle normal = QPDFObjectHandle::newDictionary();
+                normal.replaceKey(on_state, on);
+                normal.replaceKey("/Off", off);
+                QPDFObjectHandle ap = QPDFObjectHandle::newDictionary();
+                ap.replaceKey("/N", normal);
+                widget.replaceKey("/AP", ap);
+            }
+
+            widget = pdf.makeIndirectObject(widget);
+            annots.appendItem(widget);
+            if(parent.isInitialized())
+            {
+                widget.replaceKey("/Parent", parent);
+                parent.getKey("/Kids").appendItem(widget);
+            }
+            else
+            {
+                fields.appendItem(widget);
+            }
+        }
+
+        page.replaceKey("/Annots", annots);
+        pdf.addPage(page, false);
+    }
+
+    QPDFObjectHandle acroform = QPDFObjectHandle::newDictionary();
+    acroform.replaceKey("/Fields", fields);
+    acroform.replaceKey("/DR", default_resources);
+    acroform.replaceKey("/DA", QPDFObjectHandle::newString("/Helv 0 Tf 0 g"));
+    if(params.need_appearances)
+        acroform.replaceKey("/NeedAppearances", QPDFObjectHandle::newBool(true));
+    pdf.getRoot().replaceKey("/AcroForm", pdf.makeIndirectObject(acroform));
+
+    QPDFWriter w(pdf, output);
+    w.setStaticID(true);
+    w.write();
+
+    return 0;
+}
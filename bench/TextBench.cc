@@ -0,0 +1,123 @@
+//Time the conversion and escaping of field values for generated
+//appearances, the per character work of NeedAppearances documents
+
+#include "../TextEncoding.hh"
+#include "../ContentEmitter.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//One kind of field value, repeated to the requested length
+struct TextCase
+{
+    char const* name;
+    std::string value;
+};
+
+void usage()
+{
+    std::cerr << "Usage: TextBench [options]" << std::endl;
+    std::cerr << "  --length N         bytes per field value (default 200)" << std::endl;
+    std::cerr << "  --values N         field values converted per case (default 200000)" << std::endl;
+    exit(2);
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+std::string repeatTo(std::string const& unit, size_t length, char const* prefix, size_t prefix_len)
+{
+    std::string value(prefix, prefix_len);
+    while(value.size() < length)
+        value += unit;
+    return value;
+}
+
+std::vector<TextCase> makeCases(size_t length)
+{
+    std::string utf16_ascii;
+    std::string utf16_mixed;
+    char const* ascii = "Jane Doe, 42 Main Street ";
+    for(char const* c = ascii; *c != '\0'; ++c)
+    {
+        utf16_ascii += '\0';
+        utf16_ascii += *c;
+    }
+    //Grüße, with an em dash and an emoji as a surrogate pair
+    char const mixed[] = "\0G\0r\0\xfc\0\xdf\0e\x20\x14\xd8\x3d\xde\x00\0 ";
+    utf16_mixed.assign(mixed, sizeof(mixed) - 1);
+
+    std::vector<TextCase> cases;
+    TextCase c;
+    c.name = "ascii";
+    c.value = repeatTo(ascii, length, "", 0);
+    cases.push_back(c);
+    c.name = "pdfdoc-latin";
+    c.value = repeatTo("Caf\xe9 cr\xe8me \x84 \x8d" "fa\xe7" "ade\x8e ", length, "", 0);
+    cases.push_back(c);
+    c.name = "utf16-ascii";
+    c.value = repeatTo(utf16_ascii, length, "\xfe\xff", 2);
+    cases.push_back(c);
+    c.name = "utf16-mixed";
+    c.value = repeatTo(utf16_mixed, length, "\xfe\xff", 2);
+    cases.push_back(c);
+    c.name = "utf8-mixed";
+    c.value = repeatTo("Gr\xc3\xbc\xc3\x9f" "e \xe2\x80\x94 (x) ", length, "\xef\xbb\xbf", 3);
+    cases.push_back(c);
+    c.name = "multiline";
+    c.value = repeatTo("line of a comment field\r\n", length, "", 0);
+    cases.push_back(c);
+    return cases;
+}
+
+int main(int argc, char** argv)
+{
+    size_t length = 200;
+    size_t values = 200000;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "--length" && i + 1 < argc)
+            length = strtoul(argv[++i], NULL, 10);
+        else if(arg == "--values" && i + 1 < argc)
+            values = strtoul(argv[++i], NULL, 10);
+        else
+            usage();
+    }
+    if(length == 0 || values == 0)
+        usage();
+
+    std::vector<TextCase> cases = makeCases(length);
+    std::cout << "{\n  \"cases\": [\n";
+    for(size_t i = 0; i < cases.size(); ++i)
+    {
+        //encode and escape as generateOneAppearance and layoutText do,
+        //one emitter per value
+        size_t checksum = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(size_t v = 0; v < values; ++v)
+        {
+            ContentEmitter emitter;
+            emitter.literal(encodeText(cases[i].value, ENCODING_WIN_ANSI));
+            checksum += emitter.data().size();
+        }
+        double ms = millisecondsSince(start);
+        double megabytes = static_cast<double>(cases[i].value.size()) * values / (1024 * 1024);
+
+        std::cout << "    {\n"
+                  << "      \"name\": \"" << cases[i].name << "\",\n"
+                  << "      \"value_bytes\": " << cases[i].value.size() << ",\n"
+                  << "      \"output_bytes\": " << checksum << ",\n"
+                  << "      \"ms\": " << ms << ",\n"
+                  << "      \"mb_per_s\": " << (ms > 0 ? megabytes * 1000 / ms : 0) << "\n"
+                  << "    }" << (i + 1 < cases.size() ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n}\n";
+    return 0;
+}